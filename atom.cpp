@@ -2,10 +2,14 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <chrono>
 #include <map>
 #include <string>
 #include <vector>
+#include <getopt.h>
 #include <xcb/xcb.h>
+#include "atom_profile.h"
 
 class Atom
 {
@@ -21,17 +25,67 @@ public:
         }
     }
 
-    bool ShowCase(void)
+    bool Connect(void)
     {
+        if (connection) {
+            return !xcb_connection_has_error(connection);
+        }
         connection = xcb_connect(nullptr, &screen_num);
-        if (!connection) {
+        if (xcb_connection_has_error(connection)) {
             fprintf(stderr, "xcb_connect() failed\n");
             return false;
         }
+        return true;
+    }
+
+    // precache the names 'path' lists instead of the built-in list, and record this run's use
+    void SetProfile(const char *path)
+    {
+        profile_path = path;
+        precache_names = AtomProfile::Load(path);
+    }
+
+    // one thread here: each use goes to the profile as it happens
+    void Profile(std::string_view name, bool miss)
+    {
+        if (profile_path.empty()) {
+            return;
+        }
+        profile.Used(name, 1, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - profile_start).count());
+        if (miss) {
+            profile.Miss(name);
+        }
+    }
+
+    bool SaveProfile(void)
+    {
+        if (profile_path.empty()) {
+            return true;
+        }
+        auto misses = profile.LateMisses();
+        printf("\n* Atom profile '%s'\n", profile_path.c_str());
+        printf("  - precached               : %zu\n", precache_names.size());
+        printf("  - missed after startup    : %zu\n", misses.size());
+        for (auto &[name, count] : misses) {
+            printf("    . %-22s: %lu\n", name.c_str(), count);
+        }
+        if (!profile.Save(profile_path.c_str())) {
+            fprintf(stderr, "failed to save atom profile '%s'\n", profile_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool ShowCase(void)
+    {
+        if (!Connect()) {
+            return false;
+        }
 
         if (!PreCache()) {
             return false;
         }
+        profile.Started();
 
         printf("\n* Runtime list\n");
         printf("  - xcb_atom (%3u): '%s'\n", XCB_ATOM_WM_TRANSIENT_FOR, GetName(XCB_ATOM_WM_TRANSIENT_FOR));
@@ -192,16 +246,40 @@ public:
             { "x-special/gnome-copied-files"    },
         };
 
+        // a profile replaces the guess above with the names runs actually used
+        if (!precache_names.empty()) {
+            items.clear();
+            for (auto &name : precache_names) {
+                auto predefined = std::find_if(pre_assign_item.begin(), pre_assign_item.end(), [&](auto &item) {
+                    return name == item.name;
+                });
+                if (predefined == pre_assign_item.end()) {
+                    items.push_back({name.c_str()});
+                }
+            }
+        }
+
+        // names already in the cache (e.g. from Import()) cost no request
         for (auto &item : items) {
+            auto iter = atoms.find(item.name);
+            if (iter != atoms.end()) {
+                item.atom = iter->second;
+                continue;
+            }
             item.cookie = xcb_intern_atom(connection, 0, strlen(item.name), item.name);
         }
 
         for (auto iter = items.begin(); iter != items.end(); iter++) {
+            if (iter->atom != XCB_ATOM_NONE) {
+                continue;
+            }
             auto reply = xcb_intern_atom_reply(connection, iter->cookie, nullptr);
             if (!reply) {
                 fprintf(stderr, "xcb_intern_atom_reply() failed '%s'", iter->name);
                 for (++iter; iter != items.end(); iter++) {
-                    xcb_discard_reply(connection, iter->cookie.sequence);
+                    if (iter->atom == XCB_ATOM_NONE) {
+                        xcb_discard_reply(connection, iter->cookie.sequence);
+                    }
                 }
                 return false;
             }
@@ -223,6 +301,7 @@ public:
     xcb_atom_t Get(const char *name)
     {
         auto iter = atoms.find(name);
+        Profile(name, iter == atoms.end());
         if (iter != atoms.end()) {
             return iter->second;
         }
@@ -245,34 +324,425 @@ public:
     {
         auto iter = atom_names.find(atom);
         if (iter != atom_names.end()) {
+            Profile(iter->second, false);
             return iter->second.c_str();
         }
 
+        xcb_generic_error_t *error = nullptr;
         auto cookie = xcb_get_atom_name(connection, atom);
-        auto reply = xcb_get_atom_name_reply(connection, cookie, nullptr);
+        auto reply = xcb_get_atom_name_reply(connection, cookie, &error);
         if (!reply) {
+            free(error);
             return "Unknown";
         }
 
         atom_names[atom].assign(xcb_get_atom_name_name(reply), xcb_get_atom_name_name_length(reply));
         atoms[atom_names[atom]] = atom;
+        Profile(atom_names[atom], true);
         free(reply);
         return atom_names[atom].c_str();
     }
 
+    /**
+     * Bulk resolve: 'lines' are atom names, or atom ids with 'ids'
+     *
+     *   Resolved once with at most 'window' requests in flight, so libxcb's reply queue and our
+     *   cookies stay bounded however long the list, then again with the caches cleared through
+     *   Get() / GetName(), one blocking round trip each, for comparison.
+     */
+    bool Bulk(const std::vector<std::string> &lines, bool ids, size_t window, FILE *output)
+    {
+        if (!Connect()) {
+            return false;
+        }
+
+        printf("\n* Bulk %s x %zu\n", ids ? "GetAtomName" : "InternAtom", lines.size());
+
+        std::vector<xcb_atom_t> values(lines.size(), XCB_ATOM_NONE);
+        std::vector<std::string> names(lines.size());
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (ids) {
+                values[i] = static_cast<xcb_atom_t>(strtoul(lines[i].c_str(), nullptr, 0));
+            } else {
+                names[i] = lines[i];
+            }
+        }
+
+        size_t failed = 0;
+        auto start = std::chrono::steady_clock::now();
+        if (ids) {
+            Windowed(lines.size(), window,
+                [&](size_t i) {
+                    return xcb_get_atom_name(connection, values[i]);
+                },
+                [&](size_t i, xcb_get_atom_name_cookie_t cookie) {
+                    xcb_generic_error_t *error = nullptr;
+                    auto reply = xcb_get_atom_name_reply(connection, cookie, &error);
+                    if (!reply) {
+                        free(error);
+                        failed++;
+                        return;
+                    }
+                    names[i].assign(xcb_get_atom_name_name(reply), xcb_get_atom_name_name_length(reply));
+                    free(reply);
+                });
+        } else {
+            Windowed(lines.size(), window,
+                [&](size_t i) {
+                    return xcb_intern_atom(connection, 0, names[i].size(), names[i].c_str());
+                },
+                [&](size_t i, xcb_intern_atom_cookie_t cookie) {
+                    xcb_generic_error_t *error = nullptr;
+                    auto reply = xcb_intern_atom_reply(connection, cookie, &error);
+                    if (!reply) {
+                        free(error);
+                        failed++;
+                        return;
+                    }
+                    values[i] = reply->atom;
+                    free(reply);
+                });
+        }
+        auto windowed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        atoms.clear();
+        atom_names.clear();
+        size_t mismatched = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (ids) {
+                auto name = GetName(values[i]);
+                mismatched += !names[i].empty() && names[i] != name;
+            } else {
+                mismatched += values[i] != Get(names[i].c_str());
+            }
+        }
+        auto sequential = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        printf("  - window                  : %zu\n", window);
+        printf("  - failed                  : %zu\n", failed);
+        printf("  - mismatched              : %zu\n", mismatched);
+        printf("  - windowed                : %10.0f names/s\n", lines.size() / windowed);
+        printf("  - sequential Get          : %10.0f names/s\n", lines.size() / sequential);
+        printf("  - speedup                 : %10.1f x\n", sequential / windowed);
+
+        if (output) {
+            std::string out = {};
+            for (size_t i = 0; i < lines.size(); i++) {
+                if (!names[i].empty()) {
+                    out += std::to_string(values[i]) + "\t" + names[i] + "\n";
+                }
+            }
+            fwrite(out.data(), 1, out.size(), output);
+        }
+        return !mismatched;
+    }
+
+    /**
+     * Reads the server's whole atom table
+     *
+     *   GetAtomName for ids 1, 2, 3, ... with at most 'window' in flight. The server hands out
+     *   atom ids densely from 1, so the first BadAtom marks the end of the table: no new ids are
+     *   sent after it and the requests still in flight are drained.
+     */
+    bool Scan(size_t window)
+    {
+        if (!Connect()) {
+            return false;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<xcb_get_atom_name_cookie_t> ring(window);
+        xcb_atom_t next = 1;
+        xcb_atom_t received = 1;
+        bool end = false;
+        while (received < next || !end) {
+            for (; !end && next - received < window; next++) {
+                ring[next % window] = xcb_get_atom_name(connection, next);
+            }
+
+            xcb_generic_error_t *error = nullptr;
+            auto reply = xcb_get_atom_name_reply(connection, ring[received % window], &error);
+            if (reply) {
+                auto &name = atom_names[received];
+                name.assign(xcb_get_atom_name_name(reply), xcb_get_atom_name_name_length(reply));
+                atoms[name] = received;
+                free(reply);
+            } else if (error && error->error_code == XCB_ATOM) {
+                end = true;
+            } else {
+                fprintf(stderr, "xcb_get_atom_name_reply() failed for %u\n", received);
+                free(error);
+                // takes the replies still in flight off libxcb's queue
+                for (received++; received < next; received++) {
+                    xcb_discard_reply(connection, ring[received % window].sequence);
+                }
+                return false;
+            }
+            free(error);
+            received++;
+        }
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        printf("\n* Atom table scan\n");
+        printf("  - window                  : %zu\n", window);
+        printf("  - atoms                   : %zu\n", atom_names.size());
+        printf("  - requests                : %u\n", next - 1);
+        printf("  - elapsed                 : %10.1f ms\n", elapsed * 1000);
+        printf("  - rate                    : %10.0f atoms/s\n", atom_names.size() / elapsed);
+        return true;
+    }
+
+    /**
+     * Atom table file
+     *
+     *   atom_file_header_t, then per atom its id (uint32), name length (uint16) and name, in
+     *   host byte order. Ids are only meaningful for the server instance they came from.
+     */
+    bool Export(const char *path)
+    {
+        std::string out = {};
+        atom_file_header_t header = {};
+        header.count = static_cast<uint32_t>(atom_names.size());
+        out.append(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (auto &[atom, name] : atom_names) {
+            uint16_t len = static_cast<uint16_t>(std::min<size_t>(name.size(), UINT16_MAX));
+            out.append(reinterpret_cast<const char *>(&atom), sizeof(atom));
+            out.append(reinterpret_cast<const char *>(&len), sizeof(len));
+            out.append(name.data(), len);
+        }
+
+        auto fp = fopen(path, "wb");
+        if (!fp) {
+            fprintf(stderr, "cannot open '%s'\n", path);
+            return false;
+        }
+        auto rc = fwrite(out.data(), 1, out.size(), fp) == out.size();
+        rc = !fclose(fp) && rc;
+        printf("  - exported                : %u atoms, %zu bytes to '%s'\n", header.count, out.size(), path);
+        return rc;
+    }
+
+    // loads a table from Export() into the cache; one round trip checks it against the server
+    bool Import(const char *path)
+    {
+        if (!Connect()) {
+            return false;
+        }
+
+        auto fp = fopen(path, "rb");
+        if (!fp) {
+            fprintf(stderr, "cannot open '%s'\n", path);
+            return false;
+        }
+        std::string data = {};
+        char buf[65536];
+        for (size_t bytes; (bytes = fread(buf, 1, sizeof(buf), fp)) > 0;) {
+            data.append(buf, bytes);
+        }
+        fclose(fp);
+
+        atom_file_header_t header = {};
+        if (data.size() < sizeof(header) || memcmp(data.data(), header.magic, sizeof(header.magic))) {
+            fprintf(stderr, "'%s' is not an atom table\n", path);
+            return false;
+        }
+        memcpy(&header, data.data(), sizeof(header));
+
+        size_t offset = sizeof(header);
+        xcb_atom_t last = XCB_ATOM_NONE;
+        for (uint32_t i = 0; i < header.count; i++) {
+            xcb_atom_t atom = XCB_ATOM_NONE;
+            uint16_t len = 0;
+            if (offset + sizeof(atom) + sizeof(len) > data.size()) {
+                break;
+            }
+            memcpy(&atom, data.data() + offset, sizeof(atom));
+            memcpy(&len, data.data() + offset + sizeof(atom), sizeof(len));
+            offset += sizeof(atom) + sizeof(len);
+            if (offset + len > data.size()) {
+                break;
+            }
+            auto &name = atom_names[atom];
+            name.assign(data.data() + offset, len);
+            atoms[name] = atom;
+            offset += len;
+            last = std::max(last, atom);
+        }
+        if (offset != data.size()) {
+            fprintf(stderr, "'%s' is truncated\n", path);
+            return false;
+        }
+
+        printf("\n* Atom table import\n");
+        printf("  - imported                : %u atoms from '%s'\n", header.count, path);
+        if (last != XCB_ATOM_NONE) {
+            auto expected = atom_names[last];
+            atom_names.erase(last);
+            if (expected != GetName(last)) {
+                fprintf(stderr, "'%s' does not match this server (atom %u)\n", path, last);
+                atoms.clear();
+                atom_names.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
 private:
+    struct atom_file_header_t
+    {
+        char                            magic[4]    = {'X', 'A', 'T', 'M'};
+        uint32_t                        version     = 1;
+        uint32_t                        count       = 0;
+    };
+
+    /**
+     * Sends send(i) for every index in order with at most 'window' replies outstanding
+     *
+     *   receive(i, cookie) takes each reply in the order sent; the cookies live in a ring of
+     *   'window' entries, so nothing grows with 'count'.
+     */
+    template <typename Send, typename Receive>
+    static void Windowed(size_t count, size_t window, Send send, Receive receive)
+    {
+        std::vector<decltype(send(0))> ring(window);
+        for (size_t i = 0; i < count; i++) {
+            if (i >= window) {
+                receive(i - window, ring[i % window]);
+            }
+            ring[i % window] = send(i);
+        }
+        for (size_t i = count > window ? count - window : 0; i < count; i++) {
+            receive(i, ring[i % window]);
+        }
+    }
+
     int                                   screen_num  = 0;
     xcb_connection_t                     *connection  = nullptr;
     std::map<std::string, xcb_atom_t>     atoms       = {};
     std::map<xcb_atom_t, std::string>     atom_names  = {};
+    std::string                           profile_path    = {};
+    std::vector<std::string>              precache_names  = {};
+    AtomProfile                           profile         = {};
+    std::chrono::steady_clock::time_point profile_start   = std::chrono::steady_clock::now();
 };
 
+static bool ReadLines(const char *path, std::vector<std::string> &lines)
+{
+    auto fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (!fp) {
+        fprintf(stderr, "cannot open '%s'\n", path);
+        return false;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0]) {
+            lines.push_back(line);
+        }
+    }
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return true;
+}
+
+static void Usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("  -b, --bulk FILE           resolve every atom name in FILE ('-' for stdin), one per line\n");
+    printf("  -I, --ids                 the --bulk lines are atom ids, resolved to names\n");
+    printf("  -w, --window N            at most N requests in flight in --bulk (default: 256)\n");
+    printf("  -o, --output FILE         write the resolved 'atom<TAB>name' table to FILE\n");
+    printf("  -s, --scan                read the server's whole atom table, --window requests in flight\n");
+    printf("  -e, --export FILE         write the atom table read by --scan to FILE\n");
+    printf("  -i, --import FILE         load an exported atom table into the cache before the showcase\n");
+    printf("  -A, --atom-profile FILE   precache the atoms FILE lists and merge this run's atom use into it\n");
+    printf("  -h, --help                show this help\n");
+}
+
 int main(int argc, char **argv)
 { 
+    static const struct option options[] = {
+        { "bulk",           required_argument,  nullptr, 'b' },
+        { "ids",            no_argument,        nullptr, 'I' },
+        { "window",         required_argument,  nullptr, 'w' },
+        { "output",         required_argument,  nullptr, 'o' },
+        { "scan",           no_argument,        nullptr, 's' },
+        { "export",         required_argument,  nullptr, 'e' },
+        { "import",         required_argument,  nullptr, 'i' },
+        { "atom-profile",   required_argument,  nullptr, 'A' },
+        { "help",           no_argument,        nullptr, 'h' },
+        { nullptr,          0,                  nullptr,  0  },
+    };
+
+    const char *bulk_path = nullptr;
+    const char *output_path = nullptr;
+    const char *export_path = nullptr;
+    const char *import_path = nullptr;
+    const char *profile_path = nullptr;
+    bool ids = false;
+    bool scan = false;
+    size_t window = 256;
+    for (int opt; (opt = getopt_long(argc, argv, "b:Iw:o:se:i:A:h", options, nullptr)) != -1;) {
+        switch (opt) {
+            case 'b':
+                bulk_path = optarg;
+                break;
+            case 'I':
+                ids = true;
+                break;
+            case 'w':
+                window = std::max<size_t>(strtoul(optarg, nullptr, 0), 1);
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            case 's':
+                scan = true;
+                break;
+            case 'e':
+                export_path = optarg;
+                break;
+            case 'i':
+                import_path = optarg;
+                break;
+            case 'A':
+                profile_path = optarg;
+                break;
+            case 'h':
+                Usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                Usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
     printf("Example xcb_atom\n");
 
     auto obj = Atom();
-    if (!obj.ShowCase()) {
+    if (profile_path) {
+        obj.SetProfile(profile_path);
+    }
+    auto rc = false;
+    if (bulk_path) {
+        std::vector<std::string> lines = {};
+        FILE *output = nullptr;
+        if (ReadLines(bulk_path, lines) && (!output_path || (output = fopen(output_path, "w")))) {
+            rc = obj.Bulk(lines, ids, window, output);
+        }
+        if (output) {
+            fclose(output);
+        }
+    } else if (scan) {
+        rc = obj.Scan(window) && (!export_path || obj.Export(export_path));
+    } else {
+        rc = (!import_path || obj.Import(import_path)) && obj.ShowCase();
+    }
+    rc = obj.SaveProfile() && rc;
+    if (!rc) {
         printf("\nFailed..\n");
         return EXIT_FAILURE;
     }
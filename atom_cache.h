@@ -0,0 +1,401 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <xcb/xcb.h>
+
+/**
+ * Atom cache shared by threads, lock-free to read
+ *
+ *   - entries and their names are allocated once and never move or get freed before the cache,
+ *     so a returned name stays valid without a lock or a copy
+ *   - lookups probe two open-addressing tables (by name, by atom) of atomic entry pointers;
+ *     an entry is complete before the release store that publishes it
+ *   - inserts are serialized by a mutex; when the tables get half full, bigger ones are built
+ *     and published with one pointer swap, and the old ones are kept until the cache is
+ *     destroyed, so a reader still probing them is never left with freed memory
+ *   - a miss sends one request per name or atom: threads that miss on the same key while its
+ *     request is in flight wait for that reply instead of sending their own
+ *   - with CountUses(), Get() and GetName() also count uses in the entry they return, with
+ *     relaxed atomics, for an atom profile to read once at exit
+ */
+
+class AtomCache
+{
+public:
+    static constexpr size_t     INITIAL_SLOTS   = 256;
+    static constexpr size_t     BLOCK_SIZE      = 16 * 1024;    // name storage
+
+    AtomCache(void)
+    {
+        tables.push_back(std::make_unique<table_t>(INITIAL_SLOTS));
+        current.store(tables.back().get(), std::memory_order_release);
+    }
+
+    void SetConnection(xcb_connection_t *connection)
+    {
+        this->connection = connection;
+    }
+
+    // from here on Get(), GetName() and FindUsed() count uses; first uses are timed from now
+    void CountUses(void)
+    {
+        count_start = std::chrono::steady_clock::now();
+        counting.store(true, std::memory_order_release);
+    }
+
+    // XCB_ATOM_NONE if not cached; never sends a request
+    xcb_atom_t Find(std::string_view name) const
+    {
+        auto entry = FindEntry(current.load(std::memory_order_acquire), name, Hash(name));
+        return entry ? entry->atom : static_cast<xcb_atom_t>(XCB_ATOM_NONE);
+    }
+
+    // same as Find(), counted as a use
+    xcb_atom_t FindUsed(std::string_view name) const
+    {
+        auto entry = Used(FindEntry(current.load(std::memory_order_acquire), name, Hash(name)));
+        return entry ? entry->atom : static_cast<xcb_atom_t>(XCB_ATOM_NONE);
+    }
+
+    // nullptr if not cached; never sends a request
+    const char *FindName(xcb_atom_t atom) const
+    {
+        auto entry = FindEntry(current.load(std::memory_order_acquire), atom);
+        return entry ? entry->name : nullptr;
+    }
+
+    // adds a pair resolved elsewhere (e.g. by a batch); returns the cached name
+    const char *Insert(std::string_view name, xcb_atom_t atom)
+    {
+        std::lock_guard<std::mutex> guard(write_lock);
+        auto table = current.load(std::memory_order_relaxed);
+        auto hash = Hash(name);
+        if (auto entry = FindEntry(table, name, hash)) {
+            return entry->name;
+        }
+
+        auto &entry = entries.emplace_back();
+        entry.atom = atom;
+        entry.hash = hash;
+        entry.len  = static_cast<uint32_t>(name.size());
+        entry.name = Store(name);
+
+        if ((entries.size() + 1) * 2 > table->slots) {
+            table = Grow(table);
+        } else {
+            Place(table, &entry);
+        }
+        return entry.name;
+    }
+
+    /**
+     * The atom for 'name', interned on a miss
+     *
+     *   XCB_ATOM_NONE if the request failed. 'miss' tells whether this call waited for a reply,
+     *   its own or one another thread had in flight.
+     */
+    xcb_atom_t Get(std::string_view name, bool *miss = nullptr)
+    {
+        if (miss) {
+            *miss = false;
+        }
+        if (auto atom = FindUsed(name)) {
+            return atom;
+        }
+        if (miss) {
+            *miss = true;
+        }
+
+        std::unique_lock<std::mutex> guard(miss_lock);
+        if (auto atom = FindUsed(name)) {
+            return atom;
+        }
+        auto iter = pending_names.find(name);
+        if (iter != pending_names.end()) {
+            auto pending = iter->second;
+            miss_cond.wait(guard, [&] { return pending->done; });
+            guard.unlock();
+            return pending->atom ? FindUsed(name) : pending->atom;
+        }
+
+        auto pending = std::make_shared<pending_t>();
+        auto key = pending_names.emplace(std::string(name), pending).first;
+        guard.unlock();
+
+        if (connection) {
+            requests++;
+            auto cookie = xcb_intern_atom(connection, 0, name.size(), name.data());
+            xcb_generic_error_t *error = nullptr;
+            auto reply = xcb_intern_atom_reply(connection, cookie, &error);
+            if (reply) {
+                pending->atom = reply->atom;
+                Insert(name, reply->atom);
+                free(reply);
+            }
+            free(error);
+        }
+
+        guard.lock();
+        pending->done = true;
+        pending_names.erase(key);
+        miss_cond.notify_all();
+        guard.unlock();
+        return pending->atom ? FindUsed(name) : pending->atom;
+    }
+
+    // the name of 'atom', fetched on a miss; nullptr if the server does not know it
+    const char *GetName(xcb_atom_t atom, bool *miss = nullptr)
+    {
+        if (miss) {
+            *miss = false;
+        }
+        if (auto name = FindNameUsed(atom)) {
+            return name;
+        }
+        if (miss) {
+            *miss = true;
+        }
+
+        std::unique_lock<std::mutex> guard(miss_lock);
+        if (auto name = FindNameUsed(atom)) {
+            return name;
+        }
+        auto iter = pending_atoms.find(atom);
+        if (iter != pending_atoms.end()) {
+            auto pending = iter->second;
+            miss_cond.wait(guard, [&] { return pending->done; });
+            guard.unlock();
+            return pending->name ? FindNameUsed(atom) : pending->name;
+        }
+
+        auto pending = std::make_shared<pending_t>();
+        auto key = pending_atoms.emplace(atom, pending).first;
+        guard.unlock();
+
+        if (connection) {
+            requests++;
+            auto cookie = xcb_get_atom_name(connection, atom);
+            xcb_generic_error_t *error = nullptr;
+            auto reply = xcb_get_atom_name_reply(connection, cookie, &error);
+            if (reply) {
+                pending->name = Insert({xcb_get_atom_name_name(reply), static_cast<size_t>(xcb_get_atom_name_name_length(reply))}, atom);
+                free(reply);
+            }
+            free(error);
+        }
+
+        guard.lock();
+        pending->done = true;
+        pending_atoms.erase(key);
+        miss_cond.notify_all();
+        guard.unlock();
+        return pending->name ? FindNameUsed(atom) : pending->name;
+    }
+
+    size_t Size(void) const
+    {
+        std::lock_guard<std::mutex> guard(write_lock);
+        return entries.size();
+    }
+
+    // every cached (name, atom) in insertion order; inserts wait meanwhile
+    template <typename Fn>
+    void ForEach(Fn &&fn) const
+    {
+        std::lock_guard<std::mutex> guard(write_lock);
+        for (auto &entry : entries) {
+            fn(std::string_view(entry.name, entry.len), entry.atom);
+        }
+    }
+
+    // (name, uses, first use ms) of every cached entry, unused ones with 0 uses; inserts wait meanwhile
+    template <typename Fn>
+    void ForEachUse(Fn &&fn) const
+    {
+        std::lock_guard<std::mutex> guard(write_lock);
+        for (auto &entry : entries) {
+            fn(std::string_view(entry.name, entry.len), entry.uses.load(std::memory_order_relaxed),
+               entry.first_use_us.load(std::memory_order_relaxed) / 1000.0);
+        }
+    }
+
+    // requests sent for misses so far
+    uint64_t Requests(void) const
+    {
+        return requests.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct entry_t
+    {
+        xcb_atom_t              atom    = XCB_ATOM_NONE;
+        uint32_t                len     = 0;
+        uint64_t                hash    = 0;
+        const char             *name    = nullptr;
+        mutable std::atomic<uint64_t> uses = 0;             // while counting
+        mutable std::atomic<uint64_t> first_use_us = 0;     // since CountUses(), 0 before the first use
+    };
+
+    struct table_t
+    {
+        explicit table_t(size_t slots) : slots(slots),
+            by_name(std::make_unique<std::atomic<const entry_t *>[]>(slots)),
+            by_atom(std::make_unique<std::atomic<const entry_t *>[]>(slots))
+        {
+        }
+
+        size_t                                          slots   = 0;    // a power of two
+        std::unique_ptr<std::atomic<const entry_t *>[]> by_name = {};
+        std::unique_ptr<std::atomic<const entry_t *>[]> by_atom = {};
+    };
+
+    struct pending_t
+    {
+        bool                    done    = false;
+        xcb_atom_t              atom    = XCB_ATOM_NONE;
+        const char             *name    = nullptr;
+    };
+
+    // FNV-1a
+    static uint64_t Hash(std::string_view name)
+    {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (auto c : name) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    static uint64_t Hash(xcb_atom_t atom)
+    {
+        return atom * 0x9E3779B97F4A7C15ULL >> 16;
+    }
+
+    // counts a use of 'entry', if any and if counting
+    const entry_t *Used(const entry_t *entry) const
+    {
+        if (entry && counting.load(std::memory_order_relaxed)) {
+            if (!entry->uses.fetch_add(1, std::memory_order_relaxed)) {
+                auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - count_start).count();
+                entry->first_use_us.store(std::max<uint64_t>(1, us), std::memory_order_relaxed);
+            }
+        }
+        return entry;
+    }
+
+    const char *FindNameUsed(xcb_atom_t atom) const
+    {
+        auto entry = Used(FindEntry(current.load(std::memory_order_acquire), atom));
+        return entry ? entry->name : nullptr;
+    }
+
+    static const entry_t *FindEntry(const table_t *table, std::string_view name, uint64_t hash)
+    {
+        auto mask = table->slots - 1;
+        for (auto slot = hash & mask;; slot = (slot + 1) & mask) {
+            auto entry = table->by_name[slot].load(std::memory_order_acquire);
+            if (!entry) {
+                return nullptr;
+            }
+            if (entry->hash == hash && entry->len == name.size() && !memcmp(entry->name, name.data(), name.size())) {
+                return entry;
+            }
+        }
+    }
+
+    static const entry_t *FindEntry(const table_t *table, xcb_atom_t atom)
+    {
+        auto mask = table->slots - 1;
+        for (auto slot = Hash(atom) & mask;; slot = (slot + 1) & mask) {
+            auto entry = table->by_atom[slot].load(std::memory_order_acquire);
+            if (!entry) {
+                return nullptr;
+            }
+            if (entry->atom == atom) {
+                return entry;
+            }
+        }
+    }
+
+    // write_lock held; an atom already cached under another name keeps its first name
+    static void Place(const table_t *table, const entry_t *entry)
+    {
+        auto mask = table->slots - 1;
+        auto slot = entry->hash & mask;
+        while (table->by_name[slot].load(std::memory_order_relaxed)) {
+            slot = (slot + 1) & mask;
+        }
+        table->by_name[slot].store(entry, std::memory_order_release);
+
+        if (FindEntry(table, entry->atom)) {
+            return;
+        }
+        slot = Hash(entry->atom) & mask;
+        while (table->by_atom[slot].load(std::memory_order_relaxed)) {
+            slot = (slot + 1) & mask;
+        }
+        table->by_atom[slot].store(entry, std::memory_order_release);
+    }
+
+    // write_lock held; every entry, including the newest, goes into the new tables
+    table_t *Grow(const table_t *table)
+    {
+        tables.push_back(std::make_unique<table_t>(table->slots * 2));
+        auto grown = tables.back().get();
+        for (auto &entry : entries) {
+            Place(grown, &entry);
+        }
+        current.store(grown, std::memory_order_release);
+        return grown;
+    }
+
+    // write_lock held; NUL-terminated and never moved
+    const char *Store(std::string_view name)
+    {
+        auto size = name.size() + 1;
+        if (size > BLOCK_SIZE) {
+            blocks.push_back(std::make_unique<char[]>(size));
+            block_used = BLOCK_SIZE;
+            memcpy(blocks.back().get(), name.data(), name.size());
+            blocks.back()[name.size()] = '\0';
+            return blocks.back().get();
+        }
+        if (blocks.empty() || block_used + size > BLOCK_SIZE) {
+            blocks.push_back(std::make_unique<char[]>(BLOCK_SIZE));
+            block_used = 0;
+        }
+        auto ptr = blocks.back().get() + block_used;
+        memcpy(ptr, name.data(), name.size());
+        ptr[name.size()] = '\0';
+        block_used += size;
+        return ptr;
+    }
+
+    xcb_connection_t                                   *connection      = nullptr;
+    std::atomic<const table_t *>                        current         = nullptr;
+    std::atomic<uint64_t>                               requests        = 0;
+    std::atomic<bool>                                   counting        = false;
+    std::chrono::steady_clock::time_point               count_start     = {};
+
+    mutable std::mutex                                  write_lock      = {};
+    std::vector<std::unique_ptr<table_t>>               tables          = {};
+    std::deque<entry_t>                                 entries         = {};
+    std::vector<std::unique_ptr<char[]>>                blocks          = {};
+    size_t                                              block_used      = 0;
+
+    std::mutex                                          miss_lock       = {};
+    std::condition_variable                             miss_cond       = {};
+    std::map<std::string, std::shared_ptr<pending_t>, std::less<>> pending_names = {};
+    std::map<xcb_atom_t, std::shared_ptr<pending_t>>    pending_atoms   = {};
+};
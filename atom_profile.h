@@ -0,0 +1,189 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Which atoms a run actually uses, saved as the precache list of the next run
+ *
+ *   Uses are counted by the atom cache itself, lock-free (AtomCache::CountUses()), and handed
+ *   over once at exit with Used(); only misses, one round trip each, come here as they happen.
+ *   A miss after Started() means the precache list lacked that name and is reported.
+ *
+ *   The profile is a text file, one atom per line in first-use order
+ *
+ *       <first use ms> <count> <idle runs> <name>
+ *
+ *   Load() reads it so startup can intern every name in one pipelined batch, and Save() merges
+ *   this run into it: counts are halved every run, so old use fades, and a name no run has used
+ *   for MAX_IDLE_RUNS runs is dropped.
+ */
+
+class AtomProfile
+{
+public:
+    static constexpr uint32_t   MAX_IDLE_RUNS   = 8;
+
+    struct entry_t
+    {
+        uint64_t                count           = 0;
+        double                  first_use_ms    = 0;
+        uint32_t                idle_runs       = 0;    // runs in a row that did not use it
+        uint64_t                late_misses     = 0;    // misses after Started()
+    };
+
+    AtomProfile(void)
+    {
+    }
+
+    // the names of a saved profile, in first-use order; an absent file is an empty profile
+    static std::vector<std::string> Load(const char *path)
+    {
+        std::vector<std::string> names = {};
+        for (auto &[name, entry] : Sorted(Read(path))) {
+            names.push_back(name);
+        }
+        return names;
+    }
+
+    // true for a miss after Started(), which the caller may want to report right away
+    bool Miss(std::string_view name)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!started) {
+            return false;
+        }
+        auto iter = entries.find(name);
+        if (iter == entries.end()) {
+            iter = entries.emplace(name, entry_t{}).first;
+        }
+        iter->second.late_misses++;
+        return true;
+    }
+
+    // this run's use of 'name', e.g. as the atom cache counted it; the first call sets the first use
+    void Used(std::string_view name, uint64_t count, double first_use_ms)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto iter = entries.find(name);
+        if (iter == entries.end()) {
+            iter = entries.emplace(name, entry_t{}).first;
+        }
+        if (!iter->second.count) {
+            iter->second.first_use_ms = first_use_ms;
+        }
+        iter->second.count += count;
+    }
+
+    // end of startup: misses from here on were not precached
+    void Started(void)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        started = true;
+    }
+
+    // names missed after startup, with how often
+    std::vector<std::pair<std::string, uint64_t>> LateMisses(void) const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<std::pair<std::string, uint64_t>> misses = {};
+        for (auto &[name, entry] : entries) {
+            if (entry.late_misses) {
+                misses.push_back({name, entry.late_misses});
+            }
+        }
+        return misses;
+    }
+
+    // merges this run into the profile at 'path', ageing what it did not use
+    bool Save(const char *path) const
+    {
+        auto merged = Read(path);
+        for (auto &[name, entry] : merged) {
+            entry.count /= 2;
+            entry.idle_runs++;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (auto &[name, entry] : entries) {
+                if (!entry.count) {
+                    continue;
+                }
+                // this run's first use: the order of the next startup batch follows the latest run
+                auto &saved = merged[name];
+                saved.count += entry.count;
+                saved.first_use_ms = entry.first_use_ms;
+                saved.idle_runs = 0;
+            }
+        }
+        for (auto iter = merged.begin(); iter != merged.end();) {
+            iter = iter->second.idle_runs >= MAX_IDLE_RUNS ? merged.erase(iter) : std::next(iter);
+        }
+
+        std::string out = "# atom profile: <first use ms> <count> <idle runs> <name>\n";
+        char buf[64];
+        for (auto &[name, entry] : Sorted(merged)) {
+            snprintf(buf, sizeof(buf), "%.3f %lu %u ", entry.first_use_ms, entry.count, entry.idle_runs);
+            out += buf;
+            out += name;
+            out += '\n';
+        }
+
+        auto fp = fopen(path, "w");
+        if (!fp) {
+            return false;
+        }
+        auto rc = fwrite(out.data(), 1, out.size(), fp) == out.size();
+        return !fclose(fp) && rc;
+    }
+
+private:
+    using entries_t = std::map<std::string, entry_t, std::less<>>;
+
+    static entries_t Read(const char *path)
+    {
+        entries_t entries = {};
+        auto fp = fopen(path, "r");
+        if (!fp) {
+            return entries;
+        }
+        char line[1024];
+        while (fgets(line, sizeof(line), fp)) {
+            if (line[0] == '#') {
+                continue;
+            }
+            entry_t entry = {};
+            int name_offset = 0;
+            if (sscanf(line, "%lf %lu %u %n", &entry.first_use_ms, &entry.count, &entry.idle_runs, &name_offset) != 3 || !name_offset) {
+                continue;
+            }
+            std::string name(line + name_offset);
+            while (!name.empty() && (name.back() == '\n' || name.back() == '\r')) {
+                name.pop_back();
+            }
+            if (!name.empty()) {
+                entries[name] = entry;
+            }
+        }
+        fclose(fp);
+        return entries;
+    }
+
+    static std::vector<std::pair<std::string, entry_t>> Sorted(const entries_t &entries)
+    {
+        std::vector<std::pair<std::string, entry_t>> sorted(entries.begin(), entries.end());
+        std::stable_sort(sorted.begin(), sorted.end(), [](auto &a, auto &b) {
+            return a.second.first_use_ms < b.second.first_use_ms;
+        });
+        return sorted;
+    }
+
+    mutable std::mutex                          lock        = {};
+    entries_t                                   entries     = {};
+    bool                                        started     = false;
+};
@@ -0,0 +1,196 @@
+#include "config.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <xcb/xcb.h>
+#include "atom_cache.h"
+
+/**
+ * Atom cache read throughput by thread count
+ *
+ *   Both caches are filled with the same names up front, no X server involved, then 1, 2, 4 ..
+ *   hardware_concurrency() threads look names up for a fixed time
+ *     - AtomCache Find() / FindName() : lock-free probe of the published tables
+ *     - std::map + std::mutex         : the per-lookup lock a shared std::map needs
+ *   and the total lookups/s is printed for each, so scaling shows directly.
+ *
+ *   With $DISPLAY, every thread then asks for the same not yet cached name at once, and the
+ *   number of InternAtom requests that took is printed: 1 when misses are coalesced.
+ */
+
+class BenchAtoms
+{
+public:
+    static constexpr size_t     NAMES           = 4096;
+
+    BenchAtoms(void)
+    {
+        for (size_t i = 0; i < NAMES; i++) {
+            names.push_back("XCB_BENCH_ATOM_" + std::to_string(i));
+            auto atom = static_cast<xcb_atom_t>(1000 + i);
+            cache.Insert(names.back(), atom);
+            locked_atoms[names.back()] = atom;
+            locked_names[atom] = names.back();
+        }
+    }
+
+    bool Run(double seconds)
+    {
+        auto cores = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<unsigned> counts;
+        for (unsigned count = 1; count < cores; count *= 2) {
+            counts.push_back(count);
+        }
+        counts.push_back(cores);
+
+        struct workload_t
+        {
+            const char             *name;
+            std::function<bool(BenchAtoms &, size_t)> lookup;
+        };
+        const workload_t workloads[] = {
+            {"AtomCache Find",        [](BenchAtoms &obj, size_t i) { return obj.cache.Find(obj.names[i]) != XCB_ATOM_NONE; }},
+            {"AtomCache FindName",    [](BenchAtoms &obj, size_t i) { return obj.cache.FindName(1000 + i) != nullptr; }},
+            {"std::map + mutex name", [](BenchAtoms &obj, size_t i) { return obj.LockedFind(obj.names[i]) != XCB_ATOM_NONE; }},
+            {"std::map + mutex atom", [](BenchAtoms &obj, size_t i) { return obj.LockedFindName(1000 + i) != nullptr; }},
+        };
+
+        printf("\n* lookups of %zu cached names, %.1f s per run\n", NAMES, seconds);
+        for (auto &workload : workloads) {
+            double single = 0;
+            for (auto count : counts) {
+                auto rate = Measure(count, seconds, workload.lookup);
+                if (rate < 0) {
+                    fprintf(stderr, "%s: lookup missed a cached entry\n", workload.name);
+                    return false;
+                }
+                if (count == 1) {
+                    single = rate;
+                }
+                printf(" - %-22s %3u threads: %12.0f lookups/s, x%.2f\n", workload.name, count, rate, single ? rate / single : 0.0);
+            }
+        }
+
+        Coalesce(cores);
+        return true;
+    }
+
+private:
+    // total lookups/s over all threads; negative if one failed
+    double Measure(unsigned count, double seconds, const std::function<bool(BenchAtoms &, size_t)> &lookup)
+    {
+        std::atomic<bool> stop = false;
+        std::atomic<bool> failed = false;
+        std::atomic<uint64_t> total = 0;
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < count; t++) {
+            threads.emplace_back([&, t] {
+                uint64_t done = 0;
+                size_t i = t * 977 % NAMES;
+                while (!stop.load(std::memory_order_relaxed)) {
+                    for (int n = 0; n < 1024; n++) {
+                        if (!lookup(*this, i)) {
+                            failed = true;
+                        }
+                        i = (i + 1) & (NAMES - 1);
+                    }
+                    done += 1024;
+                }
+                total += done;
+            });
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        stop = true;
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return failed ? -1 : total / elapsed;
+    }
+
+    // every thread misses on one name at the same time
+    void Coalesce(unsigned count)
+    {
+        auto connection = xcb_connect(nullptr, nullptr);
+        if (xcb_connection_has_error(connection)) {
+            printf("\n* coalesced misses: skipped, no X server\n");
+            xcb_disconnect(connection);
+            return;
+        }
+
+        AtomCache shared;
+        shared.SetConnection(connection);
+        auto name = "XCB_BENCH_ATOMS_" + std::to_string(getpid());
+        std::atomic<unsigned> ready = 0;
+        std::atomic<unsigned> waited = 0;
+        std::vector<xcb_atom_t> results(count);
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < count; t++) {
+            threads.emplace_back([&, t] {
+                ready++;
+                while (ready < count) {
+                }
+                bool miss = false;
+                results[t] = shared.Get(name, &miss);
+                waited += miss;
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+
+        bool same = true;
+        for (auto atom : results) {
+            same = same && atom == results[0] && atom != XCB_ATOM_NONE;
+        }
+        printf("\n* coalesced misses\n");
+        printf(" - %u threads, %u waited for a reply: %llu request(s), %s atom\n", count, waited.load(),
+            static_cast<unsigned long long>(shared.Requests()), same ? "same" : "different");
+        xcb_disconnect(connection);
+    }
+
+    xcb_atom_t LockedFind(const std::string &name)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto iter = locked_atoms.find(name);
+        return iter != locked_atoms.end() ? iter->second : static_cast<xcb_atom_t>(XCB_ATOM_NONE);
+    }
+
+    const char *LockedFindName(xcb_atom_t atom)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto iter = locked_names.find(atom);
+        return iter != locked_names.end() ? iter->second.c_str() : nullptr;
+    }
+
+    std::vector<std::string>                names           = {};
+    AtomCache                               cache;
+    std::mutex                              lock            = {};
+    std::map<std::string, xcb_atom_t>       locked_atoms    = {};
+    std::map<xcb_atom_t, std::string>       locked_names    = {};
+};
+
+int main(int argc, char **argv)
+{
+    printf("Benchmark atom cache\n");
+
+    double seconds = argc > 1 ? strtod(argv[1], nullptr) : 1.0;
+    auto obj = BenchAtoms();
+    if (!obj.Run(seconds)) {
+        printf("\nFailed..\n");
+        return EXIT_FAILURE;
+    }
+    printf("\nSucceed..\n");
+    return EXIT_SUCCESS;
+}
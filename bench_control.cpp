@@ -0,0 +1,155 @@
+#include "config.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <xcb/xcb.h>
+#include "control_socket.h"
+
+/**
+ * Setting and reading the clipboard: control socket vs a new X client per copy
+ *
+ *   Needs xcb_selection running with '--control <socket>'. Over one connection, each request
+ *   is timed from send to reply
+ *     - status
+ *     - set / get of a short text, carried in the message
+ *     - set / get of 4 MiB, passed as a memfd both ways
+ *   and every get must return what the set before it stored.
+ *
+ *   With $DISPLAY, the same set is also done the way a one-shot tool does it: connect, intern
+ *   CLIPBOARD, create a window, take ownership, disconnect. Process start-up is not included,
+ *   so this is a lower bound for spawning one. It runs last, as it takes CLIPBOARD away.
+ */
+
+class BenchControl
+{
+public:
+    static constexpr size_t     LARGE_SIZE      = 4 * 1024 * 1024;
+
+    BenchControl(const char *path) : path(path)
+    {
+    }
+
+    ~BenchControl(void)
+    {
+        if (sock >= 0) {
+            close(sock);
+        }
+    }
+
+    bool Run(size_t count)
+    {
+        sock = ControlSocket::Connect(path);
+        if (sock < 0) {
+            fprintf(stderr, "cannot connect to '%s' (err: '%s')\n", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        std::string small = "Copy & Paste test";
+        std::string large(LARGE_SIZE, '\0');
+        for (size_t i = 0; i < large.size(); i++) {
+            large[i] = static_cast<char>('a' + i % 26);
+        }
+
+        printf("\n* %zu requests each, one connection to '%s'\n", count, path.c_str());
+        auto rc = Measure("status", count, [this] { return Call("status", {}, nullptr); });
+        rc = rc && Measure("set 17 B", count, [this, &small] { return Call("set UTF8_STRING text/plain", small, nullptr); });
+        rc = rc && Measure("get 17 B", count, [this, &small] { return Call("get UTF8_STRING", {}, &small); });
+        auto large_count = std::max<size_t>(1, count / 100);
+        rc = rc && Measure("set 4 MiB", large_count, [this, &large] { return Call("set UTF8_STRING", large, nullptr); });
+        rc = rc && Measure("get 4 MiB", large_count, [this, &large] { return Call("get UTF8_STRING", {}, &large); });
+        if (!rc) {
+            return false;
+        }
+
+        if (!getenv("DISPLAY")) {
+            printf("\n* $DISPLAY is not set, no X client baseline\n");
+            return true;
+        }
+        printf("\n* new X client per set, without process start-up\n");
+        return Measure("connect+own", std::max<size_t>(1, count / 10), [] { return OwnOnce(); });
+    }
+
+private:
+    // false if the request failed or 'expect' does not match what came back
+    bool Call(const char *line, std::string_view content, const std::string *expect)
+    {
+        if (!ControlSocket::Call(sock, line, content, reply, reply_content)) {
+            fprintf(stderr, "'%s' failed: '%s'\n", line, reply.c_str());
+            return false;
+        }
+        if (expect && reply_content != *expect) {
+            fprintf(stderr, "'%s' returned %zu bytes, not the %zu set\n", line, reply_content.size(), expect->size());
+            return false;
+        }
+        return true;
+    }
+
+    static bool OwnOnce(void)
+    {
+        int screen_num = 0;
+        auto connection = xcb_connect(nullptr, &screen_num);
+        if (xcb_connection_has_error(connection)) {
+            xcb_disconnect(connection);
+            return false;
+        }
+        auto screen = xcb_setup_roots_iterator(xcb_get_setup(connection)).data;
+        auto atom_cookie = xcb_intern_atom(connection, 0, strlen("CLIPBOARD"), "CLIPBOARD");
+        auto window = xcb_generate_id(connection);
+        xcb_create_window(connection, XCB_COPY_FROM_PARENT, window, screen->root, 0, 0, 1, 1, 0,
+            XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0, nullptr);
+        auto reply = xcb_intern_atom_reply(connection, atom_cookie, nullptr);
+        auto rc = reply != nullptr;
+        if (reply) {
+            auto error = xcb_request_check(connection, xcb_set_selection_owner_checked(connection, window, reply->atom, XCB_CURRENT_TIME));
+            rc = !error;
+            free(error);
+            free(reply);
+        }
+        xcb_disconnect(connection);
+        return rc;
+    }
+
+    bool Measure(const char *name, size_t count, const std::function<bool(void)> &call)
+    {
+        std::vector<double> us(count);
+        for (size_t i = 0; i < count; i++) {
+            auto begin = std::chrono::steady_clock::now();
+            if (!call()) {
+                return false;
+            }
+            us[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+        }
+        std::sort(us.begin(), us.end());
+        printf(" - %-12s : p50 %9.1f us, p99 %9.1f us, max %9.1f us\n", name, us[us.size() / 2], us[us.size() * 99 / 100], us.back());
+        return true;
+    }
+
+    std::string                                 path            = {};
+    int                                         sock            = -1;
+    std::string                                 reply           = {};
+    std::string                                 reply_content   = {};
+};
+
+int main(int argc, char **argv)
+{
+    printf("Benchmark control socket\n");
+
+    if (argc < 2) {
+        printf("Usage: %s <socket> [requests]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    size_t count = argc > 2 ? strtoul(argv[2], nullptr, 0) : 1000;
+    auto obj = BenchControl(argv[1]);
+    if (!obj.Run(std::max<size_t>(1, count))) {
+        printf("\nFailed..\n");
+        return EXIT_FAILURE;
+    }
+    printf("\nSucceed..\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,212 @@
+#include "config.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#include "event_dispatch.h"
+
+/**
+ * Event dispatch cost: switch vs EventDispatcher
+ *
+ *   No X server involved. A stream of synthetic events in the mix xcb_selection sees (mostly
+ *   selection requests and property notifies, some errors, button presses and events nobody
+ *   handles) plus one extension event numbered from a first_event known only at run time, is
+ *   dispatched
+ *     - switch     : a runtime first_event check, then a switch with a reinterpret_cast per case,
+ *                    the way Selection::ProcEvent was written
+ *     - dispatcher : EventDispatcher, one table load and one call through a thunk
+ *   to the same out-of-line handlers, so only the dispatch differs. The handlers fold every
+ *   event into a checksum, which both ways must agree on.
+ */
+
+// stands in for an extension event such as XFixes SelectionNotify
+struct xcb_bench_notify_event_t
+{
+    uint8_t                     response_type;
+    uint8_t                     pad0;
+    uint16_t                    sequence;
+    uint32_t                    value;
+    uint8_t                     pad1[24];
+};
+
+static xcb_extension_t bench_extension_id = {"BENCH-EXTENSION", 0};
+XCB_DISPATCH_EXTENSION_EVENT(bench_notify, bench_extension_id, 0);
+
+class BenchEvents
+{
+public:
+    static constexpr size_t     EVENTS          = 64 * 1024;
+    static constexpr uint8_t    FIRST_EVENT     = 87;
+
+    BenchEvents(void)
+    {
+        dispatcher.SetFirstEvent(&bench_extension_id, FIRST_EVENT);
+
+        // weights per thousand events
+        const struct {
+            uint8_t             code;
+            int                 weight;
+        } mix[] = {
+            {XCB_SELECTION_REQUEST, 450},
+            {XCB_PROPERTY_NOTIFY,   300},
+            {XCB_SELECTION_NOTIFY,  80},
+            {XCB_SELECTION_CLEAR,   40},
+            {XCB_BUTTON_PRESS,      30},
+            {0,                     20},
+            {FIRST_EVENT,           40},
+            {XCB_EXPOSE,            20},
+            {XCB_CLIENT_MESSAGE,    20},
+        };
+
+        std::mt19937 random(1);
+        std::uniform_int_distribution<int> pick(0, 999);
+        events.resize(EVENTS);
+        for (size_t i = 0; i < EVENTS; i++) {
+            auto roll = pick(random);
+            auto &event = events[i];
+            memset(&event, 0, sizeof(event));
+            for (auto &item : mix) {
+                if (roll < item.weight) {
+                    event.response_type = item.code;
+                    break;
+                }
+                roll -= item.weight;
+            }
+            event.sequence = static_cast<uint16_t>(i);
+            event.full_sequence = static_cast<uint32_t>(i * 2654435761u);
+        }
+    }
+
+    bool Run(size_t rounds)
+    {
+        printf("\n* %zu events x %zu rounds\n", EVENTS, rounds);
+        auto switch_ns = Measure(rounds, [this](xcb_generic_event_t *event) { return ProcEventSwitch(event); });
+        auto switch_sum = checksum;
+        auto dispatch_ns = Measure(rounds, [this](xcb_generic_event_t *event) { return dispatcher.Dispatch(*this, event); });
+        auto dispatch_sum = checksum;
+
+        printf(" - %-12s : %6.2f ns/event\n", "switch", switch_ns);
+        printf(" - %-12s : %6.2f ns/event\n", "dispatcher", dispatch_ns);
+        if (switch_sum != dispatch_sum) {
+            fprintf(stderr, "checksums differ: %016lx vs %016lx\n", switch_sum, dispatch_sum);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    template <typename Dispatch>
+    double Measure(size_t rounds, Dispatch dispatch)
+    {
+        checksum = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (size_t round = 0; round < rounds; round++) {
+            for (auto &event : events) {
+                if (!dispatch(&event)) {
+                    checksum++;
+                }
+            }
+        }
+        auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+        return ns / (rounds * EVENTS);
+    }
+
+    bool ProcEventSwitch(xcb_generic_event_t *event)
+    {
+        auto code = event->response_type & ~0x80;
+        if (code == first_event) {
+            return ProcBenchNotify(reinterpret_cast<xcb_bench_notify_event_t *>(event));
+        }
+        switch (code)
+        {
+            case 0:
+                return ProcError(reinterpret_cast<xcb_generic_error_t *>(event));
+            case XCB_BUTTON_PRESS:
+                return ProcButtonPress(reinterpret_cast<xcb_button_press_event_t *>(event));
+            case XCB_PROPERTY_NOTIFY:
+                return ProcPropertyNotify(reinterpret_cast<xcb_property_notify_event_t *>(event));
+            case XCB_SELECTION_CLEAR:
+                return ProcSelectionClear(reinterpret_cast<xcb_selection_clear_event_t *>(event));
+            case XCB_SELECTION_REQUEST:
+                return ProcSelectionRequest(reinterpret_cast<xcb_selection_request_event_t *>(event));
+            case XCB_SELECTION_NOTIFY:
+                return ProcSelectionNotify(reinterpret_cast<xcb_selection_notify_event_t *>(event));
+        }
+        return true;
+    }
+
+    // out of line, like real handlers, so both ways pay the same call
+    __attribute__((noinline)) bool ProcError(xcb_generic_error_t *error)
+    {
+        checksum = checksum * 31 + error->full_sequence + 1;
+        return true;
+    }
+
+    __attribute__((noinline)) bool ProcButtonPress(xcb_button_press_event_t *event)
+    {
+        checksum = checksum * 31 + event->sequence + 2;
+        return true;
+    }
+
+    __attribute__((noinline)) bool ProcPropertyNotify(xcb_property_notify_event_t *event)
+    {
+        checksum = checksum * 31 + event->sequence + 3;
+        return true;
+    }
+
+    __attribute__((noinline)) bool ProcSelectionClear(xcb_selection_clear_event_t *event)
+    {
+        checksum = checksum * 31 + event->sequence + 4;
+        return true;
+    }
+
+    __attribute__((noinline)) bool ProcSelectionRequest(xcb_selection_request_event_t *event)
+    {
+        checksum = checksum * 31 + event->sequence + 5;
+        return true;
+    }
+
+    __attribute__((noinline)) bool ProcSelectionNotify(xcb_selection_notify_event_t *event)
+    {
+        checksum = checksum * 31 + event->sequence + 6;
+        return true;
+    }
+
+    __attribute__((noinline)) bool ProcBenchNotify(xcb_bench_notify_event_t *event)
+    {
+        checksum = checksum * 31 + event->sequence + 7;
+        return true;
+    }
+
+    using dispatcher_t = EventDispatcher<BenchEvents,
+        On<&BenchEvents::ProcError>,
+        On<&BenchEvents::ProcButtonPress, XCB_BUTTON_PRESS>,
+        On<&BenchEvents::ProcPropertyNotify>,
+        On<&BenchEvents::ProcSelectionClear>,
+        On<&BenchEvents::ProcSelectionRequest>,
+        On<&BenchEvents::ProcSelectionNotify>,
+        On<&BenchEvents::ProcBenchNotify>>;
+
+    std::vector<xcb_generic_event_t>        events          = {};
+    dispatcher_t                            dispatcher      = {};
+    uint8_t                                 first_event     = FIRST_EVENT;  // as if queried at run time
+    uint64_t                                checksum        = 0;
+};
+
+int main(int argc, char **argv)
+{
+    printf("Benchmark event dispatch\n");
+
+    size_t rounds = argc > 1 ? strtoul(argv[1], nullptr, 0) : 200;
+    auto obj = BenchEvents();
+    if (!obj.Run(rounds)) {
+        printf("\nFailed..\n");
+        return EXIT_FAILURE;
+    }
+    printf("\nSucceed..\n");
+    return EXIT_SUCCESS;
+}
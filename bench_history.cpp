@@ -0,0 +1,151 @@
+#include "config.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "clipboard_history.h"
+
+/**
+ * Clipboard history: restart-to-serving time against history length
+ *
+ *   No X server involved. For a history of N entries, appended as clips of two targets with
+ *   payloads of varying size, in a fresh temporary directory
+ *     - append   : entries/s and MiB/s, one Append() per entry, with no size limit
+ *     - restart  : Open() up to the last clip's payloads being readable, as xcb_selection does
+ *                  before taking CLIPBOARD again; p50 / p99 / max
+ *     - read all : reading the whole log once, a lower bound for a restart that parses it
+ *     - limited  : append again under the default size limit; the log size and compactions
+ *   Restart stays flat as N grows by 100x; read all grows with it, the limited log does not.
+ */
+
+class BenchHistory
+{
+public:
+    static constexpr size_t     RESTARTS        = 200;
+    static constexpr size_t     CLIP_ENTRIES    = 2;
+
+    bool Run(size_t entries)
+    {
+        char dir[] = "/tmp/xcb-bench-history.XXXXXX";
+        if (!mkdtemp(dir)) {
+            fprintf(stderr, "mkdtemp() failed (err: '%s')\n", strerror(errno));
+            return false;
+        }
+        auto rc = true;
+        for (auto count : {entries / 100, entries / 10, entries}) {
+            rc = rc && Measure(std::string(dir) + "/history." + std::to_string(count), std::max<size_t>(CLIP_ENTRIES, count));
+        }
+        rmdir(dir);
+        return rc;
+    }
+
+private:
+    bool Measure(const std::string &path, size_t count)
+    {
+        printf("\n* %zu entries, %zu per clip\n", count, CLIP_ENTRIES);
+        auto rc = Append("append", path, count, 0) && Restart(path) && ReadAll(path);
+        unlink(path.c_str());
+        unlink((path + ".idx").c_str());
+        rc = rc && Append("limited", path, count, ClipboardHistory::DEFAULT_LIMIT);
+        unlink(path.c_str());
+        unlink((path + ".idx").c_str());
+        return rc;
+    }
+
+    static bool Append(const char *name, const std::string &path, size_t count, uint64_t limit)
+    {
+        ClipboardHistory history = {};
+        if (!history.Open(path, limit)) {
+            fprintf(stderr, "cannot open '%s' (err: '%s')\n", path.c_str(), strerror(errno));
+            return false;
+        }
+        // 64 B .. 4 KiB, like copied text
+        std::string payload(4096, 'x');
+        size_t bytes = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < count; i += CLIP_ENTRIES) {
+            auto clip = history.NextClip();
+            auto size = 64 + (i * 2654435761u) % (payload.size() - 64);
+            auto rc = history.Append(clip, "CLIPBOARD", {{"UTF8_STRING", "UTF8_STRING"}, {"TEXT", "UTF8_STRING"}}, {payload.data(), size}) &&
+                      history.Append(clip, "CLIPBOARD", {{"text/html", "text/html"}}, {payload.data(), size + 32});
+            if (!rc) {
+                fprintf(stderr, "append failed (err: '%s')\n", strerror(errno));
+                return false;
+            }
+            bytes += 2 * size + 32;
+        }
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        auto stats = history.Stats();
+        printf(" - %-12s : %10.0f entries/s, %8.1f MiB/s, log %.1f MiB, %lu compactions\n", name,
+            count / seconds, bytes / seconds / (1024 * 1024), stats.bytes / (1024.0 * 1024), stats.compactions);
+        return true;
+    }
+
+    static bool Restart(const std::string &path)
+    {
+        size_t sum = 0;
+        auto rc = Percentiles("restart", RESTARTS, [&path, &sum] {
+            ClipboardHistory history = {};
+            if (!history.Open(path) || history.LastClip().size() != CLIP_ENTRIES) {
+                return false;
+            }
+            // the first and last byte of each payload, so its pages are known to be there
+            for (auto &entry : history.LastClip()) {
+                sum += entry.data.front() + entry.data.back();
+            }
+            return true;
+        });
+        return rc && sum;
+    }
+
+    static bool ReadAll(const std::string &path)
+    {
+        std::vector<char> buf(1024 * 1024);
+        return Percentiles("read all", std::max<size_t>(1, RESTARTS / 20), [&path, &buf] {
+            auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                return false;
+            }
+            while (read(fd, buf.data(), buf.size()) > 0) {
+            }
+            close(fd);
+            return true;
+        });
+    }
+
+    static bool Percentiles(const char *name, size_t count, const std::function<bool(void)> &call)
+    {
+        std::vector<double> us(count);
+        for (size_t i = 0; i < count; i++) {
+            auto begin = std::chrono::steady_clock::now();
+            if (!call()) {
+                fprintf(stderr, "%s failed\n", name);
+                return false;
+            }
+            us[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+        }
+        std::sort(us.begin(), us.end());
+        printf(" - %-12s : p50 %9.1f us, p99 %9.1f us, max %9.1f us\n", name, us[us.size() / 2], us[us.size() * 99 / 100], us.back());
+        return true;
+    }
+};
+
+int main(int argc, char **argv)
+{
+    printf("Benchmark clipboard history\n");
+
+    size_t entries = argc > 1 ? strtoul(argv[1], nullptr, 0) : 100000;
+    auto obj = BenchHistory();
+    if (!obj.Run(std::max<size_t>(100, entries))) {
+        printf("\nFailed..\n");
+        return EXIT_FAILURE;
+    }
+    printf("\nSucceed..\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,216 @@
+#include "config.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <time.h>
+#include <xcb/xcb.h>
+
+/**
+ * Request throughput by flush cadence and socket buffer size
+ *
+ *   Needs $DISPLAY (e.g. Xvfb). Each run opens its own connection and sends one kind of request
+ *     - change_property of 16 B, 1 KiB and 64 KiB on our own window
+ *     - intern_atom of an existing name, replies discarded
+ *     - send_event of a ClientMessage no client selected
+ *   calling xcb_flush() every 1, 16 or 256 requests, or never and leaving it to libxcb, which
+ *   writes whenever its fixed 16 KiB output buffer fills. The run ends with one round trip so
+ *   every request has been processed by the server.
+ *
+ *   libxcb's own buffer size cannot be changed, so the buffer that varies is the kernel send
+ *   buffer of the connection (SO_SNDBUF): how much can be written before a write blocks on
+ *   the server reading.
+ *
+ *   cpu is this thread's time per request, so it covers marshalling and writes, not the server.
+ */
+
+class BenchRequests
+{
+public:
+    static constexpr size_t     MAX_BYTES       = 256 * 1024 * 1024;   // per run, caps large payloads
+
+    BenchRequests(void)
+    {
+    }
+
+    ~BenchRequests(void)
+    {
+        Close();
+    }
+
+    bool Run(size_t requests)
+    {
+        const size_t flush_every[] = {1, 16, 256, 0};
+        const int sndbufs[] = {0, 64 * 1024, 1024 * 1024};
+
+        struct workload_t
+        {
+            const char             *name;
+            size_t                  size;
+            std::function<void(BenchRequests &, size_t)> send;
+        };
+        const workload_t workloads[] = {
+            {"change_property 16 B",  16,          [](BenchRequests &obj, size_t) { obj.ChangeProperty(16); }},
+            {"change_property 1 KiB", 1024,        [](BenchRequests &obj, size_t) { obj.ChangeProperty(1024); }},
+            {"change_property 64 KiB", 64 * 1024,  [](BenchRequests &obj, size_t) { obj.ChangeProperty(64 * 1024); }},
+            {"intern_atom",           0,           [](BenchRequests &obj, size_t) { obj.InternAtom(); }},
+            {"send_event",            0,           [](BenchRequests &obj, size_t i) { obj.SendEvent(i); }},
+        };
+
+        payload.assign(64 * 1024, 'x');
+        for (auto &workload : workloads) {
+            auto count = workload.size ? std::min(requests, MAX_BYTES / workload.size) : requests;
+            printf("\n* %s x %zu\n", workload.name, count);
+            for (auto sndbuf : sndbufs) {
+                for (auto every : flush_every) {
+                    result_t result = {};
+                    if (!Measure(count, every, sndbuf, workload.send, result)) {
+                        return false;
+                    }
+                    char flush_label[32];
+                    char sndbuf_label[32];
+                    snprintf(flush_label, sizeof(flush_label), every ? "every %zu" : "libxcb", every);
+                    snprintf(sndbuf_label, sizeof(sndbuf_label), sndbuf ? "%d KiB" : "default", sndbuf / 1024);
+                    printf(" - flush %-9s sndbuf %-9s: %10.0f req/s, %8.1f MiB/s, %7.1f ns cpu/req, %7zu flushes\n",
+                        flush_label, sndbuf_label, result.requests_per_second, result.mib_per_second, result.cpu_ns_per_request, result.flushes);
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    struct result_t
+    {
+        double                  requests_per_second = 0;
+        double                  mib_per_second      = 0;
+        double                  cpu_ns_per_request  = 0;
+        size_t                  flushes             = 0;    // explicit xcb_flush() calls
+    };
+
+    bool Open(int sndbuf)
+    {
+        connection = xcb_connect(nullptr, nullptr);
+        if (xcb_connection_has_error(connection)) {
+            fprintf(stderr, "xcb_connect() failed\n");
+            return false;
+        }
+        if (sndbuf) {
+            setsockopt(xcb_get_file_descriptor(connection), SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        }
+
+        auto screen = xcb_setup_roots_iterator(xcb_get_setup(connection)).data;
+        window = xcb_generate_id(connection);
+        xcb_create_window(connection, XCB_COPY_FROM_PARENT, window, screen->root,
+            0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0, nullptr);
+
+        auto reply = xcb_intern_atom_reply(connection, xcb_intern_atom(connection, 0, strlen("XCB_BENCH_REQUESTS"), "XCB_BENCH_REQUESTS"), nullptr);
+        if (!reply) {
+            fprintf(stderr, "xcb_intern_atom_reply() failed\n");
+            return false;
+        }
+        property = reply->atom;
+        free(reply);
+        return true;
+    }
+
+    void Close(void)
+    {
+        if (connection) {
+            xcb_disconnect(connection);
+            connection = nullptr;
+        }
+    }
+
+    bool Measure(size_t count, size_t every, int sndbuf, const std::function<void(BenchRequests &, size_t)> &send, result_t &result)
+    {
+        if (!Open(sndbuf)) {
+            Close();
+            return false;
+        }
+        auto written = xcb_total_written(connection);
+        auto wall = std::chrono::steady_clock::now();
+        auto cpu = ThreadTime();
+
+        for (size_t i = 0; i < count; i++) {
+            send(*this, i);
+            if (every && (i + 1) % every == 0) {
+                xcb_flush(connection);
+                result.flushes++;
+            }
+        }
+        // one round trip: every request before it has been processed
+        auto reply = xcb_get_input_focus_reply(connection, xcb_get_input_focus(connection), nullptr);
+        if (!reply) {
+            fprintf(stderr, "xcb_get_input_focus_reply() failed\n");
+            Close();
+            return false;
+        }
+        free(reply);
+
+        auto cpu_ns = ThreadTime() - cpu;
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall).count();
+        auto bytes = xcb_total_written(connection) - written;
+        Close();
+
+        result.requests_per_second = count / seconds;
+        result.mib_per_second      = bytes / seconds / (1024 * 1024);
+        result.cpu_ns_per_request  = static_cast<double>(cpu_ns) / count;
+        return true;
+    }
+
+    void ChangeProperty(size_t size)
+    {
+        xcb_change_property(connection, XCB_PROP_MODE_REPLACE, window, property, XCB_ATOM_STRING, 8, size, payload.data());
+    }
+
+    // the reply is dropped by libxcb as it arrives instead of queued for us
+    void InternAtom(void)
+    {
+        auto cookie = xcb_intern_atom(connection, 1, strlen("XCB_BENCH_REQUESTS"), "XCB_BENCH_REQUESTS");
+        xcb_discard_reply(connection, cookie.sequence);
+    }
+
+    // with an event mask nobody selected on our window, the event is delivered to no one
+    void SendEvent(size_t i)
+    {
+        xcb_client_message_event_t event = {};
+        event.response_type = XCB_CLIENT_MESSAGE;
+        event.format        = 32;
+        event.window        = window;
+        event.type          = property;
+        event.data.data32[0] = static_cast<uint32_t>(i);
+        xcb_send_event(connection, 0, window, XCB_EVENT_MASK_BUTTON_PRESS, reinterpret_cast<const char *>(&event));
+    }
+
+    static int64_t ThreadTime(void)
+    {
+        struct timespec ts = {};
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    xcb_connection_t       *connection  = nullptr;
+    xcb_window_t            window      = XCB_WINDOW_NONE;
+    xcb_atom_t              property    = XCB_ATOM_NONE;
+    std::string             payload     = {};
+};
+
+int main(int argc, char **argv)
+{
+    printf("Benchmark xcb requests\n");
+
+    size_t requests = argc > 1 ? strtoul(argv[1], nullptr, 0) : 100000;
+    auto obj = BenchRequests();
+    if (!obj.Run(requests)) {
+        printf("\nFailed..\n");
+        return EXIT_FAILURE;
+    }
+    printf("\nSucceed..\n");
+    return EXIT_SUCCESS;
+}
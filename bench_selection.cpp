@@ -0,0 +1,465 @@
+#include "config.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <xcb/xcb.h>
+#include "log.h"
+#include "memfd_handoff.h"
+
+/**
+ * Event-loop cost of logging a selection handler line
+ *
+ *   Every XCB_SELECTION_REQUEST in xcb_selection logs one line with three atom names.
+ *   This measures what the event thread pays per event for
+ *     - printf   : synchronous formatting with atom names from a warm std::map cache
+ *     - log      : deferred record into the ring, formatted by the consumer thread
+ *     - log-off  : a disabled level
+ *   Output goes to /dev/null so the terminal does not dominate the numbers. Only the
+ *   event thread's cpu time is counted; the consumer drains between bursts.
+ *
+ * Multi-client load ('--load CLIENTS [SECONDS] [TARGET]')
+ *
+ *   Needs $DISPLAY and a CLIPBOARD owner, e.g. 'xcb_selection --own --workers 4'. Every client
+ *   has its own connection and window and converts CLIPBOARD back to back; the total number
+ *   of completed transfers per second is reported.
+ *
+ * Same-host handoff ('--handoff [ROUNDS] [TARGET]')
+ *
+ *   Needs an owner started with '--memfd', e.g. 'xcb_selection --own --memfd --text big.txt'.
+ *   Each round fetches the content once through 'x-memfd-handle' (claim, map, read every byte)
+ *   and once through TARGET via the property path, with INCR for large content.
+ */
+
+class BenchSelection
+{
+public:
+    BenchSelection(void)
+    {
+    }
+
+    ~BenchSelection(void)
+    {
+        if (null_out) {
+            fclose(null_out);
+        }
+    }
+
+    bool Init(void)
+    {
+        null_out = fopen("/dev/null", "w");
+        if (!null_out) {
+            fprintf(stderr, "fopen(/dev/null) failed\n");
+            return false;
+        }
+
+        const char *names[] = {"CLIPBOARD", "TARGETS", "UTF8_STRING", "image/png", "CUT_BUFFER0", "TIMESTAMP"};
+        xcb_atom_t atom = 300;
+        for (auto name : names) {
+            atom_names[atom++] = name;
+        }
+
+        events.resize(1024);
+        for (size_t i = 0; i < events.size(); i++) {
+            auto &event = events[i];
+            event.response_type = XCB_SELECTION_REQUEST;
+            event.sequence      = static_cast<uint16_t>(i);
+            event.time          = static_cast<xcb_timestamp_t>(i * 7);
+            event.owner         = 0x00400001;
+            event.requestor     = 0x00600001 + (i % 8);
+            event.selection     = 300;
+            event.target        = 301 + (i % 3);
+            event.property      = 304;
+        }
+
+        Log::Get().SetOutput(null_out, null_out);
+        Log::Get().SetAtomResolver([this](uint32_t atom) -> std::string {
+            auto iter = atom_names.find(atom);
+            return iter != atom_names.end() ? iter->second : "Unknown";
+        });
+        Log::Get().Start();
+        return true;
+    }
+
+    bool Run(size_t iterations)
+    {
+        printf("\n* %zu selection request lines\n", iterations);
+
+        Measure("printf", iterations, [this](const xcb_selection_request_event_t &event) {
+            fprintf(null_out, "   - XCB_SELECTION_REQUEST          : seq: %4u, time: %10u, owner: 0x%08X, requestor: 0x%08X, selection: '%s', target: '%s', property: '%s'\n",
+                event.sequence, event.time, event.owner, event.requestor, GetAtomName(event.selection), GetAtomName(event.target), GetAtomName(event.property));
+        });
+
+        Log::Get().SetLevel(LogLevel::INFO);
+        Measure("log", iterations, [](const xcb_selection_request_event_t &event) {
+            LOG_INFO("   - XCB_SELECTION_REQUEST          : seq: %4u, time: %10u, owner: 0x%08X, requestor: 0x%08X, selection: '%s', target: '%s', property: '%s'\n",
+                event.sequence, event.time, event.owner, event.requestor, LogAtom(event.selection), LogAtom(event.target), LogAtom(event.property));
+        });
+        printf("     . dropped (ring full)  : %lu\n", Log::Get().Dropped());
+
+        Log::Get().SetLevel(LogLevel::WARN);
+        Measure("log-off", iterations, [](const xcb_selection_request_event_t &event) {
+            LOG_INFO("   - XCB_SELECTION_REQUEST          : seq: %4u, time: %10u, owner: 0x%08X, requestor: 0x%08X, selection: '%s', target: '%s', property: '%s'\n",
+                event.sequence, event.time, event.owner, event.requestor, LogAtom(event.selection), LogAtom(event.target), LogAtom(event.property));
+        });
+
+        Log::Get().Stop();
+        return true;
+    }
+
+    bool RunLoad(size_t clients, int seconds, const char *target_name)
+    {
+        printf("\n* %zu clients converting CLIPBOARD to '%s' for %d s\n", clients, target_name, seconds);
+
+        std::atomic<bool> stop = false;
+        std::atomic<uint64_t> transfers = 0;
+        std::atomic<uint64_t> refused = 0;
+        std::atomic<uint64_t> failed = 0;
+        std::vector<std::thread> threads = {};
+
+        for (size_t i = 0; i < clients; i++) {
+            threads.emplace_back([&] {
+                if (!RunClient(target_name, stop, transfers, refused)) {
+                    failed++;
+                }
+            });
+        }
+
+        sleep(seconds);
+        stop = true;
+        for (auto &thread : threads) {
+            thread.join();
+        }
+
+        printf(" - transfers                : %lu\n", transfers.load());
+        printf(" - refused (property None)  : %lu\n", refused.load());
+        printf(" - clients failed           : %lu\n", failed.load());
+        printf(" - throughput               : %.1f transfers/s\n", static_cast<double>(transfers) / seconds);
+        return !failed;
+    }
+
+    static bool RunClient(const char *target_name, std::atomic<bool> &stop, std::atomic<uint64_t> &transfers, std::atomic<uint64_t> &refused)
+    {
+        auto connection = xcb_connect(nullptr, nullptr);
+        if (xcb_connection_has_error(connection)) {
+            fprintf(stderr, "xcb_connect() failed\n");
+            xcb_disconnect(connection);
+            return false;
+        }
+
+        auto screen = xcb_setup_roots_iterator(xcb_get_setup(connection)).data;
+        auto window = xcb_generate_id(connection);
+        xcb_create_window(connection, XCB_COPY_FROM_PARENT, window, screen->root,
+            0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0, nullptr);
+
+        const char *names[] = {"CLIPBOARD", target_name, "XCB_BENCH_SELECTION"};
+        xcb_atom_t atoms[3] = {};
+        for (size_t i = 0; i < 3; i++) {
+            auto reply = xcb_intern_atom_reply(connection, xcb_intern_atom(connection, 0, strlen(names[i]), names[i]), nullptr);
+            if (!reply) {
+                fprintf(stderr, "xcb_intern_atom_reply() failed '%s'\n", names[i]);
+                xcb_disconnect(connection);
+                return false;
+            }
+            atoms[i] = reply->atom;
+            free(reply);
+        }
+
+        struct pollfd pfd = {xcb_get_file_descriptor(connection), POLLIN, 0};
+        while (!stop) {
+            xcb_convert_selection(connection, window, atoms[0], atoms[1], atoms[2], XCB_CURRENT_TIME);
+            xcb_flush(connection);
+
+            xcb_atom_t property = XCB_ATOM_NONE;
+            bool notified = false;
+            while (!notified && !stop) {
+                auto event = xcb_poll_for_event(connection);
+                if (!event) {
+                    if (xcb_connection_has_error(connection)) {
+                        stop = true;
+                        break;
+                    }
+                    poll(&pfd, 1, 100);
+                    continue;
+                }
+                if ((event->response_type & ~0x80) == XCB_SELECTION_NOTIFY) {
+                    property = reinterpret_cast<xcb_selection_notify_event_t *>(event)->property;
+                    notified = true;
+                }
+                free(event);
+            }
+            if (!notified) {
+                break;
+            }
+            if (!property) {
+                refused++;
+                continue;
+            }
+            free(xcb_get_property_reply(connection,
+                xcb_get_property(connection, 1, window, property, XCB_GET_PROPERTY_TYPE_ANY, 0, INT32_MAX / 4), nullptr));
+            transfers++;
+        }
+
+        xcb_disconnect(connection);
+        return true;
+    }
+
+    bool RunHandoff(size_t rounds, const char *target_name)
+    {
+        printf("\n* CLIPBOARD through '%s' vs '%s', %zu rounds\n", MemfdHandoff::TARGET, target_name, rounds);
+
+        auto connection = xcb_connect(nullptr, nullptr);
+        if (xcb_connection_has_error(connection)) {
+            fprintf(stderr, "xcb_connect() failed\n");
+            xcb_disconnect(connection);
+            return false;
+        }
+
+        auto screen = xcb_setup_roots_iterator(xcb_get_setup(connection)).data;
+        auto window = xcb_generate_id(connection);
+        uint32_t values[] = {XCB_EVENT_MASK_PROPERTY_CHANGE};
+        xcb_create_window(connection, XCB_COPY_FROM_PARENT, window, screen->root,
+            0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, XCB_CW_EVENT_MASK, values);
+
+        const char *names[] = {"CLIPBOARD", MemfdHandoff::TARGET, target_name, "INCR", "XCB_BENCH_SELECTION"};
+        xcb_atom_t atoms[5] = {};
+        for (size_t i = 0; i < 5; i++) {
+            auto reply = xcb_intern_atom_reply(connection, xcb_intern_atom(connection, 0, strlen(names[i]), names[i]), nullptr);
+            if (!reply) {
+                fprintf(stderr, "xcb_intern_atom_reply() failed '%s'\n", names[i]);
+                xcb_disconnect(connection);
+                return false;
+            }
+            atoms[i] = reply->atom;
+            free(reply);
+        }
+        auto clipboard = atoms[0];
+        auto property = atoms[4];
+
+        double memfd_s = 0;
+        double property_s = 0;
+        uint64_t memfd_bytes = 0;
+        uint64_t property_bytes = 0;
+        auto rc = true;
+        for (size_t i = 0; i < rounds && rc; i++) {
+            auto begin = std::chrono::steady_clock::now();
+            std::string value = {};
+            rc = Convert(connection, window, clipboard, atoms[1], property, atoms[3], [&value](const void *data, size_t len) {
+                value.append(static_cast<const char *>(data), len);
+            });
+            size_t size = 0;
+            std::string type = {};
+            auto fd = rc ? MemfdHandoff::Claim(value.data(), value.size(), size, type) : -1;
+            if (fd < 0) {
+                fprintf(stderr, "memfd handoff failed\n");
+                rc = false;
+                break;
+            }
+            auto data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+            close(fd);
+            if (data == MAP_FAILED) {
+                rc = false;
+                break;
+            }
+            auto memfd_sum = Checksum(data, size);
+            if (data) {
+                munmap(data, size);
+            }
+            memfd_s += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            memfd_bytes += size;
+
+            begin = std::chrono::steady_clock::now();
+            uint64_t sum = 0;
+            uint64_t bytes = 0;
+            rc = Convert(connection, window, clipboard, atoms[2], property, atoms[3], [&sum, &bytes](const void *data, size_t len) {
+                // chunks are multiples of 8 except the last, so the sums match the contiguous one
+                sum += Checksum(data, len);
+                bytes += len;
+            });
+            property_s += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            property_bytes += bytes;
+            if (rc && (bytes != size || sum != memfd_sum)) {
+                fprintf(stderr, "content differs: %lu bytes via '%s', %zu via memfd\n", bytes, target_name, size);
+                rc = false;
+                break;
+            }
+        }
+        xcb_disconnect(connection);
+        if (!rc) {
+            return false;
+        }
+
+        printf(" - %-24s: %10.1f MiB/s, %8.2f ms/round\n", MemfdHandoff::TARGET, memfd_bytes / memfd_s / (1 << 20), memfd_s * 1000 / rounds);
+        printf(" - %-24s: %10.1f MiB/s, %8.2f ms/round\n", target_name, property_bytes / property_s / (1 << 20), property_s * 1000 / rounds);
+        printf(" - content                  : %lu bytes\n", memfd_bytes / rounds);
+        return true;
+    }
+
+    // one ConvertSelection, following INCR until the empty chunk; 'sink' sees the data in order
+    static bool Convert(xcb_connection_t *connection, xcb_window_t window, xcb_atom_t selection, xcb_atom_t target,
+        xcb_atom_t property, xcb_atom_t incr, const std::function<void(const void *, size_t)> &sink)
+    {
+        xcb_convert_selection(connection, window, selection, target, property, XCB_CURRENT_TIME);
+        xcb_flush(connection);
+
+        auto notify = WaitEvent(connection, [](xcb_generic_event_t *event) {
+            return (event->response_type & ~0x80) == XCB_SELECTION_NOTIFY;
+        });
+        if (!notify) {
+            return false;
+        }
+        auto refused = !reinterpret_cast<xcb_selection_notify_event_t *>(notify)->property;
+        free(notify);
+        if (refused) {
+            fprintf(stderr, "conversion refused\n");
+            return false;
+        }
+
+        auto reply = xcb_get_property_reply(connection,
+            xcb_get_property(connection, 1, window, property, XCB_GET_PROPERTY_TYPE_ANY, 0, INT32_MAX / 4), nullptr);
+        if (!reply) {
+            return false;
+        }
+        auto is_incr = reply->type == incr;
+        if (!is_incr) {
+            sink(xcb_get_property_value(reply), xcb_get_property_value_length(reply));
+        }
+        free(reply);
+
+        // deleting the INCR property above asked for the first chunk
+        while (is_incr) {
+            auto event = WaitEvent(connection, [window, property](xcb_generic_event_t *event) {
+                auto notify = reinterpret_cast<xcb_property_notify_event_t *>(event);
+                return (event->response_type & ~0x80) == XCB_PROPERTY_NOTIFY && notify->window == window &&
+                       notify->atom == property && notify->state == XCB_PROPERTY_NEW_VALUE;
+            });
+            if (!event) {
+                return false;
+            }
+            free(event);
+
+            reply = xcb_get_property_reply(connection,
+                xcb_get_property(connection, 1, window, property, XCB_GET_PROPERTY_TYPE_ANY, 0, INT32_MAX / 4), nullptr);
+            if (!reply) {
+                return false;
+            }
+            auto len = xcb_get_property_value_length(reply);
+            sink(xcb_get_property_value(reply), len);
+            free(reply);
+            xcb_flush(connection);
+            is_incr = len > 0;
+        }
+        return true;
+    }
+
+    // blocks up to 5 s for an event matching 'match'; other events are dropped
+    template <typename Match>
+    static xcb_generic_event_t *WaitEvent(xcb_connection_t *connection, Match match)
+    {
+        struct pollfd pfd = {xcb_get_file_descriptor(connection), POLLIN, 0};
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (std::chrono::steady_clock::now() < deadline) {
+            auto event = xcb_poll_for_event(connection);
+            if (!event) {
+                if (xcb_connection_has_error(connection)) {
+                    return nullptr;
+                }
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            if (match(event)) {
+                return event;
+            }
+            free(event);
+        }
+        fprintf(stderr, "timed out waiting for the owner\n");
+        return nullptr;
+    }
+
+    // reads every byte, so both paths pay for touching the content
+    static uint64_t Checksum(const void *data, size_t len)
+    {
+        auto p = static_cast<const uint8_t *>(data);
+        uint64_t sum = 0;
+        size_t i = 0;
+        for (; i + 8 <= len; i += 8) {
+            uint64_t word = 0;
+            memcpy(&word, p + i, 8);
+            sum += word;
+        }
+        for (; i < len; i++) {
+            sum += p[i];
+        }
+        return sum;
+    }
+
+    template <typename Fn>
+    void Measure(const char *label, size_t iterations, Fn fn)
+    {
+        int64_t ns = 0;
+        for (size_t i = 0; i < iterations;) {
+            // bursts stay below the ring size so the enqueue path is measured, not the drop path
+            auto begin = ThreadTime();
+            for (size_t n = 0; n < events.size() && i < iterations; n++, i++) {
+                fn(events[i % events.size()]);
+            }
+            ns += ThreadTime() - begin;
+            Log::Get().Flush();
+        }
+        printf(" - %-24s: %8.1f ns/event\n", label, static_cast<double>(ns) / iterations);
+    }
+
+    // cpu time of the calling (event) thread, so the consumer does not count against it
+    static int64_t ThreadTime(void)
+    {
+        struct timespec ts = {};
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    const char *GetAtomName(xcb_atom_t atom)
+    {
+        auto iter = atom_names.find(atom);
+        return iter != atom_names.end() ? iter->second.c_str() : "Unknown";
+    }
+
+private:
+    FILE                                       *null_out    = nullptr;
+    std::vector<xcb_selection_request_event_t>  events      = {};
+    std::map<xcb_atom_t, std::string>           atom_names  = {};
+};
+
+int main(int argc, char **argv)
+{
+    printf("Benchmark xcb_selection\n");
+
+    auto obj = BenchSelection();
+    auto rc = false;
+    if (argc > 1 && !strcmp(argv[1], "--handoff")) {
+        size_t rounds = argc > 2 ? strtoul(argv[2], nullptr, 0) : 5;
+        rc = obj.RunHandoff(rounds, argc > 3 ? argv[3] : "UTF8_STRING");
+    } else if (argc > 2 && !strcmp(argv[1], "--load")) {
+        size_t clients = strtoul(argv[2], nullptr, 0);
+        int seconds = argc > 3 ? atoi(argv[3]) : 5;
+        rc = obj.RunLoad(clients, seconds, argc > 4 ? argv[4] : "UTF8_STRING");
+    } else {
+        size_t iterations = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1000000;
+        rc = obj.Init() && obj.Run(iterations);
+    }
+    if (!rc) {
+        printf("\nFailed..\n");
+        return EXIT_FAILURE;
+    }
+    printf("\nSucceed..\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,205 @@
+#include "config.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include "task_queue.h"
+
+/**
+ * Handing work back to an event loop thread: post-to-run latency and throughput
+ *
+ *   No X server involved. A consumer thread sleeps the way the xcb_selection reactor does and
+ *   runs what other threads post to it
+ *     - task queue : TaskQueue, the consumer blocks in poll() on its eventfd
+ *     - locked list: the completion list it replaced, a mutex-guarded vector the loop only
+ *                    looks at when its 1 ms poll() timeout expires
+ *
+ *   latency    : one task in flight at a time, from Post() to the task starting; p50 / p99 / max
+ *   throughput : 1, 2, 4 .. hardware_concurrency() producers posting back to back; tasks/s,
+ *                and how many tasks each wakeup ran
+ */
+
+class LockedList
+{
+public:
+    void Post(std::function<void()> task)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        tasks.push_back(std::move(task));
+    }
+
+    size_t Wait(void)
+    {
+        poll(nullptr, 0, 1);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (tasks.empty()) {
+                return 0;
+            }
+            running.swap(tasks);
+        }
+        for (auto &task : running) {
+            task();
+        }
+        auto done = running.size();
+        running.clear();
+        wakeups++;
+        return done;
+    }
+
+    uint64_t Wakeups(void) const
+    {
+        return wakeups;
+    }
+
+private:
+    std::mutex                              lock            = {};
+    std::vector<std::function<void()>>      tasks           = {};
+    std::vector<std::function<void()>>      running         = {};
+    uint64_t                                wakeups         = 0;
+};
+
+class EventQueue
+{
+public:
+    void Post(std::function<void()> task)
+    {
+        queue.Post(std::move(task));
+    }
+
+    size_t Wait(void)
+    {
+        struct pollfd fd = {queue.Fd(), POLLIN, 0};
+        poll(&fd, 1, -1);
+        return queue.Wakeup();
+    }
+
+    uint64_t Wakeups(void) const
+    {
+        return queue.Stats().batches;
+    }
+
+private:
+    TaskQueue                               queue           = {};
+};
+
+class BenchTasks
+{
+public:
+    bool Run(size_t samples, size_t tasks)
+    {
+        TaskQueue probe = {};
+        if (probe.Fd() < 0) {
+            fprintf(stderr, "eventfd() failed (err: '%s')\n", strerror(probe.Error()));
+            return false;
+        }
+
+        auto cores = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<unsigned> producers;
+        for (unsigned count = 1; count < cores; count *= 2) {
+            producers.push_back(count);
+        }
+        producers.push_back(cores);
+
+        printf("\n* post-to-run latency, %zu samples\n", samples);
+        Latency<EventQueue>("task queue", samples);
+        Latency<LockedList>("locked list", std::min<size_t>(samples, 2000));
+
+        printf("\n* throughput, %zu tasks per producer\n", tasks);
+        for (auto count : producers) {
+            Throughput<EventQueue>("task queue", count, tasks);
+        }
+        for (auto count : producers) {
+            Throughput<LockedList>("locked list", count, tasks);
+        }
+        return true;
+    }
+
+private:
+    // runs 'queue' on its own thread until a posted task clears 'running'
+    template <typename Queue>
+    static std::thread Consume(Queue &queue, std::atomic<bool> &running)
+    {
+        return std::thread([&queue, &running] {
+            while (running.load(std::memory_order_relaxed)) {
+                queue.Wait();
+            }
+        });
+    }
+
+    template <typename Queue>
+    void Latency(const char *name, size_t samples)
+    {
+        Queue queue;
+        std::atomic<bool> running = true;
+        auto consumer = Consume(queue, running);
+
+        std::vector<double> us(samples);
+        for (size_t i = 0; i < samples; i++) {
+            std::atomic<bool> done = false;
+            auto posted = std::chrono::steady_clock::now();
+            queue.Post([&us, &done, posted, i] {
+                us[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - posted).count();
+                done.store(true, std::memory_order_release);
+            });
+            while (!done.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+        }
+        queue.Post([&running] { running = false; });
+        consumer.join();
+
+        std::sort(us.begin(), us.end());
+        printf(" - %-12s : p50 %9.1f us, p99 %9.1f us, max %9.1f us\n", name, us[us.size() / 2], us[us.size() * 99 / 100], us.back());
+    }
+
+    template <typename Queue>
+    void Throughput(const char *name, unsigned count, size_t tasks)
+    {
+        Queue queue;
+        std::atomic<bool> running = true;
+        uint64_t ran = 0;   // consumer only
+
+        auto begin = std::chrono::steady_clock::now();
+        auto consumer = Consume(queue, running);
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < count; t++) {
+            threads.emplace_back([&queue, &ran, tasks] {
+                for (size_t i = 0; i < tasks; i++) {
+                    queue.Post([&ran] { ran++; });
+                }
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        queue.Post([&running] { running = false; });
+        consumer.join();
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        printf(" - %-12s %3u producers: %12.0f tasks/s, %8.1f tasks per wakeup%s\n", name, count, ran / seconds,
+            static_cast<double>(ran) / std::max<uint64_t>(1, queue.Wakeups()), ran == count * tasks ? "" : " (tasks lost)");
+    }
+};
+
+int main(int argc, char **argv)
+{
+    printf("Benchmark task queue\n");
+
+    size_t samples = argc > 1 ? strtoul(argv[1], nullptr, 0) : 20000;
+    size_t tasks = argc > 2 ? strtoul(argv[2], nullptr, 0) : 200000;
+    auto obj = BenchTasks();
+    if (!obj.Run(samples, tasks)) {
+        printf("\nFailed..\n");
+        return EXIT_FAILURE;
+    }
+    printf("\nSucceed..\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,266 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <array>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Process-wide pool of transfer buffers in power-of-two size classes
+ *
+ *   - a buffer from MIN_SIZE to MAX_SIZE is rounded up to its class and, once released, waits on
+ *     that class's free list for the next transfer; larger ones go straight back to the allocator
+ *   - nothing is held for a transfer that is not running: a buffer is acquired when a transfer
+ *     needs it and released when it ends, and Trim() frees every cached one once the process
+ *     is idle, so the idle footprint is only what is still in use
+ *   - Buffer is the owning handle and hands its memory back when it goes out of scope
+ *
+ *   Thread-safe; buffers are acquired and released by the event thread and the workers alike.
+ */
+
+class BufferPool
+{
+public:
+    static constexpr size_t     MIN_SIZE        = 4 * 1024;
+    static constexpr size_t     MAX_SIZE        = 4 * 1024 * 1024;
+    static constexpr size_t     CLASSES         = 11;   // MIN_SIZE << 0 .. MIN_SIZE << 10
+
+    struct stats_t
+    {
+        uint64_t                acquired        = 0;
+        uint64_t                allocated       = 0;    // buffers that had to come from the allocator
+        uint64_t                in_use          = 0;    // bytes
+        uint64_t                cached          = 0;    // bytes on the free lists
+        uint64_t                trimmed         = 0;    // bytes freed by Trim()
+    };
+
+    class Buffer
+    {
+    public:
+        Buffer(void)
+        {
+        }
+
+        Buffer(Buffer &&other) noexcept
+        {
+            *this = std::move(other);
+        }
+
+        Buffer &operator=(Buffer &&other) noexcept
+        {
+            if (this != &other) {
+                Reset();
+                std::swap(pool, other.pool);
+                std::swap(data, other.data);
+                std::swap(capacity, other.capacity);
+            }
+            return *this;
+        }
+
+        ~Buffer(void)
+        {
+            Reset();
+        }
+
+        uint8_t *Data(void) const
+        {
+            return data;
+        }
+
+        size_t Capacity(void) const
+        {
+            return capacity;
+        }
+
+        explicit operator bool(void) const
+        {
+            return data != nullptr;
+        }
+
+        // returns the memory to the pool now instead of at destruction
+        void Reset(void)
+        {
+            if (data) {
+                pool->Release(data, capacity);
+                data = nullptr;
+                capacity = 0;
+            }
+        }
+
+    private:
+        friend class BufferPool;
+
+        Buffer(BufferPool *pool, uint8_t *data, size_t capacity) : pool(pool), data(data), capacity(capacity)
+        {
+        }
+
+        BufferPool             *pool        = nullptr;
+        uint8_t                *data        = nullptr;
+        size_t                  capacity    = 0;
+    };
+
+    BufferPool(void)
+    {
+    }
+
+    ~BufferPool(void)
+    {
+        Trim();
+    }
+
+    static BufferPool &Get(void)
+    {
+        static BufferPool pool;
+        return pool;
+    }
+
+    // at least 'size' bytes, uninitialized; throws std::bad_alloc like operator new
+    Buffer Acquire(size_t size)
+    {
+        auto cls = Class(size);
+        auto capacity = cls < 0 ? size : MIN_SIZE << cls;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stats.acquired++;
+            stats.in_use += capacity;
+            if (cls >= 0 && !free_lists[cls].empty()) {
+                auto data = free_lists[cls].back();
+                free_lists[cls].pop_back();
+                stats.cached -= capacity;
+                return Buffer(this, data, capacity);
+            }
+            stats.allocated++;
+        }
+        thread_allocated++;
+        auto data = static_cast<uint8_t *>(malloc(capacity));
+        if (!data) {
+            std::lock_guard<std::mutex> guard(lock);
+            stats.in_use -= capacity;
+            throw std::bad_alloc();
+        }
+        return Buffer(this, data, capacity);
+    }
+
+    // frees every cached buffer; returns the bytes freed
+    size_t Trim(void)
+    {
+        std::array<std::vector<uint8_t *>, CLASSES> lists = {};
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            lists.swap(free_lists);
+            stats.trimmed += stats.cached;
+        }
+        size_t bytes = 0;
+        for (size_t cls = 0; cls < CLASSES; cls++) {
+            for (auto data : lists[cls]) {
+                free(data);
+                bytes += MIN_SIZE << cls;
+            }
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        stats.cached -= bytes;
+        return bytes;
+    }
+
+    stats_t Stats(void) const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return stats;
+    }
+
+    // buffers the calling thread had to take from the allocator, from any pool
+    static uint64_t ThreadAllocated(void)
+    {
+        return thread_allocated;
+    }
+
+private:
+    // -1 past MAX_SIZE
+    static int Class(size_t size)
+    {
+        if (size > MAX_SIZE) {
+            return -1;
+        }
+        int cls = 0;
+        while ((MIN_SIZE << cls) < size) {
+            cls++;
+        }
+        return cls;
+    }
+
+    void Release(uint8_t *data, size_t capacity)
+    {
+        auto cls = Class(capacity);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stats.in_use -= capacity;
+            if (cls >= 0 && (MIN_SIZE << cls) == capacity) {
+                free_lists[cls].push_back(data);
+                stats.cached += capacity;
+                return;
+            }
+        }
+        free(data);
+    }
+
+    mutable std::mutex                                  lock            = {};
+    std::array<std::vector<uint8_t *>, CLASSES>         free_lists      = {};
+    stats_t                                             stats           = {};
+    static inline thread_local uint64_t                 thread_allocated = 0;
+};
+
+/**
+ * Bump allocator for the short-lived state of one transfer
+ *
+ *   Allocations are carved from pooled blocks and never freed one by one; Reset() hands every
+ *   block back to the pool at once when the transfer is over. Only trivially copyable types,
+ *   since nothing is destroyed.
+ */
+
+class TransferArena
+{
+public:
+    static constexpr size_t     BLOCK_SIZE      = BufferPool::MIN_SIZE;
+
+    TransferArena(void)
+    {
+    }
+
+    template <typename T>
+    T *Allocate(size_t count)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "the arena never runs destructors");
+        if (!count) {
+            return nullptr;
+        }
+        auto size = count * sizeof(T);
+        used = (used + alignof(T) - 1) & ~(alignof(T) - 1);
+        if (blocks.empty() || used + size > blocks.back().Capacity()) {
+            blocks.push_back(BufferPool::Get().Acquire(std::max(size, BLOCK_SIZE)));
+            used = 0;
+        }
+        auto ptr = blocks.back().Data() + used;
+        used += size;
+        return reinterpret_cast<T *>(ptr);
+    }
+
+    // everything allocated so far is gone
+    void Reset(void)
+    {
+        blocks.clear();
+        used = 0;
+    }
+
+    size_t Blocks(void) const
+    {
+        return blocks.size();
+    }
+
+private:
+    std::vector<BufferPool::Buffer>                     blocks          = {};
+    size_t                                              used            = 0;
+};
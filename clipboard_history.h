@@ -0,0 +1,522 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/**
+ * Append-only clipboard history in a memory-mapped log with a fixed-record index
+ *
+ *   '<path>' holds the entries back to back, '<path>.idx' one 16-byte record (offset, clip) per
+ *   entry; both start with the magic and the generation of the log. An entry is one distinct
+ *   payload with the selection and every (target, type) it was received or served as, the clip
+ *   (one paste or one copy) it belongs to and when it was appended:
+ *
+ *       header_t | selection, then target and type per target, each NUL-terminated, padded to 8 |
+ *       payload, padded to 8
+ *
+ *   Open() reads only the tail of the index: the last clip's entries are handed out as views into
+ *   a read-only mapping of the log, names included, so getting back to serving them after a
+ *   restart takes the same time for ten entries as for a million. A crash can leave a torn entry
+ *   or index record at the end; both files are cut back to the last complete entry.
+ *
+ *   An append is one pwritev() to the log and then one pwrite() to the index, so a record never
+ *   points past what the log holds. The log is flock()ed: one process appends at a time.
+ *
+ *   The log is kept under a size limit: a new clip that would go past it first compacts the files,
+ *   copying the newest whole clips that fit in half the limit (the last one at least) to new ones
+ *   of a new generation renamed over the old. The log is renamed first; an index left behind of
+ *   the old generation is rebuilt from the log by the next Open(), which is then small.
+ */
+
+class ClipboardHistory
+{
+public:
+    static constexpr uint64_t   MAGIC           = 0x3274736968626378;     // "xcbhist2"
+    static constexpr uint32_t   ENTRY_MAGIC     = 0x79746e65;             // "enty"
+    static constexpr uint64_t   HEADER_SIZE     = 16;       // magic and generation, in both files
+    static constexpr size_t     MAX_CLIP        = 64;       // entries of the last clip read back at most
+    static constexpr size_t     MAX_TORN        = 16;       // torn records dropped at most, past that the files are refused
+    static constexpr uint64_t   DEFAULT_LIMIT   = 64 * 1024 * 1024;
+
+    struct target_t
+    {
+        std::string_view                name        = {};
+        std::string_view                type        = {};
+    };
+
+    // views into the mapping, valid until Close()
+    struct entry_t
+    {
+        uint64_t                        clip        = 0;
+        uint64_t                        time_us     = 0;        // CLOCK_REALTIME
+        std::string_view                selection   = {};
+        std::vector<target_t>           targets     = {};       // every one of them has 'data'
+        std::string_view                data        = {};
+    };
+
+    struct stats_t
+    {
+        uint64_t                        entries     = 0;
+        uint64_t                        bytes       = 0;        // log size
+        uint64_t                        appended    = 0;
+        uint64_t                        dropped     = 0;        // torn records cut off by Open()
+        uint64_t                        compactions = 0;
+        bool                            rebuilt     = false;    // the index, by Open()
+    };
+
+    ClipboardHistory(void)
+    {
+    }
+
+    ClipboardHistory(const ClipboardHistory &) = delete;
+    ClipboardHistory &operator=(const ClipboardHistory &) = delete;
+
+    ~ClipboardHistory(void)
+    {
+        Close();
+    }
+
+    /**
+     * Creates both files if missing; false with errno set if they cannot be used (EBUSY: locked)
+     *
+     *   'limit' is the log size compactions keep it under, 0 for none; a single clip bigger than
+     *   that is still kept whole.
+     */
+    bool Open(const std::string &path, uint64_t limit = DEFAULT_LIMIT)
+    {
+        Close();
+        this->path = path;
+        this->limit = limit;
+        log_fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        index_fd = open((path + ".idx").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (log_fd >= 0 && flock(log_fd, LOCK_EX | LOCK_NB) < 0) {
+            Close();
+            errno = EBUSY;
+            return false;
+        }
+        uint64_t generation = 0;
+        uint64_t index_generation = 0;
+        if (log_fd < 0 || index_fd < 0 || !Prepare(log_fd, log_end, generation, Now()) ||
+            !Prepare(index_fd, index_end, index_generation, generation)) {
+            auto err = errno;
+            Close();
+            errno = err;
+            return false;
+        }
+
+        map_size = log_end;
+        map = static_cast<const uint8_t *>(mmap(nullptr, map_size, PROT_READ, MAP_SHARED, log_fd, 0));
+        if (map == MAP_FAILED) {
+            auto err = errno;
+            map = nullptr;
+            Close();
+            errno = err;
+            return false;
+        }
+        // an index of another generation, or none for a log with entries
+        if ((index_generation != generation || index_end == HEADER_SIZE) && log_end > HEADER_SIZE) {
+            if (!RebuildIndex(generation)) {
+                auto err = errno;
+                Close();
+                errno = err;
+                return false;
+            }
+        }
+        if (!Recover()) {
+            Close();
+            errno = EINVAL;
+            return false;
+        }
+        LoadLastClip();
+        return true;
+    }
+
+    void Close(void)
+    {
+        if (map) {
+            munmap(const_cast<uint8_t *>(map), map_size);
+            map = nullptr;
+        }
+        for (auto fd : {log_fd, index_fd}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        log_fd = index_fd = -1;
+        last_clip.clear();
+        next_clip = 1;
+        tail_clip = 0;
+        stats = {};
+    }
+
+    bool Opened(void) const
+    {
+        return log_fd >= 0;
+    }
+
+    // the entries of the newest clip in the order they were appended; empty for a new history
+    const std::vector<entry_t> &LastClip(void) const
+    {
+        return last_clip;
+    }
+
+    // a new clip id: every entry of one paste or copy is appended under the same one
+    uint64_t NextClip(void)
+    {
+        return next_clip++;
+    }
+
+    // one payload and every target it stands for; a clip's entries are appended one after another
+    bool Append(uint64_t clip, std::string_view selection, const std::vector<target_t> &targets, std::string_view data)
+    {
+        if (log_fd < 0) {
+            return false;
+        }
+        std::string names = {};
+        names.append(selection).push_back('\0');
+        for (auto &target : targets) {
+            names.append(target.name).push_back('\0');
+            names.append(target.type).push_back('\0');
+        }
+        header_t header = {ENTRY_MAGIC, static_cast<uint32_t>(names.size()), clip, Now(), data.size()};
+        names.resize(Pad(names.size()));
+
+        // only ahead of a new clip, so none is ever split
+        if (limit && stats.entries && clip != tail_clip && log_end + EntrySize(header) > limit && !Compact()) {
+            return false;
+        }
+
+        static const char zeros[8] = {};
+        struct iovec iov[] = {
+            {&header, sizeof(header)},
+            {names.data(), names.size()},
+            {const_cast<char *>(data.data()), data.size()},
+            {const_cast<char *>(zeros), Pad(data.size()) - data.size()},
+        };
+        auto size = EntrySize(header);
+        index_t record = {log_end, clip};
+        errno = 0;
+        if (pwritev(log_fd, iov, sizeof(iov) / sizeof(iov[0]), log_end) != static_cast<ssize_t>(size) ||
+            pwrite(index_fd, &record, sizeof(record), index_end) != sizeof(record)) {
+            auto err = errno ? errno : ENOSPC;
+            // cut a partial write back, so the next append does not leave a hole behind it
+            if (ftruncate(log_fd, log_end) < 0 || ftruncate(index_fd, index_end) < 0) {
+                err = errno;
+            }
+            errno = err;
+            return false;
+        }
+        log_end += size;
+        index_end += sizeof(record);
+        tail_clip = clip;
+        stats.entries++;
+        stats.bytes = log_end;
+        stats.appended++;
+        return true;
+    }
+
+    stats_t Stats(void) const
+    {
+        return stats;
+    }
+
+private:
+    struct header_t
+    {
+        uint32_t                        magic       = 0;
+        uint32_t                        names       = 0;        // bytes of names, without padding
+        uint64_t                        clip        = 0;
+        uint64_t                        time_us     = 0;
+        uint64_t                        size        = 0;        // bytes of payload, without padding
+    };
+
+    struct index_t
+    {
+        uint64_t                        offset      = 0;
+        uint64_t                        clip        = 0;
+    };
+
+    static constexpr uint64_t Pad(uint64_t len)
+    {
+        return (len + 7) & ~uint64_t{7};
+    }
+
+    static uint64_t EntrySize(const header_t &header)
+    {
+        return sizeof(header_t) + Pad(header.names) + Pad(header.size);
+    }
+
+    static uint64_t Now(void)
+    {
+        struct timespec ts = {};
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+    }
+
+    // writes the header to an empty file with 'fresh' as its generation, checks it otherwise; 'size' is the file size
+    static bool Prepare(int fd, uint64_t &size, uint64_t &generation, uint64_t fresh)
+    {
+        struct stat st = {};
+        if (fstat(fd, &st) < 0) {
+            return false;
+        }
+        if (!st.st_size) {
+            size = HEADER_SIZE;
+            generation = fresh;
+            return WriteHeader(fd, fresh);
+        }
+        uint64_t header[2] = {};
+        if (pread(fd, header, sizeof(header), 0) != sizeof(header) || header[0] != MAGIC) {
+            errno = EINVAL;
+            return false;
+        }
+        size = st.st_size;
+        generation = header[1];
+        return true;
+    }
+
+    static bool WriteHeader(int fd, uint64_t generation)
+    {
+        uint64_t header[] = {MAGIC, generation};
+        return pwrite(fd, header, sizeof(header), 0) == sizeof(header);
+    }
+
+    // the complete entry 'record' points at, or nullptr
+    const header_t *Entry(const index_t &record) const
+    {
+        if (record.offset < HEADER_SIZE || record.offset % 8 || record.offset + sizeof(header_t) > log_end) {
+            return nullptr;
+        }
+        auto header = reinterpret_cast<const header_t *>(map + record.offset);
+        if (header->magic != ENTRY_MAGIC || header->clip != record.clip || !header->names ||
+            header->size > log_end || record.offset + EntrySize(*header) > log_end ||
+            map[record.offset + sizeof(header_t) + header->names - 1] != '\0') {
+            return nullptr;
+        }
+        return header;
+    }
+
+    bool ReadRecord(uint64_t n, index_t &record) const
+    {
+        return pread(index_fd, &record, sizeof(record), HEADER_SIZE + n * sizeof(record)) == sizeof(record);
+    }
+
+    // walks the whole log up to its first incomplete entry; the log is small when this is needed
+    bool RebuildIndex(uint64_t generation)
+    {
+        std::vector<index_t> records = {};
+        for (uint64_t offset = HEADER_SIZE; offset + sizeof(header_t) <= log_end;) {
+            index_t record = {offset, reinterpret_cast<const header_t *>(map + offset)->clip};
+            auto header = Entry(record);
+            if (!header) {
+                break;
+            }
+            records.push_back(record);
+            offset += EntrySize(*header);
+        }
+        auto size = records.size() * sizeof(index_t);
+        if (!WriteHeader(index_fd, generation) ||
+            (size && pwrite(index_fd, records.data(), size, HEADER_SIZE) != static_cast<ssize_t>(size)) ||
+            ftruncate(index_fd, HEADER_SIZE + size) < 0) {
+            return false;
+        }
+        index_end = HEADER_SIZE + size;
+        stats.rebuilt = true;
+        return true;
+    }
+
+    /**
+     * Copies the newest whole clips that fit in half the limit, the last one at least, to new files
+     * renamed over the old ones
+     *
+     *   The mapping stays on the old log until Close(): views handed out, e.g. the last clip being
+     *   served, stay valid.
+     */
+    bool Compact(void)
+    {
+        auto count = stats.entries;
+        uint64_t keep = count;      // the first record kept
+        while (keep) {
+            index_t first = {};
+            if (!ReadRecord(keep - 1, first)) {
+                return false;
+            }
+            auto begin = keep - 1;
+            for (index_t record = {}; begin && ReadRecord(begin - 1, record) && record.clip == first.clip; begin--) {
+                first = record;
+            }
+            if (keep != count && log_end - first.offset > limit / 2) {
+                break;
+            }
+            keep = begin;
+        }
+        if (!keep) {
+            return true;
+        }
+
+        index_t first = {};
+        std::vector<index_t> records(count - keep);
+        auto size = static_cast<ssize_t>(records.size() * sizeof(index_t));
+        if (!ReadRecord(keep, first) || pread(index_fd, records.data(), size, HEADER_SIZE + keep * sizeof(index_t)) != size) {
+            return false;
+        }
+        auto shift = first.offset - HEADER_SIZE;
+        for (auto &record : records) {
+            record.offset -= shift;
+        }
+
+        auto log_path = path + ".tmp";
+        auto index_path = path + ".idx.tmp";
+        auto generation = Now();
+        auto new_log = open(log_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        auto new_index = open(index_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        errno = 0;
+        auto rc = new_log >= 0 && new_index >= 0 && flock(new_log, LOCK_EX | LOCK_NB) == 0 &&
+                  WriteHeader(new_log, generation) && WriteHeader(new_index, generation) &&
+                  CopyRange(new_log, first.offset, log_end - first.offset) &&
+                  pwrite(new_index, records.data(), size, HEADER_SIZE) == size &&
+                  rename(log_path.c_str(), path.c_str()) == 0;
+        if (!rc) {
+            auto err = errno ? errno : EIO;
+            for (auto fd : {new_log, new_index}) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+            unlink(log_path.c_str());
+            unlink(index_path.c_str());
+            errno = err;
+            return false;
+        }
+        // the log is in place: from here on the new files are ours, even if the index stays behind
+        if (rename(index_path.c_str(), (path + ".idx").c_str()) < 0) {
+            unlink(index_path.c_str());
+        }
+        close(log_fd);
+        close(index_fd);
+        log_fd = new_log;
+        index_fd = new_index;
+        log_end -= shift;
+        index_end = HEADER_SIZE + size;
+        stats.entries = records.size();
+        stats.bytes = log_end;
+        stats.compactions++;
+        return true;
+    }
+
+    // 'len' bytes of the log from 'offset' to the start of 'fd', past its header
+    bool CopyRange(int fd, uint64_t offset, uint64_t len) const
+    {
+        loff_t in = offset;
+        loff_t out = HEADER_SIZE;
+        while (len) {
+            auto bytes = copy_file_range(log_fd, &in, fd, &out, len, 0);
+            if (bytes <= 0) {
+                return false;
+            }
+            len -= bytes;
+        }
+        return true;
+    }
+
+    // drops torn records from the end of the index, and whatever the log holds past the last entry
+    bool Recover(void)
+    {
+        auto count = (index_end - HEADER_SIZE) / sizeof(index_t);
+        uint64_t end = HEADER_SIZE;
+        for (; count; count--) {
+            index_t record = {};
+            if (ReadRecord(count - 1, record)) {
+                if (auto header = Entry(record)) {
+                    end = record.offset + EntrySize(*header);
+                    break;
+                }
+            }
+            if (++stats.dropped > MAX_TORN) {
+                return false;
+            }
+        }
+
+        auto records = HEADER_SIZE + count * sizeof(index_t);
+        if ((records != index_end && ftruncate(index_fd, records) < 0) ||
+            (end != log_end && ftruncate(log_fd, end) < 0)) {
+            return false;
+        }
+        index_end = records;
+        log_end = end;
+        stats.entries = count;
+        stats.bytes = log_end;
+        return true;
+    }
+
+    // walks back from the last record while the clip stays the same, at most MAX_CLIP records
+    void LoadLastClip(void)
+    {
+        auto count = stats.entries;
+        for (size_t n = 0; n < MAX_CLIP && n < count; n++) {
+            index_t record = {};
+            if (!ReadRecord(count - 1 - n, record) || (n && record.clip != last_clip.front().clip)) {
+                break;
+            }
+            auto header = Entry(record);
+            if (!header) {
+                break;
+            }
+            last_clip.insert(last_clip.begin(), Parse(record.offset, *header));
+        }
+        if (!last_clip.empty()) {
+            tail_clip = last_clip.back().clip;
+            next_clip = tail_clip + 1;
+        }
+    }
+
+    // only splits the names: the payload is not touched
+    entry_t Parse(uint64_t offset, const header_t &header) const
+    {
+        entry_t entry = {};
+        entry.clip = header.clip;
+        entry.time_us = header.time_us;
+
+        auto names = reinterpret_cast<const char *>(map + offset + sizeof(header_t));
+        size_t field = 0;
+        for (size_t pos = 0; pos < header.names; field++) {
+            std::string_view name(names + pos);
+            pos += name.size() + 1;
+            if (field == 0) {
+                entry.selection = name;
+            } else if (field % 2) {
+                // a target without a type is its own type
+                entry.targets.push_back({name, name});
+            } else {
+                entry.targets.back().type = name;
+            }
+        }
+        entry.data = {names + Pad(header.names), header.size};
+        return entry;
+    }
+
+    std::string                         path        = {};
+    uint64_t                            limit       = 0;
+    int                                 log_fd      = -1;
+    int                                 index_fd    = -1;
+    uint64_t                            log_end     = 0;
+    uint64_t                            index_end   = 0;
+    const uint8_t                      *map         = nullptr;
+    size_t                              map_size    = 0;
+    std::vector<entry_t>                last_clip   = {};
+    uint64_t                            next_clip   = 1;
+    uint64_t                            tail_clip   = 0;        // of the last entry appended
+    stats_t                             stats       = {};
+};
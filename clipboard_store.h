@@ -0,0 +1,483 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <list>
+#include <map>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * Streaming 64-bit content hash (XXH64)
+ *
+ *   Data is fed in whatever pieces it arrives in; 32-byte stripes are consumed as soon as they
+ *   are complete, so hashing an INCR transfer costs no extra pass over the payload.
+ */
+
+class Hash64
+{
+public:
+    Hash64(uint64_t seed = 0)
+    {
+        Reset(seed);
+    }
+
+    void Reset(uint64_t seed = 0)
+    {
+        lanes = {seed + P1 + P2, seed + P2, seed, seed - P1};
+        this->seed = seed;
+        total = 0;
+        buffered = 0;
+    }
+
+    void Update(const void *data, size_t len)
+    {
+        auto p = static_cast<const uint8_t *>(data);
+        total += len;
+
+        if (buffered) {
+            auto fill = std::min(len, sizeof(buffer) - buffered);
+            memcpy(buffer + buffered, p, fill);
+            buffered += fill;
+            p += fill;
+            len -= fill;
+            if (buffered < sizeof(buffer)) {
+                return;
+            }
+            Stripe(buffer);
+            buffered = 0;
+        }
+        for (; len >= sizeof(buffer); p += sizeof(buffer), len -= sizeof(buffer)) {
+            Stripe(p);
+        }
+        memcpy(buffer, p, len);
+        buffered = len;
+    }
+
+    uint64_t Digest(void) const
+    {
+        uint64_t h = 0;
+        if (total >= sizeof(buffer)) {
+            h = Rotl(lanes[0], 1) + Rotl(lanes[1], 7) + Rotl(lanes[2], 12) + Rotl(lanes[3], 18);
+            for (auto lane : lanes) {
+                h = (h ^ Round(0, lane)) * P1 + P4;
+            }
+        } else {
+            h = seed + P5;
+        }
+        h += total;
+
+        auto p = buffer;
+        auto len = buffered;
+        for (; len >= 8; p += 8, len -= 8) {
+            h = Rotl(h ^ Round(0, Read64(p)), 27) * P1 + P4;
+        }
+        if (len >= 4) {
+            h = Rotl(h ^ (Read32(p) * P1), 23) * P2 + P3;
+            p += 4;
+            len -= 4;
+        }
+        for (; len; p++, len--) {
+            h = Rotl(h ^ (*p * P5), 11) * P1;
+        }
+
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+        return h;
+    }
+
+private:
+    static constexpr uint64_t   P1  = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t   P2  = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t   P3  = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t   P4  = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t   P5  = 0x27D4EB2F165667C5ULL;
+
+    static uint64_t Rotl(uint64_t v, int r)
+    {
+        return (v << r) | (v >> (64 - r));
+    }
+
+    static uint64_t Read64(const uint8_t *p)
+    {
+        uint64_t v = 0;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint64_t Read32(const uint8_t *p)
+    {
+        uint32_t v = 0;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint64_t Round(uint64_t acc, uint64_t input)
+    {
+        return Rotl(acc + input * P2, 31) * P1;
+    }
+
+    void Stripe(const uint8_t *p)
+    {
+        for (size_t i = 0; i < lanes.size(); i++) {
+            lanes[i] = Round(lanes[i], Read64(p + i * 8));
+        }
+    }
+
+    std::array<uint64_t, 4>     lanes       = {};
+    uint64_t                    seed        = 0;
+    uint64_t                    total       = 0;
+    uint8_t                     buffer[32]  = {};
+    size_t                      buffered    = 0;
+};
+
+/**
+ * Content-addressed clipboard store
+ *
+ *   Every payload is kept once, keyed by its hash and length and confirmed with memcmp, and any
+ *   number of (selection, target) keys may point at it.
+ *
+ *   - payloads up to MAX_SLOT_SIZE live in power-of-two slots carved from SLAB_SIZE slabs; freed
+ *     slots go on a per-class free list, so steady-state copying does not touch the allocator,
+ *     and a slab left empty by an eviction is returned
+ *   - larger payloads keep the buffer they were received into, so they are not copied; only a
+ *     buffer reserved at over twice what arrived (an INCR owner that over-announced) is shrunk
+ *   - when the memory held (slabs and large buffers, not just payload bytes) exceeds the limit,
+ *     the least recently used payloads are evicted together with every key that points at them
+ *
+ *   Views returned by Find() stay valid until the next Commit() or Put().
+ */
+
+class ClipboardStore
+{
+public:
+    static constexpr size_t     MIN_SLOT_SIZE   = 64;
+    static constexpr size_t     MAX_SLOT_SIZE   = 64 * 1024;
+    static constexpr size_t     SLAB_SIZE       = 1024 * 1024;
+    static constexpr size_t     MAX_RESERVE     = 1024 * 1024;        // an announced size is only a lower bound
+
+    struct stats_t
+    {
+        uint64_t                blobs           = 0;
+        uint64_t                keys            = 0;
+        uint64_t                bytes           = 0;    // payload bytes held, counted once
+        uint64_t                reserved        = 0;    // slab and large buffer memory
+        uint64_t                stored          = 0;    // commits that added a payload
+        uint64_t                deduplicated    = 0;    // commits that found it already stored
+        uint64_t                evicted         = 0;
+    };
+
+    // one incoming transfer; fed chunk by chunk, hashed as it goes
+    class Writer
+    {
+    public:
+        void Append(const void *data, size_t len)
+        {
+            auto p = static_cast<const uint8_t *>(data);
+            buffer.insert(buffer.end(), p, p + len);
+            hash.Update(data, len);
+        }
+
+        // 'len' is a hint, e.g. the lower bound an INCR transfer announces; capped at MAX_RESERVE
+        void Reserve(size_t len)
+        {
+            buffer.reserve(std::min(len, MAX_RESERVE));
+        }
+
+        size_t Size(void) const
+        {
+            return buffer.size();
+        }
+
+    private:
+        friend class ClipboardStore;
+
+        std::vector<uint8_t>    buffer  = {};
+        Hash64                  hash    = {};
+    };
+
+    struct result_t
+    {
+        uint64_t                hash            = 0;
+        size_t                  size            = 0;
+        bool                    deduplicated    = false;
+    };
+
+    ClipboardStore(size_t limit = 64 * 1024 * 1024) : limit(limit)
+    {
+    }
+
+    void SetLimit(size_t limit)
+    {
+        this->limit = limit;
+        Evict(nullptr);
+    }
+
+    // points (selection, target) at the writer's content, storing it only if it is new
+    result_t Commit(uint32_t selection, uint32_t target, uint32_t type, Writer &writer)
+    {
+        auto result = Store(key_t{selection, target}, type, writer.hash.Digest(), writer.buffer.data(), writer.buffer.size(), &writer.buffer);
+        writer = {};
+        return result;
+    }
+
+    // same as Commit() for a payload received in one piece; nothing is copied if it is already stored
+    result_t Put(uint32_t selection, uint32_t target, uint32_t type, const void *data, size_t len)
+    {
+        Hash64 hash = {};
+        hash.Update(data, len);
+        return Store(key_t{selection, target}, type, hash.Digest(), static_cast<const uint8_t *>(data), len, nullptr);
+    }
+
+    // the content last stored for (selection, target), or false if it was never stored or evicted
+    bool Find(uint32_t selection, uint32_t target, std::string_view &data, uint32_t *type = nullptr)
+    {
+        auto iter = keys.find(key_t{selection, target});
+        if (iter == keys.end()) {
+            return false;
+        }
+        auto blob = iter->second.blob;
+        Touch(blob);
+        data = std::string_view(reinterpret_cast<const char *>(blob->data), blob->size);
+        if (type) {
+            *type = iter->second.type;
+        }
+        return true;
+    }
+
+    // every target stored for 'selection'
+    std::vector<uint32_t> Targets(uint32_t selection) const
+    {
+        std::vector<uint32_t> targets = {};
+        for (auto iter = keys.lower_bound(key_t{selection, 0}); iter != keys.end() && iter->first.first == selection; iter++) {
+            targets.push_back(iter->first.second);
+        }
+        return targets;
+    }
+
+    // forgets every key of 'selection'; payloads stay until evicted
+    void Clear(uint32_t selection)
+    {
+        for (auto iter = keys.lower_bound(key_t{selection, 0}); iter != keys.end() && iter->first.first == selection;) {
+            iter->second.blob->refs--;
+            iter = keys.erase(iter);
+        }
+    }
+
+    stats_t Stats(void) const
+    {
+        auto stats = this->stats;
+        stats.blobs = lru.size();
+        stats.keys  = keys.size();
+        return stats;
+    }
+
+private:
+    using key_t = std::pair<uint32_t, uint32_t>;
+
+    struct blob_t
+    {
+        uint64_t                hash        = 0;
+        const uint8_t          *data        = nullptr;
+        size_t                  size        = 0;
+        int                     cls         = -1;   // slot class, -1 for a large buffer
+        uint8_t                *slot        = nullptr;
+        std::vector<uint8_t>    large       = {};
+        size_t                  refs        = 0;
+        std::list<blob_t>::iterator lru     = {};
+    };
+
+    struct ref_t
+    {
+        blob_t                 *blob        = nullptr;
+        uint32_t                type        = 0;
+    };
+
+    static constexpr int        CLASSES     = 11;   // 64 B .. 64 KiB
+
+    static int SlotClass(size_t len)
+    {
+        int cls = 0;
+        for (size_t size = MIN_SLOT_SIZE; size < len; size <<= 1) {
+            cls++;
+        }
+        return cls;
+    }
+
+    // 'owned', if set, holds the data and may be moved from
+    result_t Store(key_t key, uint32_t type, uint64_t hash, const uint8_t *data, size_t len, std::vector<uint8_t> *owned)
+    {
+        result_t result = {};
+        result.hash = hash;
+        result.size = len;
+
+        auto blob = Lookup(hash, data, len);
+        if (blob) {
+            result.deduplicated = true;
+            stats.deduplicated++;
+        } else {
+            blob = Insert(hash, data, len, owned);
+            stats.stored++;
+        }
+
+        Bind(key, blob, type);
+        Touch(blob);
+        Evict(blob);
+        return result;
+    }
+
+    blob_t *Lookup(uint64_t hash, const uint8_t *data, size_t len)
+    {
+        auto range = index.equal_range(hash);
+        for (auto iter = range.first; iter != range.second; iter++) {
+            auto blob = iter->second;
+            if (blob->size == len && !memcmp(blob->data, data, len)) {
+                return blob;
+            }
+        }
+        return nullptr;
+    }
+
+    blob_t *Insert(uint64_t hash, const uint8_t *data, size_t len, std::vector<uint8_t> *owned)
+    {
+        lru.emplace_front();
+        auto blob = &lru.front();
+        blob->lru  = lru.begin();
+        blob->hash = hash;
+        blob->size = len;
+
+        if (len <= MAX_SLOT_SIZE) {
+            blob->cls  = SlotClass(len);
+            blob->slot = AllocSlot(blob->cls);
+            memcpy(blob->slot, data, len);
+            blob->data = blob->slot;
+        } else {
+            if (owned) {
+                // growth leaves at most twice the size; past that the reserve was over-announced
+                if (owned->capacity() > 2 * len) {
+                    owned->shrink_to_fit();
+                }
+                blob->large = std::move(*owned);
+            } else {
+                blob->large.assign(data, data + len);
+            }
+            blob->data = blob->large.data();
+            stats.reserved += blob->large.capacity();
+        }
+        stats.bytes += blob->size;
+        index.emplace(hash, blob);
+        return blob;
+    }
+
+    void Bind(key_t key, blob_t *blob, uint32_t type)
+    {
+        auto &ref = keys[key];
+        if (ref.blob) {
+            ref.blob->refs--;
+        }
+        ref.blob = blob;
+        ref.type = type;
+        blob->refs++;
+    }
+
+    void Touch(blob_t *blob)
+    {
+        lru.splice(lru.begin(), lru, blob->lru);
+    }
+
+    // keeps 'keep' even if it alone exceeds the limit
+    void Evict(blob_t *keep)
+    {
+        while (stats.reserved > limit && !lru.empty() && &lru.back() != keep) {
+            Remove(&lru.back());
+        }
+    }
+
+    void Remove(blob_t *blob)
+    {
+        if (blob->refs) {
+            for (auto iter = keys.begin(); iter != keys.end();) {
+                iter = iter->second.blob == blob ? keys.erase(iter) : std::next(iter);
+            }
+        }
+
+        auto range = index.equal_range(blob->hash);
+        for (auto iter = range.first; iter != range.second; iter++) {
+            if (iter->second == blob) {
+                index.erase(iter);
+                break;
+            }
+        }
+
+        if (blob->cls >= 0) {
+            FreeSlot(blob->cls, blob->slot);
+        } else {
+            stats.reserved -= blob->large.capacity();
+        }
+        stats.bytes -= blob->size;
+        stats.evicted++;
+        lru.erase(blob->lru);
+    }
+
+    struct slab_t
+    {
+        std::unique_ptr<uint8_t[]>  memory      = {};
+        size_t                      used        = 0;    // slots handed out
+    };
+
+    // the slab 'slot' was carved from
+    slab_t &SlabOf(const uint8_t *slot)
+    {
+        return std::prev(slabs.upper_bound(slot))->second;
+    }
+
+    uint8_t *AllocSlot(int cls)
+    {
+        auto &free_list = free_slots[cls];
+        if (free_list.empty()) {
+            auto slot_size = MIN_SLOT_SIZE << cls;
+            auto memory = new uint8_t[SLAB_SIZE];
+            slabs[memory].memory.reset(memory);
+            stats.reserved += SLAB_SIZE;
+            for (size_t offset = SLAB_SIZE; offset >= slot_size; offset -= slot_size) {
+                free_list.push_back(memory + offset - slot_size);
+            }
+        }
+        auto slot = free_list.back();
+        free_list.pop_back();
+        SlabOf(slot).used++;
+        return slot;
+    }
+
+    // only evictions free slots, so a slab they leave empty is returned: the store is over its limit
+    void FreeSlot(int cls, uint8_t *slot)
+    {
+        auto &free_list = free_slots[cls];
+        auto &slab = SlabOf(slot);
+        if (--slab.used) {
+            free_list.push_back(slot);
+            return;
+        }
+        auto begin = slab.memory.get();
+        free_list.erase(std::remove_if(free_list.begin(), free_list.end(), [begin](const uint8_t *free) {
+            return free >= begin && free < begin + SLAB_SIZE;
+        }), free_list.end());
+        slabs.erase(begin);
+        stats.reserved -= SLAB_SIZE;
+    }
+
+    size_t                                              limit       = 0;
+    std::list<blob_t>                                   lru         = {};   // most recently used first
+    std::unordered_multimap<uint64_t, blob_t *>         index       = {};
+    std::map<key_t, ref_t>                              keys        = {};
+    std::map<const uint8_t *, slab_t>                   slabs       = {};   // by address
+    std::array<std::vector<uint8_t *>, CLASSES>         free_slots  = {};
+    stats_t                                             stats       = {};
+};
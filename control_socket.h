@@ -0,0 +1,471 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "memfd_handoff.h"
+#include "task_queue.h"
+
+/**
+ * Local control API: set and read the clipboard over one long-lived Unix socket
+ *
+ *   SOCK_SEQPACKET, so every request and every reply is exactly one message, a text line
+ *   optionally followed by content:
+ *
+ *       set <target>...\n<content>     -> ok                           serve <content> as every target
+ *       get <target>\n                 -> ok <type> <size>\n<content>
+ *       status\n                       -> ok <owned|foreign|none> <owner> <target>...
+ *
+ *   and anything that fails is answered with 'error <reason>'. Content that fits in MAX_MESSAGE
+ *   travels in the message; larger content is passed as a file descriptor (SCM_RIGHTS) with the
+ *   line alone: a regular file or memfd from the client, a sealed memfd from us, so a large payload
+ *   is never pushed through the socket. A pipe or socket is refused: reading it to its end could
+ *   block every other client for as long as its writer keeps it open.
+ *
+ *   - one thread accepts clients and reads their requests; the handler given to Listen() passes
+ *     each request on (to the event thread) and Reply() hands the answer back to this thread,
+ *     through a TaskQueue it polls along with the sockets
+ *   - only peers with our uid are served
+ *   - Connect() and Call() are the client side
+ */
+
+class ControlSocket
+{
+public:
+    static constexpr size_t     MAX_MESSAGE     = 64 * 1024;
+    static constexpr size_t     MAX_CONTENT     = 256 * 1024 * 1024;
+    static constexpr size_t     MAX_CLIENTS     = 64;
+
+    using blob_t = std::shared_ptr<const std::string>;
+
+    struct request_t
+    {
+        uint64_t                    client          = 0;
+        std::vector<std::string>    args            = {};   // the request line split on spaces, never empty
+        blob_t                      content         = {};   // nullptr if none came with it
+    };
+
+    struct reply_t
+    {
+        std::string                 line            = {};   // without the newline
+        blob_t                      content         = {};
+    };
+
+    struct stats_t
+    {
+        uint64_t                    clients         = 0;
+        uint64_t                    requests        = 0;
+        uint64_t                    fds_received    = 0;
+        uint64_t                    fds_sent        = 0;
+    };
+
+    // called on the control thread for every well-formed request; it must answer with Reply()
+    using handler_t = std::function<void(const request_t &)>;
+
+    ControlSocket(void)
+    {
+    }
+
+    ~ControlSocket(void)
+    {
+        Stop();
+    }
+
+    ControlSocket(const ControlSocket &) = delete;
+    ControlSocket &operator=(const ControlSocket &) = delete;
+
+    // 'path' is a file system path, or '@name' for an abstract socket; a stale socket file is replaced
+    bool Listen(const std::string &path, handler_t handler)
+    {
+        struct sockaddr_un addr = {};
+        socklen_t addr_len = 0;
+        if (path.empty() || path.size() > sizeof(addr.sun_path) - 1) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        if (tasks.Fd() < 0) {
+            errno = tasks.Error();
+            return false;
+        }
+        MemfdHandoff::Address(path, addr, addr_len);
+
+        listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) {
+            return false;
+        }
+        if (path[0] != '@') {
+            unlink(path.c_str());
+        }
+        if (bind(listen_fd, reinterpret_cast<struct sockaddr *>(&addr), addr_len) < 0 || listen(listen_fd, 16) < 0) {
+            auto err = errno;
+            close(listen_fd);
+            listen_fd = -1;
+            errno = err;
+            return false;
+        }
+
+        this->path = path;
+        this->handler = std::move(handler);
+        running = true;
+        thread = std::thread([this] { Serve(); });
+        return true;
+    }
+
+    void Stop(void)
+    {
+        if (listen_fd < 0) {
+            return;
+        }
+        tasks.Post([this] { running = false; });
+        thread.join();
+        for (auto &iter : clients) {
+            close(iter.second);
+        }
+        clients.clear();
+        close(listen_fd);
+        listen_fd = -1;
+        if (path[0] != '@') {
+            unlink(path.c_str());
+        }
+    }
+
+    bool Listening(void) const
+    {
+        return listen_fd >= 0;
+    }
+
+    // from any thread; dropped if the client has gone meanwhile
+    void Reply(uint64_t client, reply_t reply)
+    {
+        tasks.Post([this, client, reply = std::move(reply)] { Send(client, reply); });
+    }
+
+    stats_t Stats(void) const
+    {
+        stats_t stats = {};
+        stats.clients      = clients_accepted.load(std::memory_order_relaxed);
+        stats.requests     = requests.load(std::memory_order_relaxed);
+        stats.fds_received = fds_received.load(std::memory_order_relaxed);
+        stats.fds_sent     = fds_sent.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    // client side: a blocking connection to the socket at 'path', -1 on failure
+    static int Connect(const std::string &path)
+    {
+        struct sockaddr_un addr = {};
+        socklen_t addr_len = 0;
+        if (path.empty() || path.size() > sizeof(addr.sun_path) - 1) {
+            return -1;
+        }
+        MemfdHandoff::Address(path, addr, addr_len);
+
+        auto sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (sock < 0) {
+            return -1;
+        }
+        if (connect(sock, reinterpret_cast<struct sockaddr *>(&addr), addr_len) < 0) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    /**
+     * Client side: sends one request and waits for its reply
+     *
+     *   'content' that does not fit in one message is sent as a memfd; content that comes back
+     *   as an fd is read into 'reply_content'. True if the reply line starts with 'ok'.
+     */
+    static bool Call(int sock, std::string_view line, std::string_view content, std::string &reply, std::string &reply_content)
+    {
+        std::string request(line);
+        request += '\n';
+        auto sent = false;
+        if (request.size() + content.size() > MAX_MESSAGE) {
+            auto fd = MemfdHandoff::CreateMemfd(content);
+            if (fd < 0) {
+                return false;
+            }
+            sent = SendMessage(sock, request, {}, fd, 0);
+            close(fd);
+        } else {
+            sent = SendMessage(sock, request, content, -1, 0);
+        }
+        if (!sent) {
+            return false;
+        }
+
+        std::vector<char> buf(MAX_MESSAGE);
+        auto fd = -1;
+        auto truncated = false;
+        auto len = RecvMessage(sock, buf.data(), buf.size(), fd, truncated);
+        if (len <= 0 || truncated) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return false;
+        }
+
+        std::string_view message(buf.data(), len);
+        auto eol = message.find('\n');
+        reply = message.substr(0, eol);
+        reply_content.clear();
+        if (fd >= 0) {
+            auto blob = ReadContent(fd);
+            close(fd);
+            if (!blob) {
+                return false;
+            }
+            reply_content = *blob;
+        } else if (eol != std::string_view::npos) {
+            reply_content = message.substr(eol + 1);
+        }
+        return reply.compare(0, 2, "ok") == 0;
+    }
+
+private:
+    void Serve(void)
+    {
+        std::vector<struct pollfd> fds = {};
+        std::vector<uint64_t> ids = {};
+        buffer.resize(MAX_MESSAGE);
+        while (running) {
+            fds.clear();
+            ids.clear();
+            fds.push_back({listen_fd, POLLIN, 0});
+            fds.push_back({tasks.Fd(), POLLIN, 0});
+            for (auto &iter : clients) {
+                fds.push_back({iter.second, POLLIN, 0});
+                ids.push_back(iter.first);
+            }
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+
+            // replies first: a client is answered before its next request is read
+            if (fds[1].revents) {
+                tasks.Wakeup();
+            }
+            if (fds[0].revents) {
+                Accept();
+            }
+            for (size_t i = 2; i < fds.size(); i++) {
+                if (fds[i].revents) {
+                    Receive(ids[i - 2]);
+                }
+            }
+        }
+    }
+
+    void Accept(void)
+    {
+        auto sock = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (sock < 0) {
+            return;
+        }
+        struct ucred cred = {};
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 || cred.uid != getuid() || clients.size() >= MAX_CLIENTS) {
+            close(sock);
+            return;
+        }
+        clients[++last_client] = sock;
+        clients_accepted.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Receive(uint64_t client)
+    {
+        auto iter = clients.find(client);
+        if (iter == clients.end()) {
+            return;
+        }
+
+        auto fd = -1;
+        auto truncated = false;
+        auto len = RecvMessage(iter->second, buffer.data(), buffer.size(), fd, truncated);
+        if (len <= 0) {
+            // hung up, or the socket failed
+            close(iter->second);
+            clients.erase(iter);
+            return;
+        }
+        requests.fetch_add(1, std::memory_order_relaxed);
+
+        request_t request = {};
+        request.client = client;
+        std::string_view message(buffer.data(), len);
+        auto eol = message.find('\n');
+        auto line = message.substr(0, eol);
+        for (size_t begin = 0; begin < line.size();) {
+            auto end = std::min(line.find(' ', begin), line.size());
+            if (end > begin) {
+                request.args.emplace_back(line.substr(begin, end - begin));
+            }
+            begin = end + 1;
+        }
+
+        if (fd >= 0) {
+            fds_received.fetch_add(1, std::memory_order_relaxed);
+            request.content = ReadContent(fd);
+            close(fd);
+            if (!request.content) {
+                Send(client, {"error the content must be passed as a regular file or memfd", {}});
+                return;
+            }
+        } else if (eol != std::string_view::npos && eol + 1 < message.size()) {
+            request.content = std::make_shared<const std::string>(message.substr(eol + 1));
+        }
+
+        if (truncated) {
+            Send(client, {"error message too long, pass content over " + std::to_string(MAX_MESSAGE) + " bytes as a file descriptor", {}});
+        } else if (request.args.empty()) {
+            Send(client, {"error empty request", {}});
+        } else {
+            handler(request);
+        }
+    }
+
+    // control thread only; a client that cannot take its reply right away is dropped
+    void Send(uint64_t client, const reply_t &reply)
+    {
+        auto iter = clients.find(client);
+        if (iter == clients.end()) {
+            return;
+        }
+
+        auto line = reply.line + '\n';
+        auto sent = false;
+        if (reply.content && line.size() + reply.content->size() > MAX_MESSAGE) {
+            auto fd = MemfdHandoff::CreateMemfd(*reply.content);
+            if (fd < 0) {
+                sent = SendMessage(iter->second, "error cannot create a memfd\n", {}, -1, MSG_DONTWAIT);
+            } else {
+                sent = SendMessage(iter->second, line, {}, fd, MSG_DONTWAIT);
+                close(fd);
+                fds_sent.fetch_add(1, std::memory_order_relaxed);
+            }
+        } else {
+            sent = SendMessage(iter->second, line, reply.content ? std::string_view(*reply.content) : std::string_view(), -1, MSG_DONTWAIT);
+        }
+        if (!sent) {
+            close(iter->second);
+            clients.erase(iter);
+        }
+    }
+
+    // 'line' and 'content' as one message, with 'fd' attached unless it is -1
+    static bool SendMessage(int sock, std::string_view line, std::string_view content, int fd, int flags)
+    {
+        struct iovec iov[2] = {
+            {const_cast<char *>(line.data()), line.size()},
+            {const_cast<char *>(content.data()), content.size()},
+        };
+        char control[CMSG_SPACE(sizeof(int))] = {};
+        struct msghdr msg = {};
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = content.empty() ? 1 : 2;
+        if (fd >= 0) {
+            msg.msg_control    = control;
+            msg.msg_controllen = sizeof(control);
+            auto cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type  = SCM_RIGHTS;
+            cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+        ssize_t rc = 0;
+        do {
+            rc = sendmsg(sock, &msg, MSG_NOSIGNAL | flags);
+        } while (rc < 0 && errno == EINTR);
+        return rc == static_cast<ssize_t>(line.size() + content.size());
+    }
+
+    // one message into 'buf' and the fd attached to it, if any; 0 once the peer has hung up
+    static ssize_t RecvMessage(int sock, char *buf, size_t len, int &fd, bool &truncated)
+    {
+        struct iovec iov = {buf, len};
+        char control[CMSG_SPACE(sizeof(int))] = {};
+        struct msghdr msg = {};
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t rc = 0;
+        do {
+            rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        } while (rc < 0 && errno == EINTR);
+        fd = -1;
+        truncated = msg.msg_flags & MSG_TRUNC;
+        auto cmsg = rc >= 0 ? CMSG_FIRSTHDR(&msg) : nullptr;
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+        return rc;
+    }
+
+    // everything a file or memfd holds from offset 0; nullptr for anything else
+    static blob_t ReadContent(int fd)
+    {
+        struct stat st = {};
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            return {};
+        }
+        size_t size = st.st_size;
+        if (size > MAX_CONTENT) {
+            return {};
+        }
+        // read, not mapped: the client may truncate it meanwhile, which would SIGBUS a mapping
+        auto content = std::make_shared<std::string>(size, '\0');
+        size_t done = 0;
+        while (done < size) {
+            auto bytes = pread(fd, content->data() + done, size - done, done);
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes < 0) {
+                return {};
+            }
+            if (!bytes) {
+                content->resize(done);
+                break;
+            }
+            done += bytes;
+        }
+        return content;
+    }
+
+    std::string                                 path                = {};
+    int                                         listen_fd           = -1;
+    handler_t                                   handler             = {};
+    bool                                        running             = false;    // control thread only
+    std::thread                                 thread              = {};
+    TaskQueue                                   tasks               = {};
+    std::map<uint64_t, int>                     clients             = {};
+    uint64_t                                    last_client         = 0;
+    std::vector<char>                           buffer              = {};
+
+    std::atomic<uint64_t>                       clients_accepted    = 0;
+    std::atomic<uint64_t>                       requests            = 0;
+    std::atomic<uint64_t>                       fds_received        = 0;
+    std::atomic<uint64_t>                       fds_sent            = 0;
+};
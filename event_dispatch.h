@@ -0,0 +1,272 @@
+#pragma once
+#include <cstdint>
+#include <array>
+#include <type_traits>
+#include <xcb/xcb.h>
+
+/**
+ * Typed event dispatch with a jump table built at compile time
+ *
+ *   Handlers are member functions taking the event type they handle, registered by pointer:
+ *
+ *       using dispatcher_t = EventDispatcher<Selection,
+ *           On<&Selection::ProcError>,
+ *           On<&Selection::ProcButtonPress, XCB_BUTTON_PRESS>,
+ *           On<&Selection::ProcPropertyNotify>>;
+ *
+ *   The event type is deduced from the handler and its response code from event_code_t, so
+ *   a handler can never be called with the wrong cast. xproto gives key, button, enter, focus
+ *   and circulate events one type for two codes; those take the code explicitly.
+ *
+ *   - core events : 128-entry table of thunks, a constexpr built from the handler list, which
+ *                   also rejects two handlers for one code at compile time
+ *   - extension   : events numbered from the extension's first_event; Connect() looks it up
+ *                   (xcb_get_extension_data(), cached by libxcb) and fills their slots
+ *   - XGE         : GenericEvent (35) carries the extension's major opcode and an event type;
+ *                   the few such handlers are matched on both after the table lookup
+ *
+ *   Dispatch() is one table load and one direct call; events nobody handles are ignored.
+ */
+
+enum class EventKind
+{
+    CORE,
+    EXTENSION,
+    GENERIC,
+};
+
+// response code (or offset from first_event, or XGE event type) of each event type
+template <typename Event>
+struct event_code_t;
+
+#define XCB_DISPATCH_EVENT(NAME, CODE)                              \
+    template <>                                                     \
+    struct event_code_t<xcb_##NAME##_event_t>                       \
+    {                                                               \
+        static constexpr EventKind  kind    = EventKind::CORE;      \
+        static constexpr uint8_t    value   = CODE;                 \
+        static xcb_extension_t *extension(void) { return nullptr; } \
+    }
+
+// for an extension header, e.g. XCB_DISPATCH_EXTENSION_EVENT(xfixes_selection_notify, xcb_xfixes_id, XCB_XFIXES_SELECTION_NOTIFY)
+#define XCB_DISPATCH_EXTENSION_EVENT(NAME, ID, OFFSET)              \
+    template <>                                                     \
+    struct event_code_t<xcb_##NAME##_event_t>                       \
+    {                                                               \
+        static constexpr EventKind  kind    = EventKind::EXTENSION; \
+        static constexpr uint8_t    value   = OFFSET;               \
+        static xcb_extension_t *extension(void) { return &ID; }     \
+    }
+
+// e.g. XCB_DISPATCH_GENERIC_EVENT(present_complete_notify, xcb_present_id, XCB_PRESENT_COMPLETE_NOTIFY)
+#define XCB_DISPATCH_GENERIC_EVENT(NAME, ID, EVENT_TYPE)            \
+    template <>                                                     \
+    struct event_code_t<xcb_##NAME##_event_t>                       \
+    {                                                               \
+        static constexpr EventKind  kind    = EventKind::GENERIC;   \
+        static constexpr uint8_t    value   = EVENT_TYPE;           \
+        static xcb_extension_t *extension(void) { return &ID; }     \
+    }
+
+template <>
+struct event_code_t<xcb_generic_error_t>
+{
+    static constexpr EventKind  kind    = EventKind::CORE;
+    static constexpr uint8_t    value   = 0;
+    static xcb_extension_t *extension(void) { return nullptr; }
+};
+
+// types shared by two codes (key, button, enter, focus, circulate) are left out on purpose
+XCB_DISPATCH_EVENT(motion_notify,       XCB_MOTION_NOTIFY);
+XCB_DISPATCH_EVENT(keymap_notify,       XCB_KEYMAP_NOTIFY);
+XCB_DISPATCH_EVENT(expose,              XCB_EXPOSE);
+XCB_DISPATCH_EVENT(graphics_exposure,   XCB_GRAPHICS_EXPOSURE);
+XCB_DISPATCH_EVENT(no_exposure,         XCB_NO_EXPOSURE);
+XCB_DISPATCH_EVENT(visibility_notify,   XCB_VISIBILITY_NOTIFY);
+XCB_DISPATCH_EVENT(create_notify,       XCB_CREATE_NOTIFY);
+XCB_DISPATCH_EVENT(destroy_notify,      XCB_DESTROY_NOTIFY);
+XCB_DISPATCH_EVENT(unmap_notify,        XCB_UNMAP_NOTIFY);
+XCB_DISPATCH_EVENT(map_notify,          XCB_MAP_NOTIFY);
+XCB_DISPATCH_EVENT(map_request,         XCB_MAP_REQUEST);
+XCB_DISPATCH_EVENT(reparent_notify,     XCB_REPARENT_NOTIFY);
+XCB_DISPATCH_EVENT(configure_notify,    XCB_CONFIGURE_NOTIFY);
+XCB_DISPATCH_EVENT(configure_request,   XCB_CONFIGURE_REQUEST);
+XCB_DISPATCH_EVENT(gravity_notify,      XCB_GRAVITY_NOTIFY);
+XCB_DISPATCH_EVENT(resize_request,      XCB_RESIZE_REQUEST);
+XCB_DISPATCH_EVENT(property_notify,     XCB_PROPERTY_NOTIFY);
+XCB_DISPATCH_EVENT(selection_clear,     XCB_SELECTION_CLEAR);
+XCB_DISPATCH_EVENT(selection_request,   XCB_SELECTION_REQUEST);
+XCB_DISPATCH_EVENT(selection_notify,    XCB_SELECTION_NOTIFY);
+XCB_DISPATCH_EVENT(colormap_notify,     XCB_COLORMAP_NOTIFY);
+XCB_DISPATCH_EVENT(client_message,      XCB_CLIENT_MESSAGE);
+XCB_DISPATCH_EVENT(mapping_notify,      XCB_MAPPING_NOTIFY);
+
+// one handler: 'FUNCTION' is 'bool (Class::*)(Event *)'; 'CODE' overrides event_code_t for core events
+template <auto FUNCTION, int CODE = -1>
+struct On;
+
+template <typename Class, typename Event, bool (Class::*FUNCTION)(Event *), int CODE>
+struct On<FUNCTION, CODE>
+{
+    using class_t = Class;
+    using event_t = Event;
+
+    static constexpr EventKind Kind(void)
+    {
+        if constexpr (CODE < 0) {
+            return event_code_t<Event>::kind;
+        } else {
+            return EventKind::CORE;
+        }
+    }
+
+    static constexpr uint8_t Code(void)
+    {
+        if constexpr (CODE < 0) {
+            return event_code_t<Event>::value;
+        } else {
+            return static_cast<uint8_t>(CODE);
+        }
+    }
+
+    static constexpr EventKind kind = Kind();
+    static constexpr uint8_t   code = Code();
+
+    static xcb_extension_t *Extension(void)
+    {
+        if constexpr (CODE < 0) {
+            return event_code_t<Event>::extension();
+        } else {
+            return nullptr;
+        }
+    }
+
+    static bool Call(Class &handler, xcb_generic_event_t *event)
+    {
+        return (handler.*FUNCTION)(reinterpret_cast<Event *>(event));
+    }
+};
+
+template <typename Handler, typename... Handlers>
+class EventDispatcher
+{
+public:
+    static constexpr size_t     CODES           = 128;
+    static constexpr size_t     GENERICS        = ((Handlers::kind == EventKind::GENERIC) + ... + 0);
+
+    using thunk_t = bool (*)(Handler &, xcb_generic_event_t *);
+
+    static_assert((std::is_same_v<typename Handlers::class_t, Handler> && ...), "every handler must be a member of Handler");
+
+    EventDispatcher(void)
+    {
+    }
+
+    /**
+     * Enables the extension handlers: each extension's first_event / major opcode is looked up
+     *
+     *   false if one of them is not present; its events are then never dispatched, everything
+     *   else still is. Call it again after reconnecting, the numbers are per connection.
+     */
+    bool Connect(xcb_connection_t *connection)
+    {
+        table = CORE;
+        generic_count = 0;
+        auto rc = true;
+        ((rc &= Register<Handlers>(connection)), ...);
+        return rc;
+    }
+
+    // for an extension whose numbers are known otherwise; Connect() does this for every one
+    bool SetFirstEvent(xcb_extension_t *extension, uint8_t first_event)
+    {
+        auto found = false;
+        ((found |= SetSlot<Handlers>(extension, first_event)), ...);
+        return found;
+    }
+
+    bool Dispatch(Handler &handler, xcb_generic_event_t *event) const
+    {
+        auto code = event->response_type & 0x7F;
+        if (code == XCB_GE_GENERIC && GENERICS) {
+            auto generic = reinterpret_cast<xcb_ge_generic_event_t *>(event);
+            for (size_t i = 0; i < generic_count; i++) {
+                if (generics[i].major == generic->extension && generics[i].event_type == generic->event_type) {
+                    return generics[i].thunk(handler, event);
+                }
+            }
+            return true;
+        }
+        auto thunk = table[code];
+        return thunk ? thunk(handler, event) : true;
+    }
+
+    bool Handles(uint8_t code) const
+    {
+        return table[code & 0x7F] != nullptr;
+    }
+
+private:
+    struct generic_t
+    {
+        uint8_t                 major           = 0;
+        uint16_t                event_type      = 0;
+        thunk_t                 thunk           = nullptr;
+    };
+
+    static constexpr std::array<thunk_t, CODES> BuildCore(void)
+    {
+        std::array<thunk_t, CODES> core = {};
+        auto add = [&core](EventKind kind, uint8_t code, thunk_t thunk) {
+            if (kind != EventKind::CORE) {
+                return;
+            }
+            if (code >= CODES || core[code]) {
+                throw "two handlers for one response code, or a code past 127";
+            }
+            core[code] = thunk;
+        };
+        (add(Handlers::kind, Handlers::code, &Handlers::Call), ...);
+        return core;
+    }
+
+    template <typename Entry>
+    bool Register(xcb_connection_t *connection)
+    {
+        if constexpr (Entry::kind == EventKind::CORE) {
+            return true;
+        } else {
+            auto data = xcb_get_extension_data(connection, Entry::Extension());
+            if (!data || !data->present) {
+                return false;
+            }
+            if constexpr (Entry::kind == EventKind::GENERIC) {
+                generics[generic_count++] = {data->major_opcode, Entry::code, &Entry::Call};
+                return true;
+            } else {
+                return SetSlot<Entry>(Entry::Extension(), data->first_event);
+            }
+        }
+    }
+
+    template <typename Entry>
+    bool SetSlot(xcb_extension_t *extension, uint8_t first_event)
+    {
+        if constexpr (Entry::kind != EventKind::EXTENSION) {
+            return false;
+        } else {
+            size_t code = first_event + Entry::code;
+            if (Entry::Extension() != extension || code >= CODES) {
+                return false;
+            }
+            table[code] = &Entry::Call;
+            return true;
+        }
+    }
+
+    static constexpr std::array<thunk_t, CODES> CORE = BuildCore();
+
+    std::array<thunk_t, CODES>                  table           = CORE;
+    std::array<generic_t, GENERICS>             generics        = {};
+    size_t                                      generic_count   = 0;
+};
@@ -0,0 +1,429 @@
+#pragma once
+#include "config.h"
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <csetjmp>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifndef HAVE_LIBPNG
+#define HAVE_LIBPNG 0
+#endif
+#ifndef HAVE_LIBJPEG
+#define HAVE_LIBJPEG 0
+#endif
+#if HAVE_LIBPNG
+#include <png.h>
+#endif
+#if HAVE_LIBJPEG
+#include <jpeglib.h>
+#endif
+
+/**
+ * Image representations served from one source file
+ *
+ *   The source bytes are served as they are for their own mime type. Any other type is
+ *   produced on first request: the source is decoded to RGBA once, then encoded as
+ *     - image/bmp  : 32-bit BGRA, bottom-up, written with a vectorized RGBA -> BGRA swizzle
+ *     - image/png  : libpng, when built with it
+ *     - image/jpeg : libjpeg, when built with it
+ *   Every converted blob is kept until Reset(), which the owner calls when ownership changes.
+ */
+
+class ImageConverter
+{
+public:
+    using blob_t = std::shared_ptr<const std::string>;
+
+    ImageConverter(void)
+    {
+    }
+
+    bool Load(const char *path)
+    {
+        auto file = fopen(path, "rb");
+        if (!file) {
+            return false;
+        }
+
+        auto data = std::make_shared<std::string>();
+        char buf[64 * 1024];
+        for (size_t bytes; (bytes = fread(buf, 1, sizeof(buf), file)) > 0;) {
+            data->append(buf, bytes);
+        }
+        fclose(file);
+
+        auto type = Detect(*data);
+        if (!type) {
+            return false;
+        }
+
+        Reset();
+        source = data;
+        source_type = type;
+        return true;
+    }
+
+    bool Loaded(void) const
+    {
+        return source != nullptr;
+    }
+
+    // mime types this source can be served as, the source type first
+    std::vector<const char *> Targets(void) const
+    {
+        std::vector<const char *> targets = {};
+        if (!source) {
+            return targets;
+        }
+        targets.push_back(source_type);
+        if (!CanDecode(source_type)) {
+            return targets;
+        }
+        for (auto type : {"image/png", "image/jpeg", "image/bmp"}) {
+            if (strcmp(type, source_type) && CanEncode(type)) {
+                targets.push_back(type);
+            }
+        }
+        return targets;
+    }
+
+    // nullptr if 'type' cannot be produced
+    blob_t Get(const char *type)
+    {
+        if (!source) {
+            return {};
+        }
+        if (!strcmp(type, source_type)) {
+            return source;
+        }
+
+        auto iter = converted.find(type);
+        if (iter != converted.end()) {
+            return iter->second;
+        }
+
+        if (!Decode()) {
+            return {};
+        }
+
+        auto out = std::make_shared<std::string>();
+        auto rc = false;
+        if (!strcmp(type, "image/bmp")) {
+            rc = EncodeBmp(*out);
+#if HAVE_LIBPNG
+        } else if (!strcmp(type, "image/png")) {
+            rc = EncodePng(*out);
+#endif
+#if HAVE_LIBJPEG
+        } else if (!strcmp(type, "image/jpeg")) {
+            rc = EncodeJpeg(*out);
+#endif
+        }
+        if (!rc) {
+            return {};
+        }
+        return converted[type] = out;
+    }
+
+    // drops the decoded pixels and every converted representation, keeps the source
+    void Reset(void)
+    {
+        converted.clear();
+        pixels.clear();
+        pixels.shrink_to_fit();
+        width = 0;
+        height = 0;
+    }
+
+    // RGBA -> BGRA for 'count' pixels
+    static void SwizzleRgbaToBgra(const uint8_t *src, uint8_t *dst, size_t count)
+    {
+        static const auto impl = SelectSwizzle();
+        impl(src, dst, count);
+    }
+
+private:
+    using swizzle_t = void (*)(const uint8_t *, uint8_t *, size_t);
+
+    static const char *Detect(const std::string &data)
+    {
+        if (data.size() >= 8 && !memcmp(data.data(), "\x89PNG\r\n\x1a\n", 8)) {
+            return "image/png";
+        }
+        if (data.size() >= 3 && !memcmp(data.data(), "\xff\xd8\xff", 3)) {
+            return "image/jpeg";
+        }
+        if (data.size() >= 2 && !memcmp(data.data(), "BM", 2)) {
+            return "image/bmp";
+        }
+        return nullptr;
+    }
+
+    static bool CanDecode(const char *type)
+    {
+        return (HAVE_LIBPNG && !strcmp(type, "image/png")) || (HAVE_LIBJPEG && !strcmp(type, "image/jpeg"));
+    }
+
+    static bool CanEncode(const char *type)
+    {
+        return !strcmp(type, "image/bmp") || (HAVE_LIBPNG && !strcmp(type, "image/png")) || (HAVE_LIBJPEG && !strcmp(type, "image/jpeg"));
+    }
+
+    bool Decode(void)
+    {
+        if (!pixels.empty()) {
+            return true;
+        }
+#if HAVE_LIBPNG
+        if (!strcmp(source_type, "image/png")) {
+            return DecodePng();
+        }
+#endif
+#if HAVE_LIBJPEG
+        if (!strcmp(source_type, "image/jpeg")) {
+            return DecodeJpeg();
+        }
+#endif
+        return false;
+    }
+
+    bool EncodeBmp(std::string &out)
+    {
+        static constexpr uint32_t FILE_HEADER_SIZE = 14;
+        static constexpr uint32_t INFO_HEADER_SIZE = 40;
+
+        auto row_bytes = static_cast<size_t>(width) * 4;
+        auto image_size = row_bytes * height;
+        out.resize(FILE_HEADER_SIZE + INFO_HEADER_SIZE + image_size);
+        auto p = reinterpret_cast<uint8_t *>(out.data());
+
+        auto put16 = [&p](uint16_t v) { memcpy(p, &v, 2); p += 2; };
+        auto put32 = [&p](uint32_t v) { memcpy(p, &v, 4); p += 4; };
+
+        // BITMAPFILEHEADER
+        put16(0x4D42);
+        put32(static_cast<uint32_t>(out.size()));
+        put32(0);
+        put32(FILE_HEADER_SIZE + INFO_HEADER_SIZE);
+        // BITMAPINFOHEADER, BI_RGB
+        put32(INFO_HEADER_SIZE);
+        put32(width);
+        put32(height);
+        put16(1);
+        put16(32);
+        put32(0);
+        put32(static_cast<uint32_t>(image_size));
+        put32(2835);
+        put32(2835);
+        put32(0);
+        put32(0);
+
+        // bottom-up rows
+        for (uint32_t y = 0; y < height; y++) {
+            SwizzleRgbaToBgra(pixels.data() + (height - 1 - y) * row_bytes, p + y * row_bytes, width);
+        }
+        return true;
+    }
+
+#if HAVE_LIBPNG
+    bool DecodePng(void)
+    {
+        png_image image = {};
+        image.version = PNG_IMAGE_VERSION;
+        if (!png_image_begin_read_from_memory(&image, source->data(), source->size())) {
+            return false;
+        }
+        image.format = PNG_FORMAT_RGBA;
+        pixels.resize(PNG_IMAGE_SIZE(image));
+        if (!png_image_finish_read(&image, nullptr, pixels.data(), 0, nullptr)) {
+            png_image_free(&image);
+            pixels.clear();
+            return false;
+        }
+        width = image.width;
+        height = image.height;
+        return true;
+    }
+
+    bool EncodePng(std::string &out)
+    {
+        png_image image = {};
+        image.version = PNG_IMAGE_VERSION;
+        image.width   = width;
+        image.height  = height;
+        image.format  = PNG_FORMAT_RGBA;
+
+        png_alloc_size_t size = 0;
+        if (!png_image_write_get_memory_size(image, size, 0, pixels.data(), 0, nullptr)) {
+            return false;
+        }
+        out.resize(size);
+        if (!png_image_write_to_memory(&image, out.data(), &size, 0, pixels.data(), 0, nullptr)) {
+            return false;
+        }
+        out.resize(size);
+        return true;
+    }
+#endif
+
+#if HAVE_LIBJPEG
+    struct jpeg_error_t
+    {
+        struct jpeg_error_mgr       mgr;
+        jmp_buf                     jump;
+    };
+
+    static void OnJpegError(j_common_ptr info)
+    {
+        longjmp(reinterpret_cast<jpeg_error_t *>(info->err)->jump, 1);
+    }
+
+    bool DecodeJpeg(void)
+    {
+        struct jpeg_decompress_struct info = {};
+        jpeg_error_t error = {};
+        info.err = jpeg_std_error(&error.mgr);
+        error.mgr.error_exit = OnJpegError;
+        if (setjmp(error.jump)) {
+            jpeg_destroy_decompress(&info);
+            pixels.clear();
+            return false;
+        }
+
+        jpeg_create_decompress(&info);
+        jpeg_mem_src(&info, reinterpret_cast<const unsigned char *>(source->data()), source->size());
+        jpeg_read_header(&info, TRUE);
+        info.out_color_space = JCS_RGB;
+        jpeg_start_decompress(&info);
+
+        width = info.output_width;
+        height = info.output_height;
+        pixels.resize(static_cast<size_t>(width) * height * 4);
+        // from the image pool: an error longjmp()s past this scope, jpeg_destroy_decompress() frees it
+        auto rows = (*info.mem->alloc_sarray)(reinterpret_cast<j_common_ptr>(&info), JPOOL_IMAGE, width * 3, 1);
+        auto row = rows[0];
+        while (info.output_scanline < info.output_height) {
+            auto dst = pixels.data() + static_cast<size_t>(info.output_scanline) * width * 4;
+            jpeg_read_scanlines(&info, rows, 1);
+            for (uint32_t x = 0; x < width; x++) {
+                dst[x * 4 + 0] = row[x * 3 + 0];
+                dst[x * 4 + 1] = row[x * 3 + 1];
+                dst[x * 4 + 2] = row[x * 3 + 2];
+                dst[x * 4 + 3] = 0xFF;
+            }
+        }
+        jpeg_finish_decompress(&info);
+        jpeg_destroy_decompress(&info);
+        return true;
+    }
+
+    bool EncodeJpeg(std::string &out)
+    {
+        struct jpeg_compress_struct info = {};
+        jpeg_error_t error = {};
+        unsigned char *mem = nullptr;
+        unsigned long mem_len = 0;
+
+        info.err = jpeg_std_error(&error.mgr);
+        error.mgr.error_exit = OnJpegError;
+        if (setjmp(error.jump)) {
+            jpeg_destroy_compress(&info);
+            free(mem);
+            return false;
+        }
+
+        jpeg_create_compress(&info);
+        jpeg_mem_dest(&info, &mem, &mem_len);
+        info.image_width      = width;
+        info.image_height     = height;
+        info.input_components = 3;
+        info.in_color_space   = JCS_RGB;
+        jpeg_set_defaults(&info);
+        jpeg_set_quality(&info, 90, TRUE);
+        jpeg_start_compress(&info, TRUE);
+
+        // JPEG has no alpha; it is dropped. The row is from the image pool, as in DecodeJpeg()
+        auto rows = (*info.mem->alloc_sarray)(reinterpret_cast<j_common_ptr>(&info), JPOOL_IMAGE, width * 3, 1);
+        auto row = rows[0];
+        while (info.next_scanline < info.image_height) {
+            auto src = pixels.data() + static_cast<size_t>(info.next_scanline) * width * 4;
+            for (uint32_t x = 0; x < width; x++) {
+                row[x * 3 + 0] = src[x * 4 + 0];
+                row[x * 3 + 1] = src[x * 4 + 1];
+                row[x * 3 + 2] = src[x * 4 + 2];
+            }
+            jpeg_write_scanlines(&info, rows, 1);
+        }
+        jpeg_finish_compress(&info);
+        out.assign(reinterpret_cast<char *>(mem), mem_len);
+        jpeg_destroy_compress(&info);
+        free(mem);
+        return true;
+    }
+#endif
+
+    static void SwizzleScalar(const uint8_t *src, uint8_t *dst, size_t count)
+    {
+        for (size_t i = 0; i < count; i++) {
+            uint32_t px = 0;
+            memcpy(&px, src + i * 4, 4);
+            // little endian RGBA is 0xAABBGGRR; swap the R and B bytes
+            px = (px & 0xFF00FF00) | ((px & 0x00FF0000) >> 16) | ((px & 0x000000FF) << 16);
+            memcpy(dst + i * 4, &px, 4);
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("ssse3")))
+    static void SwizzleSsse3(const uint8_t *src, uint8_t *dst, size_t count)
+    {
+        const auto mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            auto px = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 4));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 4), _mm_shuffle_epi8(px, mask));
+        }
+        SwizzleScalar(src + i * 4, dst + i * 4, count - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void SwizzleAvx2(const uint8_t *src, uint8_t *dst, size_t count)
+    {
+        const auto mask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                           2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            auto px = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 4));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 4), _mm256_shuffle_epi8(px, mask));
+        }
+        SwizzleSsse3(src + i * 4, dst + i * 4, count - i);
+    }
+#endif
+
+    static swizzle_t SelectSwizzle(void)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return SwizzleAvx2;
+        }
+        if (__builtin_cpu_supports("ssse3")) {
+            return SwizzleSsse3;
+        }
+#endif
+        return SwizzleScalar;
+    }
+
+    blob_t                                  source          = {};
+    const char                             *source_type     = nullptr;
+    std::vector<uint8_t>                    pixels          = {};
+    uint32_t                                width           = 0;
+    uint32_t                                height          = 0;
+    std::map<std::string, blob_t>           converted       = {};
+};
@@ -1,7 +1,52 @@
 #include "config.h"
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
 #include <xcb/xcb.h>
+#include "setup_tables.h"
+
+/**
+ * Snapshot record, one per display
+ *
+ *   JSON       : one line per display, the same fields as the text dump
+ *   binary     : snapshot_header_t, the display name, then the setup exactly as xcb_get_setup()
+ *                returned it (xcb_setup_sizeof() bytes, host byte order); the setup is already a
+ *                compact encoding of the roots, depths, visuals and pixmap formats, and a reader
+ *                can hand it to SetupTables::Parse() as it is
+ *
+ *   A display that cannot be reached still gets a record, with its status set and no setup.
+ */
+
+enum class SnapshotFormat
+{
+    TEXT,
+    JSON,
+    BINARY,
+};
+
+struct snapshot_header_t
+{
+    char                magic[4]            = {'X', 'S', 'N', 'P'};
+    uint16_t            version             = 1;
+    uint8_t             status              = 0;    // 0: ok, 1: connection failed
+    uint8_t             name_len            = 0;
+    uint32_t            setup_len           = 0;
+    uint32_t            max_request_length  = 0;
+    uint64_t            total_read          = 0;
+    uint64_t            total_written       = 0;
+};
 
 class Info
 {
@@ -17,14 +62,38 @@ public:
         }
     }
 
+    // nullptr for $DISPLAY
+    void SetDisplay(const char *name)
+    {
+        display_name = name;
+    }
+
+    const char *DisplayName(void) const
+    {
+        if (display_name) {
+            return display_name;
+        }
+        auto env = getenv("DISPLAY");
+        return env ? env : "";
+    }
+
+    bool Connect(void)
+    {
+        connection = xcb_connect(display_name, &screen_num);
+        if (xcb_connection_has_error(connection)) {
+            return false;
+        }
+        setup = xcb_get_setup(connection);
+        tables.Parse(setup);
+        return true;
+    }
+
     bool Dump(void)
     {
-        connection = xcb_connect(nullptr, &screen_num);
-        if (!connection) {
+        if (!Connect()) {
             fprintf(stderr, "xcb_connect() failed\n");
             return false;
         }
-        setup = xcb_get_setup(connection);
 
         if (!DumpConnection()) {
             return false;
@@ -32,9 +101,18 @@ public:
         if (!DumpSetup()) {
             return false;
         }
+        if (!DumpTables()) {
+            return false;
+        }
         return true;
     }
 
+    // the setup parsed once into flat tables, valid while connected
+    const SetupTables &Tables(void) const
+    {
+        return tables;
+    }
+
     bool DumpConnection(void)
     {
         printf("\n* xcb_connection\n");
@@ -160,17 +238,473 @@ public:
         return true;
     }
 
+    bool DumpTables(void)
+    {
+        printf("\n* setup_tables\n");
+        printf(" - screens                              : %zu\n", tables.Screens().size());
+        printf(" - visuals                              : %zu\n", tables.Visuals().size());
+
+        for (auto &visual : tables.Visuals()) {
+            printf("   . visual 0x%08X                  : screen %u, depth %2u, class %u, rgb %u/%u %u/%u %u/%u (shift/width)\n",
+                   visual.id, visual.screen, visual.depth, visual._class,
+                   visual.red.shift, visual.red.width, visual.green.shift, visual.green.width, visual.blue.shift, visual.blue.width);
+        }
+
+        auto visual = tables.RootVisual(screen_num);
+        if (!visual) {
+            fprintf(stderr, "no root visual for screen %d\n", screen_num);
+            return false;
+        }
+        printf(" - root_visual[%d]                       : 0x%08X\n", screen_num, visual->id);
+        printf("   . by id                              : %s\n", tables.Visual(visual->id) == visual ? "found" : "missing");
+        printf("   . by depth/class                     : 0x%08X\n", tables.Visual(screen_num, visual->depth, visual->_class)->id);
+        if (auto format = tables.Format(visual->depth)) {
+            printf("   . bits_per_pixel                     : %u\n", format->bits_per_pixel);
+            printf("   . scanline_pad                       : %u\n", format->scanline_pad);
+            printf("   . stride of 1 pixel                  : %u\n", tables.Stride(visual->depth, 1));
+        }
+        printf("   . pixel(255, 128, 0)                 : 0x%08X\n", SetupTables::Pixel(*visual, 255, 128, 0));
+        return true;
+    }
+
+    /**
+     * Round-trip latency probe
+     *
+     *   Sends 'count' GetInputFocus requests, the cheapest request with a reply, keeping 'depth'
+     *   of them in flight: each reply received lets the next request go out. A request's RTT runs
+     *   from the flush that sent it to its reply, so at depth 1 it is the bare round trip and at
+     *   higher depths it adds the time spent queued behind the others.
+     *
+     *   jitter is the mean difference between consecutive RTTs.
+     */
+    bool Probe(size_t count, const std::vector<size_t> &depths)
+    {
+        if (!setup && !Connect()) {
+            fprintf(stderr, "xcb_connect() failed\n");
+            return false;
+        }
+
+        printf("\n* rtt (GetInputFocus x %zu)\n", count);
+        for (auto depth : depths) {
+            std::vector<double> rtts = {};
+            auto start = std::chrono::steady_clock::now();
+            if (!ProbeDepth(count, depth, rtts)) {
+                fprintf(stderr, "GetInputFocus failed at depth %zu\n", depth);
+                return false;
+            }
+            auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            double jitter = 0;
+            for (size_t i = 1; i < rtts.size(); i++) {
+                jitter += std::abs(rtts[i] - rtts[i - 1]);
+            }
+            jitter /= std::max<size_t>(rtts.size() - 1, 1);
+
+            std::sort(rtts.begin(), rtts.end());
+            auto percentile = [&](double p) {
+                return rtts[std::min(static_cast<size_t>(p * rtts.size()), rtts.size() - 1)];
+            };
+            printf(" - depth %-4zu                           : p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us, jitter %.1f us, %.0f req/s\n",
+                   depth, percentile(0.50), percentile(0.90), percentile(0.99), rtts.back(), jitter, count / elapsed);
+        }
+        return true;
+    }
+
+    /**
+     * Appends this display's snapshot record to 'out'
+     *
+     *   Connects first if needed; an unreachable display is recorded as such, so the result is
+     *   false but 'out' still has the record.
+     */
+    bool Snapshot(SnapshotFormat format, std::string &out)
+    {
+        auto connected = setup || Connect();
+        if (format == SnapshotFormat::BINARY) {
+            SnapshotBinary(connected, out);
+        } else {
+            SnapshotJson(connected, out);
+        }
+        return connected;
+    }
+
 private:
-    int                 screen_num  = 0;
-    xcb_connection_t   *connection  = nullptr;
-    const xcb_setup_t  *setup       = nullptr;
+    // RTTs in microseconds, in the order the requests were sent
+    bool ProbeDepth(size_t count, size_t depth, std::vector<double> &rtts)
+    {
+        struct inflight_t
+        {
+            xcb_get_input_focus_cookie_t            cookie  = {};
+            std::chrono::steady_clock::time_point   sent    = {};
+        };
+
+        rtts.reserve(count);
+        std::deque<inflight_t> inflight = {};
+        size_t sent = 0;
+        while (rtts.size() < count) {
+            auto queued = inflight.size();
+            while (sent < count && inflight.size() < depth) {
+                inflight.push_back({xcb_get_input_focus(connection), {}});
+                sent++;
+            }
+            if (inflight.size() > queued) {
+                xcb_flush(connection);
+                auto now = std::chrono::steady_clock::now();
+                for (auto i = queued; i < inflight.size(); i++) {
+                    inflight[i].sent = now;
+                }
+            }
+
+            auto reply = xcb_get_input_focus_reply(connection, inflight.front().cookie, nullptr);
+            if (!reply) {
+                return false;
+            }
+            free(reply);
+            rtts.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - inflight.front().sent).count());
+            inflight.pop_front();
+        }
+        return true;
+    }
+
+    void SnapshotBinary(bool connected, std::string &out)
+    {
+        auto name = DisplayName();
+        snapshot_header_t header = {};
+        header.status   = connected ? 0 : 1;
+        header.name_len = static_cast<uint8_t>(std::min<size_t>(strlen(name), UINT8_MAX));
+        if (connected) {
+            header.setup_len          = xcb_setup_sizeof(setup);
+            header.max_request_length = xcb_get_maximum_request_length(connection);
+            header.total_read         = xcb_total_read(connection);
+            header.total_written      = xcb_total_written(connection);
+        }
+        out.append(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.append(name, header.name_len);
+        out.append(reinterpret_cast<const char *>(setup), header.setup_len);
+    }
+
+    void SnapshotJson(bool connected, std::string &out)
+    {
+        out += '{';
+        String(out, "display", DisplayName());
+        if (!connected) {
+            String(out, "error", "connection failed");
+            out += "}\n";
+            return;
+        }
+
+        Open(out, "connection", '{');
+        Number(out, "total_read", xcb_total_read(connection));
+        Number(out, "total_written", xcb_total_written(connection));
+        Number(out, "maximum_request_length", xcb_get_maximum_request_length(connection));
+        out += '}';
+
+        Open(out, "setup", '{');
+        Number(out, "status", setup->status);
+        Number(out, "protocol_major_version", setup->protocol_major_version);
+        Number(out, "protocol_minor_version", setup->protocol_minor_version);
+        Number(out, "release_number", setup->release_number);
+        Number(out, "resource_id_base", setup->resource_id_base);
+        Number(out, "resource_id_mask", setup->resource_id_mask);
+        Number(out, "motion_buffer_size", setup->motion_buffer_size);
+        Number(out, "maximum_request_length", setup->maximum_request_length);
+        Number(out, "image_byte_order", setup->image_byte_order);
+        Number(out, "bitmap_format_bit_order", setup->bitmap_format_bit_order);
+        Number(out, "bitmap_format_scanline_unit", setup->bitmap_format_scanline_unit);
+        Number(out, "bitmap_format_scanline_pad", setup->bitmap_format_scanline_pad);
+        Number(out, "min_keycode", setup->min_keycode);
+        Number(out, "max_keycode", setup->max_keycode);
+        String(out, "vendor", std::string(xcb_setup_vendor(setup), xcb_setup_vendor_length(setup)).c_str());
+
+        Open(out, "roots", '[');
+        for (auto screen_iter = xcb_setup_roots_iterator(setup); screen_iter.rem; xcb_screen_next(&screen_iter)) {
+            auto screen = screen_iter.data;
+            Open(out, nullptr, '{');
+            Number(out, "root", screen->root);
+            Number(out, "default_colormap", screen->default_colormap);
+            Number(out, "white_pixel", screen->white_pixel);
+            Number(out, "black_pixel", screen->black_pixel);
+            Number(out, "current_input_masks", screen->current_input_masks);
+            Number(out, "width_in_pixels", screen->width_in_pixels);
+            Number(out, "height_in_pixels", screen->height_in_pixels);
+            Number(out, "width_in_millimeters", screen->width_in_millimeters);
+            Number(out, "height_in_millimeters", screen->height_in_millimeters);
+            Number(out, "min_installed_maps", screen->min_installed_maps);
+            Number(out, "max_installed_maps", screen->max_installed_maps);
+            Number(out, "root_visual", screen->root_visual);
+            Number(out, "backing_stores", screen->backing_stores);
+            Number(out, "save_unders", screen->save_unders);
+            Number(out, "root_depth", screen->root_depth);
+
+            Open(out, "allowed_depths", '[');
+            for (auto depth_iter = xcb_screen_allowed_depths_iterator(screen); depth_iter.rem; xcb_depth_next(&depth_iter)) {
+                Open(out, nullptr, '{');
+                Number(out, "depth", depth_iter.data->depth);
+                Open(out, "visuals", '[');
+                for (auto iter = xcb_depth_visuals_iterator(depth_iter.data); iter.rem; xcb_visualtype_next(&iter)) {
+                    auto visualtype = iter.data;
+                    Open(out, nullptr, '{');
+                    Number(out, "visual_id", visualtype->visual_id);
+                    Number(out, "class", visualtype->_class);
+                    Number(out, "bits_per_rgb_value", visualtype->bits_per_rgb_value);
+                    Number(out, "colormap_entries", visualtype->colormap_entries);
+                    Number(out, "red_mask", visualtype->red_mask);
+                    Number(out, "green_mask", visualtype->green_mask);
+                    Number(out, "blue_mask", visualtype->blue_mask);
+                    out += '}';
+                }
+                out += "]}";
+            }
+            out += "]}";
+        }
+        out += ']';
+
+        Open(out, "pixmap_formats", '[');
+        for (auto iter = xcb_setup_pixmap_formats_iterator(setup); iter.rem; xcb_format_next(&iter)) {
+            Open(out, nullptr, '{');
+            Number(out, "depth", iter.data->depth);
+            Number(out, "bits_per_pixel", iter.data->bits_per_pixel);
+            Number(out, "scanline_pad", iter.data->scanline_pad);
+            out += '}';
+        }
+        out += "]}}\n";
+    }
+
+    // a ',' unless this is the first member of an object or array
+    static void Key(std::string &out, const char *key)
+    {
+        if (out.back() != '{' && out.back() != '[') {
+            out += ',';
+        }
+        if (key) {
+            out += '"';
+            out += key;
+            out += "\":";
+        }
+    }
+
+    static void Open(std::string &out, const char *key, char bracket)
+    {
+        Key(out, key);
+        out += bracket;
+    }
+
+    template <typename T>
+    static void Number(std::string &out, const char *key, T value)
+    {
+        Key(out, key);
+        char buf[24];
+        auto result = std::to_chars(buf, buf + sizeof(buf), value);
+        out.append(buf, result.ptr);
+    }
+
+    static void String(std::string &out, const char *key, const char *value)
+    {
+        Key(out, key);
+        out += '"';
+        for (auto c = value; *c; c++) {
+            if (*c == '"' || *c == '\\') {
+                out += '\\';
+                out += *c;
+            } else if (static_cast<unsigned char>(*c) < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", *c);
+                out += buf;
+            } else {
+                out += *c;
+            }
+        }
+        out += '"';
+    }
+
+    const char         *display_name    = nullptr;
+    int                 screen_num      = 0;
+    xcb_connection_t   *connection      = nullptr;
+    const xcb_setup_t  *setup           = nullptr;
+    SetupTables         tables          = {};
 };
 
+static bool WriteAll(int fd, const std::string &data)
+{
+    for (size_t total = 0; total < data.size();) {
+        auto bytes = write(fd, data.data() + total, data.size() - total);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        total += bytes;
+    }
+    return true;
+}
+
+// one record per display, in the order given, probed on up to 'jobs' threads
+static bool RunBatch(const std::vector<std::string> &names, SnapshotFormat format, size_t jobs)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::string> records(names.size());
+    std::atomic<size_t> next = 0;
+    std::atomic<size_t> failed = 0;
+    auto probe = [&] {
+        for (size_t i; (i = next++) < names.size();) {
+            auto obj = Info();
+            obj.SetDisplay(names[i].c_str());
+            if (!obj.Snapshot(format, records[i])) {
+                failed++;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads = {};
+    for (size_t i = 0; i < std::min(jobs, names.size()); i++) {
+        threads.emplace_back(probe);
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::string out = {};
+    for (auto &record : records) {
+        out += record;
+    }
+    auto rc = WriteAll(STDOUT_FILENO, out);
+
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "probed %zu displays (%zu failed) on %zu threads in %.1f ms, %zu bytes\n",
+            names.size(), failed.load(), threads.size(), elapsed, out.size());
+    return rc;
+}
+
+static bool ReadDisplayList(const char *path, std::vector<std::string> &names)
+{
+    auto fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (!fp) {
+        fprintf(stderr, "cannot open '%s'\n", path);
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, " \t\r\n")] = '\0';
+        if (line[0] && line[0] != '#') {
+            names.push_back(line);
+        }
+    }
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return true;
+}
+
+static void Usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("  -d, --display NAME        connect to NAME instead of $DISPLAY\n");
+    printf("  -f, --format FORMAT       text | json | binary (default: text)\n");
+    printf("  -b, --batch FILE          snapshot every display listed in FILE ('-' for stdin), one record each\n");
+    printf("  -j, --jobs N              probe up to N displays at once in --batch (default: 16)\n");
+    printf("  -r, --rtt N               measure N GetInputFocus round trips at each pipeline depth\n");
+    printf("  -D, --depths LIST         comma-separated pipeline depths for --rtt (default: 1,8,64)\n");
+    printf("  -h, --help                show this help\n");
+}
+
 int main(int argc, char **argv)
 { 
+    static const struct option options[] = {
+        { "display",        required_argument,  nullptr, 'd' },
+        { "format",         required_argument,  nullptr, 'f' },
+        { "batch",          required_argument,  nullptr, 'b' },
+        { "jobs",           required_argument,  nullptr, 'j' },
+        { "rtt",            required_argument,  nullptr, 'r' },
+        { "depths",         required_argument,  nullptr, 'D' },
+        { "help",           no_argument,        nullptr, 'h' },
+        { nullptr,          0,                  nullptr,  0  },
+    };
+
+    const char *display = nullptr;
+    const char *batch_path = nullptr;
+    auto format = SnapshotFormat::TEXT;
+    size_t jobs = 16;
+    size_t rtt_count = 0;
+    std::vector<size_t> depths = {};
+    for (int opt; (opt = getopt_long(argc, argv, "d:f:b:j:r:D:h", options, nullptr)) != -1;) {
+        switch (opt) {
+            case 'd':
+                display = optarg;
+                break;
+            case 'f':
+                if (!strcmp(optarg, "text")) {
+                    format = SnapshotFormat::TEXT;
+                } else if (!strcmp(optarg, "json")) {
+                    format = SnapshotFormat::JSON;
+                } else if (!strcmp(optarg, "binary")) {
+                    format = SnapshotFormat::BINARY;
+                } else {
+                    fprintf(stderr, "invalid format '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'b':
+                batch_path = optarg;
+                break;
+            case 'j':
+                jobs = std::max<size_t>(strtoul(optarg, nullptr, 0), 1);
+                break;
+            case 'r':
+                rtt_count = strtoul(optarg, nullptr, 0);
+                break;
+            case 'D':
+                for (auto str = optarg; *str;) {
+                    char *end = nullptr;
+                    auto depth = strtoul(str, &end, 0);
+                    if (end == str || !depth || (*end && *end != ',')) {
+                        fprintf(stderr, "invalid depths '%s'\n", optarg);
+                        return EXIT_FAILURE;
+                    }
+                    depths.push_back(depth);
+                    str = *end ? end + 1 : end;
+                }
+                break;
+            case 'h':
+                Usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                Usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    // snapshots keep stdout for the records
+    if (batch_path) {
+        std::vector<std::string> names = {};
+        if (!ReadDisplayList(batch_path, names)) {
+            return EXIT_FAILURE;
+        }
+        return RunBatch(names, format == SnapshotFormat::BINARY ? format : SnapshotFormat::JSON, jobs) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (format != SnapshotFormat::TEXT) {
+        auto obj = Info();
+        obj.SetDisplay(display);
+        std::string out = {};
+        auto rc = obj.Snapshot(format, out);
+        return WriteAll(STDOUT_FILENO, out) && rc ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     printf("Example xcb_info\n");
 
     auto obj = Info();
+    obj.SetDisplay(display);
+    if (rtt_count) {
+        if (depths.empty()) {
+            depths = {1, 8, 64};
+        }
+        if (!obj.Probe(rtt_count, depths)) {
+            printf("\nFailed..\n");
+            return EXIT_FAILURE;
+        }
+        printf("\nSucceed..\n");
+        return EXIT_SUCCESS;
+    }
     if (!obj.Dump()) {
         printf("\nFailed..\n");
         return EXIT_FAILURE;
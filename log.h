@@ -0,0 +1,485 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Deferred-formatting logger
+ *
+ *   The event thread only copies the format pointer and raw argument values into a
+ *   lock-free ring; a background consumer renders the printf-style format later and
+ *   resolves atom ids to names on its own, so no xcb_get_atom_name round trip and no
+ *   stdio work happens on the producer side.
+ *
+ *   - Format strings and plain 'const char *' arguments must have static storage
+ *   - LogAtom(atom)  is rendered by '%s' as the atom name (resolved lazily)
+ *   - LogText(p, n)  copies up to LOG_TEXT_SIZE bytes into the record
+ *
+ *   A thread may tag its records with a context (e.g. one per X display); atoms are then
+ *   resolved with that context's resolver and lines get the context's prefix.
+ */
+
+enum class LogLevel : uint8_t
+{
+    DEBUG   = 0,
+    INFO    = 1,
+    WARN    = 2,
+    ERROR   = 3,
+    OFF     = 4,
+};
+
+struct LogAtom
+{
+    uint32_t        atom;
+    explicit LogAtom(uint32_t atom) : atom(atom) {}
+};
+
+struct LogText
+{
+    const char     *text;
+    size_t          len;
+    LogText(const char *text, size_t len) : text(text), len(len) {}
+    explicit LogText(const char *text) : text(text), len(text ? strlen(text) : 0) {}
+};
+
+class Log
+{
+public:
+    static constexpr size_t     RING_SIZE       = 4096;
+    static constexpr size_t     MAX_ARGS        = 12;
+    static constexpr size_t     LOG_TEXT_SIZE   = 128;
+
+    using AtomResolver = std::function<std::string(uint32_t)>;
+
+    static Log &Get(void)
+    {
+        static Log log;
+        return log;
+    }
+
+    ~Log(void)
+    {
+        Stop();
+    }
+
+    bool Enabled(LogLevel level) const
+    {
+        return static_cast<uint8_t>(level) >= min_level.load(std::memory_order_relaxed);
+    }
+
+    void SetLevel(LogLevel level)
+    {
+        min_level.store(static_cast<uint8_t>(level), std::memory_order_relaxed);
+    }
+
+    void SetOutput(FILE *out, FILE *err)
+    {
+        this->out = out;
+        this->err = err;
+    }
+
+    void SetTimestamps(bool enable)
+    {
+        timestamps = enable;
+    }
+
+    // may be called while the consumer runs, e.g. when another display connects
+    void SetAtomResolver(AtomResolver resolver, uint32_t context = 0)
+    {
+        std::lock_guard<std::mutex> guard(context_lock);
+        auto &data = contexts[context];
+        data.resolver = std::move(resolver);
+        data.atom_names.clear();
+    }
+
+    // records already posted for 'context' are rendered without it, e.g. once its display is gone
+    void ClearAtomResolver(uint32_t context)
+    {
+        std::lock_guard<std::mutex> guard(context_lock);
+        contexts[context].resolver = {};
+    }
+
+    void SetContextPrefix(uint32_t context, const std::string &prefix)
+    {
+        std::lock_guard<std::mutex> guard(context_lock);
+        contexts[context].prefix = prefix;
+    }
+
+    // the context of every record written by the calling thread from now on
+    static void SetThreadContext(uint32_t context)
+    {
+        thread_context = context;
+    }
+
+    void Start(void)
+    {
+        if (consumer.joinable()) {
+            return;
+        }
+        running.store(true);
+        consumer = std::thread([this] { Consume(); });
+    }
+
+    // drains every record already posted, then joins the consumer
+    void Stop(void)
+    {
+        running.store(false);
+        if (!consumer.joinable()) {
+            Consume();
+            return;
+        }
+        Wake();
+        consumer.join();
+    }
+
+    // blocks until the consumer has rendered everything posted so far
+    void Flush(void)
+    {
+        if (!consumer.joinable()) {
+            return;
+        }
+        auto target = head.load(std::memory_order_acquire);
+        while (consumed.load(std::memory_order_acquire) < target) {
+            Wake();
+            std::this_thread::yield();
+        }
+    }
+
+    uint64_t Dropped(void) const
+    {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+    template <typename... Args>
+    void Write(LogLevel level, const char *fmt, Args... args)
+    {
+        static_assert(sizeof...(Args) <= MAX_ARGS, "too many log arguments");
+
+        // Vyukov bounded queue: claim a slot whose sequence matches the ticket
+        record_t *record = nullptr;
+        auto pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            record = &ring[pos % RING_SIZE];
+            auto seq = record->seq.load(std::memory_order_acquire);
+            auto diff = static_cast<int64_t>(seq) - static_cast<int64_t>(pos);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+
+        record->timestamp = std::chrono::steady_clock::now().time_since_epoch().count();
+        record->fmt       = fmt;
+        record->level     = level;
+        record->context   = thread_context;
+        record->argc      = 0;
+        record->text_len  = 0;
+        (Put(*record, args), ...);
+        record->seq.store(pos + 1, std::memory_order_release);
+
+        // one wake per consumer sleep; later producers see the flag already cleared
+        if (waiting.load(std::memory_order_seq_cst) && waiting.exchange(false)) {
+            Wake();
+        }
+    }
+
+private:
+    enum class arg_t : uint8_t
+    {
+        SIGNED,
+        UNSIGNED,
+        DOUBLE,
+        STRING,
+        ATOM,
+        TEXT,
+    };
+
+    struct record_t
+    {
+        std::atomic<uint64_t>           seq                     = 0;
+        int64_t                         timestamp               = 0;
+        const char                     *fmt                     = nullptr;
+        LogLevel                        level                   = LogLevel::INFO;
+        uint32_t                        context                 = 0;
+        uint8_t                         argc                    = 0;
+        uint8_t                         text_len                = 0;
+        arg_t                           types[MAX_ARGS]         = {};
+        uint64_t                        args[MAX_ARGS]          = {};
+        char                            text[LOG_TEXT_SIZE]     = {};
+    };
+
+    Log(void) : ring(RING_SIZE)
+    {
+        for (size_t i = 0; i < RING_SIZE; i++) {
+            ring[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    template <typename T>
+    static void Put(record_t &record, T value)
+    {
+        auto &type = record.types[record.argc];
+        auto &arg  = record.args[record.argc];
+        record.argc++;
+
+        if constexpr (std::is_same_v<T, LogAtom>) {
+            type = arg_t::ATOM;
+            arg  = value.atom;
+        } else if constexpr (std::is_same_v<T, LogText>) {
+            type = arg_t::TEXT;
+            record.text_len = static_cast<uint8_t>(std::min(value.len, LOG_TEXT_SIZE - 1));
+            memcpy(record.text, value.text, record.text_len);
+            record.text[record.text_len] = '\0';
+        } else if constexpr (std::is_convertible_v<T, const char *>) {
+            type = arg_t::STRING;
+            arg  = reinterpret_cast<uintptr_t>(static_cast<const char *>(value));
+        } else if constexpr (std::is_floating_point_v<T>) {
+            type = arg_t::DOUBLE;
+            double d = value;
+            memcpy(&arg, &d, sizeof(d));
+        } else if constexpr (std::is_enum_v<T>) {
+            type = arg_t::SIGNED;
+            arg  = static_cast<uint64_t>(value);
+        } else if constexpr (std::is_signed_v<T>) {
+            type = arg_t::SIGNED;
+            arg  = static_cast<uint64_t>(static_cast<int64_t>(value));
+        } else {
+            static_assert(std::is_unsigned_v<T>, "unsupported log argument");
+            type = arg_t::UNSIGNED;
+            arg  = static_cast<uint64_t>(value);
+        }
+    }
+
+    void Wake(void)
+    {
+        posted.fetch_add(1, std::memory_order_seq_cst);
+        posted.notify_one();
+    }
+
+    void Consume(void)
+    {
+        uint64_t reported_drops = dropped.load();
+        std::string line;
+
+        while (true) {
+            auto &record = ring[tail % RING_SIZE];
+            if (record.seq.load(std::memory_order_acquire) == tail + 1) {
+                Render(record, line);
+                if (record.level == LogLevel::ERROR) {
+                    fflush(out);
+                    fwrite(line.data(), 1, line.size(), err);
+                } else {
+                    fwrite(line.data(), 1, line.size(), out);
+                }
+                record.seq.store(tail + RING_SIZE, std::memory_order_release);
+                tail++;
+                consumed.store(tail, std::memory_order_release);
+                continue;
+            }
+
+            auto drops = dropped.load(std::memory_order_relaxed);
+            if (drops != reported_drops) {
+                fprintf(err, " - log: %lu records dropped\n", drops - reported_drops);
+                reported_drops = drops;
+            }
+            fflush(out);
+
+            // the producer side may have claimed a slot that is not published yet
+            if (head.load(std::memory_order_acquire) != tail) {
+                std::this_thread::yield();
+                continue;
+            }
+            if (!running.load()) {
+                break;
+            }
+
+            auto ticket = posted.load(std::memory_order_seq_cst);
+            waiting.store(true, std::memory_order_seq_cst);
+            if (head.load(std::memory_order_seq_cst) == tail && running.load()) {
+                posted.wait(ticket);
+            }
+            waiting.store(false, std::memory_order_seq_cst);
+        }
+        fflush(out);
+        fflush(err);
+    }
+
+    struct context_t
+    {
+        AtomResolver                                resolver    = {};
+        std::string                                 prefix      = {};
+        std::unordered_map<uint32_t, std::string>   atom_names  = {};
+    };
+
+    // a resolver may block on a round trip, so only the lookup itself is locked
+    std::string AtomName(uint32_t context, uint32_t atom)
+    {
+        AtomResolver resolver = {};
+        {
+            std::lock_guard<std::mutex> guard(context_lock);
+            auto &data = contexts[context];
+            auto iter = data.atom_names.find(atom);
+            if (iter != data.atom_names.end()) {
+                return iter->second;
+            }
+            resolver = data.resolver;
+        }
+        auto name = resolver ? resolver(atom) : std::to_string(atom);
+        std::lock_guard<std::mutex> guard(context_lock);
+        contexts[context].atom_names[atom] = name;
+        return name;
+    }
+
+    // re-creates each printf conversion with an 'll' length so the widened values print as intended
+    void Render(const record_t &record, std::string &line)
+    {
+        char spec[32];
+        char buf[256];
+        size_t idx = 0;
+
+        line.clear();
+        if (timestamps) {
+            auto usec = record.timestamp / 1000;
+            auto n = snprintf(buf, sizeof(buf), "[%6lld.%06lld] ", static_cast<long long>(usec / 1000000), static_cast<long long>(usec % 1000000));
+            line.append(buf, n);
+        }
+        {
+            std::lock_guard<std::mutex> guard(context_lock);
+            auto iter = contexts.find(record.context);
+            if (iter != contexts.end()) {
+                line.append(iter->second.prefix);
+            }
+        }
+        std::string atom_name = {};
+        for (auto p = record.fmt; *p; p++) {
+            if (*p != '%') {
+                line.push_back(*p);
+                continue;
+            }
+            if (p[1] == '%') {
+                line.push_back('%');
+                p++;
+                continue;
+            }
+
+            size_t len = 0;
+            spec[len++] = *p++;
+            while (*p && strchr("-+ #0123456789.", *p) && len < sizeof(spec) - 4) {
+                spec[len++] = *p++;
+            }
+            while (*p && strchr("hlLqjzt", *p)) {
+                p++;
+            }
+            if (!*p) {
+                break;
+            }
+
+            auto conv = *p;
+            if (idx >= record.argc) {
+                line.append("(missing)");
+                continue;
+            }
+
+            auto type  = record.types[idx];
+            auto value = record.args[idx];
+            idx++;
+
+            int n = 0;
+            if (conv == 's' || type == arg_t::ATOM || type == arg_t::TEXT || type == arg_t::STRING) {
+                const char *str = "(null)";
+                if (type == arg_t::ATOM) {
+                    atom_name = AtomName(record.context, static_cast<uint32_t>(value));
+                    str = atom_name.c_str();
+                } else if (type == arg_t::TEXT) {
+                    str = record.text;
+                } else if (type == arg_t::STRING && value) {
+                    str = reinterpret_cast<const char *>(static_cast<uintptr_t>(value));
+                }
+                spec[len++] = 's';
+                spec[len] = '\0';
+                if (len == 2) {
+                    line.append(str);
+                    continue;
+                }
+                n = snprintf(buf, sizeof(buf), spec, str);
+            } else if (strchr("fFeEgGaA", conv)) {
+                double d = 0;
+                if (type == arg_t::DOUBLE) {
+                    memcpy(&d, &value, sizeof(d));
+                } else {
+                    d = static_cast<double>(static_cast<int64_t>(value));
+                }
+                spec[len++] = conv;
+                spec[len] = '\0';
+                n = snprintf(buf, sizeof(buf), spec, d);
+            } else if (conv == 'p') {
+                n = snprintf(buf, sizeof(buf), "0x%llx", static_cast<unsigned long long>(value));
+            } else if (conv == 'c') {
+                spec[len++] = 'c';
+                spec[len] = '\0';
+                n = snprintf(buf, sizeof(buf), spec, static_cast<int>(value));
+            } else {
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+                spec[len++] = conv;
+                spec[len] = '\0';
+                if (conv == 'd' || conv == 'i') {
+                    n = snprintf(buf, sizeof(buf), spec, static_cast<long long>(value));
+                } else {
+                    n = snprintf(buf, sizeof(buf), spec, static_cast<unsigned long long>(value));
+                }
+            }
+            if (n > 0) {
+                line.append(buf, std::min(static_cast<size_t>(n), sizeof(buf) - 1));
+            }
+        }
+    }
+
+    std::vector<record_t>                       ring;
+    alignas(64) std::atomic<uint64_t>           head            = 0;
+    alignas(64) std::atomic<uint64_t>           posted          = 0;
+    std::atomic<bool>                           waiting         = false;
+    std::atomic<bool>                           running         = false;
+    std::atomic<uint64_t>                       dropped         = 0;
+    uint64_t                                    tail            = 0;
+    std::atomic<uint64_t>                       consumed        = 0;
+    std::atomic<uint8_t>                        min_level       = static_cast<uint8_t>(LogLevel::INFO);
+    std::thread                                 consumer        = {};
+    bool                                        timestamps      = false;
+    FILE                                       *out             = stdout;
+    FILE                                       *err             = stderr;
+    std::mutex                                  context_lock    = {};
+    std::map<uint32_t, context_t>               contexts        = {};
+
+    static inline thread_local uint32_t         thread_context  = 0;
+};
+
+// arguments are not evaluated at all when the level is disabled
+#define LOG_AT(LEVEL, ...)                                          \
+    do {                                                            \
+        if (Log::Get().Enabled(LEVEL)) {                            \
+            Log::Get().Write(LEVEL, __VA_ARGS__);                   \
+        }                                                           \
+    } while (0)
+
+#define LOG_DEBUG(...)  LOG_AT(LogLevel::DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)   LOG_AT(LogLevel::INFO,  __VA_ARGS__)
+#define LOG_WARN(...)   LOG_AT(LogLevel::WARN,  __VA_ARGS__)
+#define LOG_ERROR(...)  LOG_AT(LogLevel::ERROR, __VA_ARGS__)
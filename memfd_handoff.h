@@ -0,0 +1,350 @@
+#pragma once
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/**
+ * Same-host content handoff through a sealed memfd
+ *
+ *   The owner answers the private 'x-memfd-handle' target with a short text property
+ *
+ *       "<socket> <token> <size> <type>"
+ *
+ *   where <socket> is an abstract Unix socket ('@' for the leading NUL) and <token> a random,
+ *   single-use 64-bit key. The requestor connects, writes the token and receives the memfd via
+ *   SCM_RIGHTS, then maps it. No payload byte goes through the X server.
+ *
+ *   - the memfd is sealed against writes and resizing, so one fd per content is shared by every
+ *     requestor and a mapping can never change under a reader
+ *   - only peers with our uid are served, and only for a token handed out through the property;
+ *     a requestor only claims from an owner with our uid, and only a memfd sealed against
+ *     writes and shrinking that holds the advertised size, so mapping it cannot SIGBUS
+ *   - a client on another host cannot connect and falls back to the ordinary targets
+ *
+ *   Connections are served on one thread; a claim is a token lookup and a sendmsg().
+ */
+
+class MemfdHandoff
+{
+public:
+    static constexpr const char    *TARGET          = "x-memfd-handle";
+    static constexpr size_t         MAX_OFFERS      = 64;
+    static constexpr int            TIMEOUT_MS      = 1000;
+
+    using blob_t = std::shared_ptr<const std::string>;
+
+    MemfdHandoff(void)
+    {
+    }
+
+    ~MemfdHandoff(void)
+    {
+        Stop();
+    }
+
+    bool Listen(void)
+    {
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) {
+            return false;
+        }
+
+        uint32_t salt = 0;
+        getrandom(&salt, sizeof(salt), 0);
+        name = "@xcb-selection-memfd." + std::to_string(getpid()) + "." + std::to_string(salt);
+
+        struct sockaddr_un addr = {};
+        socklen_t addr_len = 0;
+        Address(name, addr, addr_len);
+        if (bind(listen_fd, reinterpret_cast<struct sockaddr *>(&addr), addr_len) < 0 || listen(listen_fd, 16) < 0) {
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+
+        running = true;
+        thread = std::thread([this] { Serve(); });
+        return true;
+    }
+
+    void Stop(void)
+    {
+        if (listen_fd < 0) {
+            return;
+        }
+        running = false;
+        // wakes the blocked accept()
+        shutdown(listen_fd, SHUT_RDWR);
+        thread.join();
+        close(listen_fd);
+        listen_fd = -1;
+
+        std::lock_guard<std::mutex> guard(lock);
+        offers.clear();
+        memfds.clear();
+    }
+
+    bool Listening(void) const
+    {
+        return listen_fd >= 0;
+    }
+
+    // the property value for one requestor, or "" if the content could not be put in a memfd
+    std::string Offer(const blob_t &blob, const char *type)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto iter = memfds.find(blob.get());
+        if (iter == memfds.end()) {
+            auto fd = CreateMemfd(*blob);
+            if (fd < 0) {
+                return {};
+            }
+            // the blob is kept so its address cannot be reused by other content while cached
+            iter = memfds.emplace(blob.get(), std::make_shared<memfd_t>(blob, fd)).first;
+        }
+
+        uint64_t token = 0;
+        getrandom(&token, sizeof(token), 0);
+        offers.push_back({token, iter->second});
+        if (offers.size() > MAX_OFFERS) {
+            offers.pop_front();
+        }
+
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s %016lx %zu %s", name.c_str(), token, blob->size(), type);
+        return buf;
+    }
+
+    // drops every cached memfd; offers already handed out stay claimable
+    void Reset(void)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        memfds.clear();
+    }
+
+    /**
+     * Requestor side: claims the memfd described by an 'x-memfd-handle' property
+     *
+     *   Returns the fd (-1 on any failure) with the content size and type. The owner on the other
+     *   end must have our uid, and the fd must be sealed against writes and shrinking and hold
+     *   'size' bytes, so a mapping of all of it is stable and never faults.
+     */
+    static int Claim(const char *value, size_t len, size_t &size, std::string &type)
+    {
+        char socket_name[108] = {};
+        char type_name[128] = {};
+        uint64_t token = 0;
+        std::string str(value, len);
+        if (sscanf(str.c_str(), "%107s %lx %zu %127s", socket_name, &token, &size, type_name) != 4) {
+            return -1;
+        }
+        type = type_name;
+
+        auto sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0) {
+            return -1;
+        }
+        struct timeval tv = {TIMEOUT_MS / 1000, (TIMEOUT_MS % 1000) * 1000};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        struct sockaddr_un addr = {};
+        socklen_t addr_len = 0;
+        Address(socket_name, addr, addr_len);
+        struct ucred cred = {};
+        socklen_t cred_len = sizeof(cred);
+        if (connect(sock, reinterpret_cast<struct sockaddr *>(&addr), addr_len) < 0 ||
+            getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 || cred.uid != getuid() ||
+            write(sock, &token, sizeof(token)) != sizeof(token)) {
+            close(sock);
+            return -1;
+        }
+
+        uint64_t sent_size = 0;
+        auto fd = RecvFd(sock, &sent_size, sizeof(sent_size));
+        close(sock);
+        if (fd < 0) {
+            return -1;
+        }
+        struct stat st = {};
+        auto seals = fcntl(fd, F_GET_SEALS);
+        if (sent_size != size || seals < 0 || (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) != (F_SEAL_WRITE | F_SEAL_SHRINK) ||
+            fstat(fd, &st) < 0 || static_cast<uint64_t>(st.st_size) != size) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // sends 'fd' with 'len' bytes of 'data' in one message
+    static bool SendFd(int sock, int fd, const void *data, size_t len)
+    {
+        struct iovec iov = {const_cast<void *>(data), len};
+        char control[CMSG_SPACE(sizeof(int))] = {};
+        struct msghdr msg = {};
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        return sendmsg(sock, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(len);
+    }
+
+    // receives one fd with exactly 'len' bytes of 'data'; -1 if either is missing
+    static int RecvFd(int sock, void *data, size_t len)
+    {
+        struct iovec iov = {data, len};
+        char control[CMSG_SPACE(sizeof(int))] = {};
+        struct msghdr msg = {};
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != static_cast<ssize_t>(len)) {
+            return -1;
+        }
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            return -1;
+        }
+        int fd = -1;
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        return fd;
+    }
+
+    // '@name' is an abstract socket; a longer name than sun_path holds is cut
+    static void Address(const std::string &name, struct sockaddr_un &addr, socklen_t &addr_len)
+    {
+        addr.sun_family = AF_UNIX;
+        auto len = std::min(name.size(), sizeof(addr.sun_path));
+        memcpy(addr.sun_path, name.data(), len);
+        if (name[0] == '@') {
+            addr.sun_path[0] = '\0';
+        }
+        addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+    }
+
+    // a sealed memfd holding 'data'; -1 on failure
+    static int CreateMemfd(std::string_view data)
+    {
+        auto fd = memfd_create("xcb-selection", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0) {
+            return -1;
+        }
+        for (size_t offset = 0; offset < data.size();) {
+            auto bytes = write(fd, data.data() + offset, data.size() - offset);
+            if (bytes <= 0) {
+                close(fd);
+                return -1;
+            }
+            offset += bytes;
+        }
+        if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+private:
+    // closed when neither the cache nor an outstanding offer refers to it
+    struct memfd_t
+    {
+        memfd_t(blob_t blob, int fd) : blob(std::move(blob)), fd(fd)
+        {
+        }
+
+        ~memfd_t(void)
+        {
+            close(fd);
+        }
+
+        blob_t                  blob    = {};
+        int                     fd      = -1;
+    };
+
+    struct offer_t
+    {
+        uint64_t                    token   = 0;
+        std::shared_ptr<memfd_t>    memfd   = {};
+    };
+
+    void Serve(void)
+    {
+        while (running) {
+            auto sock = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (sock < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                break;
+            }
+            Answer(sock);
+            close(sock);
+        }
+    }
+
+    void Answer(int sock)
+    {
+        struct ucred cred = {};
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 || cred.uid != getuid()) {
+            return;
+        }
+
+        struct timeval tv = {TIMEOUT_MS / 1000, (TIMEOUT_MS % 1000) * 1000};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        uint64_t token = 0;
+        if (read(sock, &token, sizeof(token)) != sizeof(token)) {
+            return;
+        }
+
+        std::shared_ptr<memfd_t> memfd = {};
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (auto iter = offers.begin(); iter != offers.end(); iter++) {
+                if (iter->token == token) {
+                    memfd = iter->memfd;
+                    offers.erase(iter);
+                    break;
+                }
+            }
+        }
+        if (memfd) {
+            uint64_t size = memfd->blob->size();
+            SendFd(sock, memfd->fd, &size, sizeof(size));
+        }
+    }
+
+    std::string                                 name        = {};
+    int                                         listen_fd   = -1;
+    std::atomic<bool>                           running     = false;
+    std::thread                                 thread      = {};
+    std::mutex                                  lock        = {};
+    std::map<const std::string *, std::shared_ptr<memfd_t>> memfds = {};
+    std::deque<offer_t>                         offers      = {};
+};
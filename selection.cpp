@@ -3,23 +3,103 @@
 #include <cstdlib>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <map>
 #include <set>
 #include <string>
-#include <queue>
 #include <vector>
 #include <errno.h>
 #include <fcntl.h>
+#include <malloc.h>
+#include <poll.h>
 #include <signal.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <xcb/xcb.h>
 #include <xcb/xcbext.h>
+#include <getopt.h>
+#include "log.h"
+#include "trace.h"
+#include "xcb_coro.h"
+#include "worker_pool.h"
+#include "transcode.h"
+#include "image_convert.h"
+#include "clipboard_store.h"
+#include "memfd_handoff.h"
+#include "atom_profile.h"
+#include "atom_cache.h"
+#include "buffer_pool.h"
+#include "event_dispatch.h"
+#include "task_queue.h"
+#include "control_socket.h"
+#include "clipboard_history.h"
 
 static constexpr int32_t    INVALID_FD      = -1;
 static constexpr ssize_t    INCR_CHUNK_SIZE = 64 * 1024;
 static int                  signal_pipe[2]  = {INVALID_FD, INVALID_FD};
+static int                  signal_users    = 0;
+static constexpr int        IDLE_TRIM_MS    = 1000;     // idle this long, pooled buffers are freed
+static long                 idle_rss_kib    = 0;
+
+// heap allocations of each thread; a paste is counted on its event thread, so workers, the
+// control socket and the log consumer never add to it
+static thread_local uint64_t heap_allocations = 0;
+
+// kept out of line: once inlined, gcc pairs malloc() / free() with new / delete and flags them
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    heap_allocations++;
+    if (auto ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+using blob_t = std::shared_ptr<const std::string>;
+
+struct request_job_t
+{
+    xcb_selection_request_event_t               event                       = {};
+    xcb_atom_t                                  type                        = XCB_ATOM_NONE;
+    uint8_t                                     format                      = 8;
+    std::vector<uint8_t>                        data                        = {};
+    std::string_view                            content                     = {};   // written instead of 'data' when set
+    blob_t                                      blob                        = {};   // owns 'content', unless it is in the history mapping
+    bool                                        incr                        = false;
+    bool                                        stream                      = false;
+
+    void SetProperty(xcb_atom_t type, uint8_t format, const void *data, size_t len)
+    {
+        this->type   = type;
+        this->format = format;
+        this->data.assign(static_cast<const uint8_t *>(data), static_cast<const uint8_t *>(data) + len);
+    }
+
+    // 8-bit content, written without a copy; from one chunk up it goes via INCR
+    void SetContent(xcb_atom_t type, std::string_view content, blob_t blob)
+    {
+        this->type    = type;
+        this->format  = 8;
+        this->content = content;
+        this->blob    = std::move(blob);
+        this->incr    = content.size() >= INCR_CHUNK_SIZE;
+    }
+};
 
 class Selection
 {
@@ -30,17 +110,26 @@ public:
 
     ~Selection(void)
     {
-        if (read_fd != INVALID_FD) {
-            close(read_fd);
+        // a paste cut short still leaves what it got
+        AppendPaste();
+        control.Stop();
+        workers.Stop();
+        startup.Reset();
+        // the logger outlives every display; the resolver captures 'this'
+        Log::Get().Flush();
+        Log::Get().ClearAtomResolver(log_context);
+
+        if (stream_fd > STDERR_FILENO) {
+            close(stream_fd);
         }
 
-        if (write_fd != INVALID_FD) {
-            close(write_fd);
-        }
-
-        for (auto fd : signal_pipe) {
-            if (fd != INVALID_FD) {
-                close(fd);
+        // the last display closes the pipe
+        if (listening_signal && !--signal_users) {
+            for (auto &fd : signal_pipe) {
+                if (fd != INVALID_FD) {
+                    close(fd);
+                    fd = INVALID_FD;
+                }
             }
         }
 
@@ -53,32 +142,194 @@ public:
         }
     }
 
-    bool Init(void)
+    // 'name' as for xcb_connect() (nullptr for $DISPLAY); 'context' tags this display's log lines
+    void SetDisplay(const char *name, uint32_t context)
+    {
+        display_name = name ? name : "";
+        log_context = context;
+    }
+
+    const std::string &DisplayName(void) const
+    {
+        return display_name;
+    }
+
+    bool SetWorkers(size_t count)
+    {
+        return workers.Start(count);
+    }
+
+    // take CLIPBOARD ownership as soon as startup completes, without a button press
+    void SetOwnOnStartup(bool own)
+    {
+        this->own = own;
+    }
+
+    /**
+     * Headless daemon mode: nothing on screen and only the events transfers need
+     *
+     *   An unmapped 1x1 InputOnly window that only takes PropertyNotify for our own transfers, no
+     *   root window subscription, a requestor subscribed to for as long as its INCR transfer runs,
+     *   and events no handler would act on dropped before they are traced, logged or dispatched.
+     */
+    void SetHeadless(bool headless)
+    {
+        this->headless = headless;
+    }
+
+    // received payloads are kept once per distinct content, in up to 'limit' bytes of memory
+    void SetStoreLimit(size_t limit)
+    {
+        store.SetLimit(limit);
+    }
+
+    // opt-in same-host fast path: offer and claim content through 'x-memfd-handle'
+    bool SetMemfdHandoff(bool enable)
+    {
+        memfd = enable;
+        if (enable && !handoff.Listen()) {
+            LOG_ERROR("failed to listen for memfd handoff (err: '%s')\n", LogText(strerror(errno)));
+            return false;
+        }
+        return true;
+    }
+
+    // serves set / get / status requests on the Unix socket 'path' ('@name' for an abstract one)
+    bool SetControlSocket(const char *path)
+    {
+        // parsed on the control thread, answered on the event thread
+        auto listening = control.Listen(path, [this](const ControlSocket::request_t &request) {
+            tasks.Post([this, request] { ProcControlRequest(request); });
+        });
+        if (!listening) {
+            LOG_ERROR("failed to listen on the control socket '%s' (err: '%s')\n", LogText(path), LogText(strerror(errno)));
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Clipboard history: CLIPBOARD content received from its owner or set over the control socket
+     * is appended to 'path'
+     *
+     *   At startup, if nobody owns CLIPBOARD and '--own' does not serve other content, it is taken
+     *   again with the last clip, served from the history's mapping; see clipboard_history.h. Past
+     *   'limit' bytes (0: none) the history keeps only its newest clips.
+     */
+    bool SetHistory(const char *path, uint64_t limit)
+    {
+        auto begin = std::chrono::steady_clock::now();
+        if (!history.Open(path, limit)) {
+            // 'path' is from argv: a record holds one LogText only
+            LOG_ERROR("failed to open the clipboard history '%s' (err: '%s')\n", path, LogText(strerror(errno)));
+            return false;
+        }
+        auto stats = history.Stats();
+        size_t bytes = 0;
+        for (auto &entry : history.LastClip()) {
+            bytes += entry.data.size();
+        }
+        LOG_INFO(" * clipboard history                : %lu entries, %lu bytes, last clip %zu entries of %zu bytes, opened in %.3f ms\n",
+            stats.entries, stats.bytes, history.LastClip().size(), bytes, ElapsedMs(begin));
+        if (stats.dropped) {
+            LOG_WARN("       . %lu torn records dropped\n", stats.dropped);
+        }
+        if (stats.rebuilt) {
+            LOG_WARN("       . index rebuilt from the log, a compaction was cut short\n");
+        }
+        return true;
+    }
+
+    /**
+     * Profile-guided atom precache
+     *
+     *   The names of a previous run's profile are interned in the startup batch; this run's
+     *   lookups, counted by the atom cache, are merged back into the profile by SaveAtomProfile().
+     *   An atom missed after startup is logged as it happens.
+     */
+    void SetAtomProfile(const char *path)
+    {
+        atom_profile_path = path;
+        precache_names = AtomProfile::Load(path);
+        atom_cache.CountUses();
+    }
+
+    bool SaveAtomProfile(FILE *out)
+    {
+        if (atom_profile_path.empty()) {
+            return true;
+        }
+        auto misses = atom_profile.LateMisses();
+        fprintf(out, " - atom profile '%s' (%s): %zu precached, %zu missed after startup\n",
+                atom_profile_path.c_str(), display_name.c_str(), precache_names.size(), misses.size());
+        for (auto &[name, count] : misses) {
+            fprintf(out, "   . %-28s: %lu\n", name.c_str(), count);
+        }
+        atom_cache.ForEachUse([this](std::string_view name, uint64_t uses, double first_use_ms) {
+            if (uses) {
+                atom_profile.Used(name, uses, first_use_ms);
+            }
+        });
+        if (!atom_profile.Save(atom_profile_path.c_str())) {
+            fprintf(stderr, "failed to save atom profile '%s'\n", atom_profile_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool Init(bool pipelined = false)
     {
-        if (!ListenSignal()) {
+        if (!ListenSignal() || !CheckTasks()) {
             return false;
         }
 
-        connection = xcb_connect(nullptr, &screen_num);
-        if (!connection) {
-            fprintf(stderr, "xcb_connect() failed\n");
+        Log::SetThreadContext(log_context);
+        this->pipelined = pipelined;
+        connect_begin = std::chrono::steady_clock::now();
+        connection = xcb_connect(display_name.empty() ? nullptr : display_name.c_str(), &screen_num);
+        if (xcb_connection_has_error(connection)) {
+            LOG_ERROR("xcb_connect() failed '%s'\n", LogText(display_name.c_str()));
             return false;
         }
 
+        // atom names are resolved by the log consumer, off the event thread, from the shared cache;
+        // lookup only, so the consumer never waits on a round trip: an uncached atom stays a number
+        atom_cache.SetConnection(connection);
+        Log::Get().SetAtomResolver([this](uint32_t atom) -> std::string {
+            if (atom == XCB_ATOM_NONE) {
+                return "(null)";
+            }
+            auto name = atom_cache.FindName(atom);
+            return name ? name : std::to_string(atom);
+        }, log_context);
+
+        replies.SetConnection(connection);
+        replies.SetReplyHook([this](const void *reply) {
+            trace_writer.Reply(reply);
+        });
+
         setup = xcb_get_setup(connection);
         if (!setup) {
-            fprintf(stderr, "xcb_get_setup() failed\n");
+            LOG_ERROR("xcb_get_setup() failed\n");
             return false;
         }
 
+        // the screen named by the display string, e.g. ':1.1', not always the first one
         auto iter = xcb_setup_roots_iterator(setup);
+        for (int i = 0; i < screen_num && iter.rem; i++) {
+            xcb_screen_next(&iter);
+        }
         if (!iter.data) {
-            fprintf(stderr, "xcb_setup_roots_iterator() failed\n");
+            LOG_ERROR("xcb_setup_roots_iterator() failed\n");
             return false;
         }
         screen = iter.data;
 
-        if (!SetWindowAttribute(screen->root)) {
+        if (pipelined) {
+            return InitPipelined();
+        }
+
+        if (!headless && !SetWindowAttribute(screen->root, WATCH_EVENTS)) {
             return false;
         }
 
@@ -86,17 +337,113 @@ public:
             return false;
         }
 
-        if (!MapWindow()) {
+        if (!headless && !MapWindow()) {
+            return false;
+        }
+        return PreCacheAtoms();
+    }
+
+    // the profile's names in one batch: every request is sent before the first reply is read
+    bool PreCacheAtoms(void)
+    {
+        std::vector<xcb_intern_atom_cookie_t> cookies = {};
+        for (auto &name : precache_names) {
+            cookies.push_back(xcb_intern_atom(connection, 0, name.size(), name.c_str()));
+        }
+        for (size_t i = 0; i < cookies.size(); i++) {
+            auto reply = xcb_intern_atom_reply(connection, cookies[i], nullptr);
+            if (!reply) {
+                LOG_ERROR("xcb_intern_atom_reply() failed '%s'\n", LogText(precache_names[i].c_str()));
+                continue;
+            }
+            atom_cache.Insert(precache_names[i], reply->atom);
+            trace_writer.Atom(reply->atom, precache_names[i].data(), precache_names[i].size());
+            free(reply);
+        }
+        return true;
+    }
+
+    /**
+     * Same requests as the serial Init() plus the atom batch, all sent before anything waits
+     *
+     *   The last intern reply can only arrive after the server processed every earlier request,
+     *   so once it is read, each xcb_request_check() below is answered locally: one round trip.
+     */
+    bool InitPipelined(void)
+    {
+        std::vector<std::string> names = {
+            "CLIPBOARD", "TARGETS", "TIMESTAMP", "INCR", "UTF8_STRING", "TEXT",
+            "text/plain", "text/html", "image/png", "image/jpeg", "image/bmp",
+        };
+        for (auto &name : precache_names) {
+            if (std::find(names.begin(), names.end(), name) == names.end()) {
+                names.push_back(name);
+            }
+        }
+
+        struct check_t
+        {
+            const char         *name;
+            xcb_void_cookie_t   cookie;
+        };
+        std::vector<check_t> checks = {};
+        if (!headless) {
+            uint32_t root_values[] = {WATCH_EVENTS};
+            checks.push_back({"xcb_change_window_attributes_checked()",
+                xcb_change_window_attributes_checked(connection, screen->root, XCB_CW_EVENT_MASK, root_values)});
+        }
+        checks.push_back({"xcb_create_window_checked()", RequestWindow()});
+        if (!headless) {
+            checks.push_back({"xcb_map_window_checked()", xcb_map_window_checked(connection, window)});
+        }
+
+        std::vector<xcb_intern_atom_cookie_t> cookies = {};
+        for (auto &name : names) {
+            cookies.push_back(xcb_intern_atom(connection, 0, name.size(), name.c_str()));
+        }
+
+        auto rc = true;
+        for (size_t i = 0; i < cookies.size(); i++) {
+            auto reply = xcb_intern_atom_reply(connection, cookies[i], nullptr);
+            if (!reply) {
+                LOG_ERROR("xcb_intern_atom_reply() failed '%s'\n", LogText(names[i].c_str()));
+                rc = false;
+                continue;
+            }
+            atom_cache.Insert(names[i], reply->atom);
+            trace_writer.Atom(reply->atom, names[i].data(), names[i].size());
+            free(reply);
+        }
+
+        for (auto &check : checks) {
+            auto error = xcb_request_check(connection, check.cookie);
+            if (error) {
+                LOG_ERROR("%s failed (err: %d)\n", check.name, error->error_code);
+                free(error);
+                rc = false;
+            }
+        }
+        if (!rc) {
+            window = XCB_WINDOW_NONE;
             return false;
         }
+        if (!headless) {
+            LOG_INFO(" * xcb_change_window_attributes     : 0x%08X\n", screen->root);
+        }
+        LOG_INFO(" * pipelined init                   : %.3f ms\n", ElapsedMs(connect_begin));
         return true;
     }
 
+    static double ElapsedMs(std::chrono::steady_clock::time_point since)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+    }
+
     bool ShowCase(void)
     {
-        printf("\n");
-        printf(" * xcb_screen_root                  : 0x%08X\n", screen->root);
-        printf(" * xcb_window                       : 0x%08X\n", window);
+        LOG_INFO("\n");
+        LOG_INFO(" * xcb_screen_root                  : 0x%08X\n", screen->root);
+        LOG_INFO(" * xcb_window                       : 0x%08X\n", window);
 
         /**
          * Case 1. Who is the selection owner?
@@ -123,34 +470,146 @@ public:
          *   Note. X server may accept STRING and UTF8_STRING while 'text/plain' | 'text/plain;charset=utf-8' may not
          */
 
-        // Case 1
-        if (!GetSelectionOwner(XCB_ATOM_PRIMARY) ||
-            !GetSelectionOwner(XCB_ATOM_SECONDARY) ||
-            !GetSelectionOwner(GetAtom("CLIPBOARD"))) {
-            return false;
+        Start();
+        return RunEventLoop();
+    }
+
+    // Case 1 and 2-1 run as a coroutine, driven by the event loop as their replies arrive
+    void Start(void)
+    {
+        atom_profile.Started();
+        startup = QuerySelections();
+    }
+
+    Task<bool> QuerySelections(void)
+    {
+        // Case 1. every owner query and atom lookup is in flight at once
+        auto clipboard = InternAtom("CLIPBOARD");
+        auto targets   = InternAtom("TARGETS");
+        auto primary   = UpdateSelectionOwner(XCB_ATOM_PRIMARY);
+        auto secondary = UpdateSelectionOwner(XCB_ATOM_SECONDARY);
+        auto owner     = UpdateSelectionOwner(co_await clipboard);
+
+        if (!co_await primary || !co_await secondary || !co_await owner || !co_await targets) {
+            co_return false;
+        }
+
+        if (!stream_target_name.empty()) {
+            stream_target = co_await InternAtom(stream_target_name.c_str());
+        }
+        if (paste_fd != INVALID_FD) {
+            auto selection = GetAtom("CLIPBOARD");
+            if (!selections[selection].owner) {
+                LOG_ERROR("CLIPBOARD has no owner\n");
+                co_return false;
+            }
+            pending_target = stream_target;
+            co_return ConvertSelection(selection, stream_target);
+        }
+        if (stream_fd != INVALID_FD) {
+            co_return true;
+        }
+        // nobody took CLIPBOARD while we were gone: serve the last clip again
+        if (!own && !history.LastClip().empty() && !selections.count(GetAtom("CLIPBOARD")) && !co_await RestoreHistory()) {
+            co_return false;
         }
 
         // Case 2-1. request available targets aka 'mime_types' from the selection owner
         for (auto iter : selections) {
             auto &data = iter.second;
             if (data.owner != window && !ConvertSelection(data.atom, GetAtom("TARGETS"))) {
-                return false;
+                co_return false;
             }
         }
+        co_return true;
+    }
 
-        return RunEventLoop();
+    // takes CLIPBOARD with the history's last clip; names and payloads stay in the mapping
+    Task<bool> RestoreHistory(void)
+    {
+        auto &clip = history.LastClip();
+        // a (target, type) pair per target, all in flight at once; names in the mapping end in NUL
+        std::vector<Task<xcb_atom_t>> atoms = {};
+        for (auto &entry : clip) {
+            for (auto &target : entry.targets) {
+                atoms.push_back(InternAtom(target.name.data()));
+                atoms.push_back(InternAtom(target.type.data()));
+            }
+        }
+
+        std::map<xcb_atom_t, owned_t> content = {};
+        size_t n = 0;
+        size_t bytes = 0;
+        for (auto &entry : clip) {
+            for (size_t i = 0; i < entry.targets.size(); i++) {
+                auto target = co_await std::move(atoms[n]);
+                auto type = co_await std::move(atoms[n + 1]);
+                n += 2;
+                if (target && type) {
+                    content[target] = {type, entry.data, {}};
+                }
+            }
+            bytes += entry.data.size();
+        }
+        if (content.empty()) {
+            co_return true;
+        }
+
+        owned_content = std::move(content);
+        if (!SetSelectionOwner(GetAtom("CLIPBOARD"))) {
+            owned_content.clear();
+            co_return false;
+        }
+        LOG_INFO(" * history restore                  : clip %lu, %zu targets, %zu bytes, serving %.3f ms after connect\n",
+            clip.back().clip, owned_content.size(), bytes, ElapsedMs(connect_begin));
+        co_return true;
+    }
+
+    Task<xcb_atom_t> InternAtom(const char *name)
+    {
+        auto cached = atom_cache.FindUsed(name);
+        ProfileAtom(name, !cached);
+        if (cached) {
+            co_return cached;
+        }
+
+        auto reply = co_await replies.Send(xcb_intern_atom(connection, 0, strlen(name), name));
+        if (!reply) {
+            LOG_ERROR("xcb_intern_atom_reply() failed '%s'\n", LogText(name));
+            co_return XCB_NONE;
+        }
+
+        auto atom = reply->atom;
+        atom_cache.Insert(name, atom);
+        atom_cache.FindUsed(name);
+        trace_writer.Atom(atom, name, strlen(name));
+        free(reply);
+        co_return atom;
+    }
+
+    Task<bool> UpdateSelectionOwner(xcb_atom_t selection)
+    {
+        auto reply = co_await replies.Send(xcb_get_selection_owner(connection, selection));
+        if (!reply) {
+            LOG_ERROR("xcb_get_selection_owner_reply() failed\n");
+            co_return false;
+        }
+        SetSelectionData(selection, reply->owner);
+        free(reply);
+        co_return true;
     }
 
-    bool SetWindowAttribute(xcb_window_t window)
+    bool SetWindowAttribute(xcb_window_t window, uint32_t events)
     {
-        std::vector<uint32_t> values = {XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_PROPERTY_CHANGE, 0};
-        auto cookie = xcb_change_window_attributes_checked(connection, window, XCB_CW_EVENT_MASK, values.data());
+        uint32_t values[] = {events};
+        auto cookie = xcb_change_window_attributes_checked(connection, window, XCB_CW_EVENT_MASK, values);
         auto error = xcb_request_check(connection, cookie);
         if (error) {
-            fprintf(stderr, "xcb_change_window_attributes() failed\n");
+            LOG_ERROR("xcb_change_window_attributes() failed\n");
+            free(error);
             return false;
         }
-        printf(" * xcb_change_window_attributes     : 0x%08X\n", window);
+        LOG_INFO(" * xcb_change_window_attributes     : 0x%08X\n", window);
         return true;
     }
 
@@ -160,14 +619,17 @@ public:
         auto cookie = xcb_set_selection_owner_checked(connection, owner, selection, XCB_CURRENT_TIME);
         auto error = xcb_request_check(connection, cookie);
         if (error) {
-            fprintf(stderr, "xcb_set_selection_owner_checked() failed\n");
+            LOG_ERROR("xcb_set_selection_owner_checked() failed\n");
             free(error);
             return false;
         }
         auto &data = selections[selection] = {};
         data.atom  = selection;
         data.owner = owner;
-        printf(" * xcb_selection_owner              : 0x%08X '%s'\n", owner, GetAtomName(selection));
+        text_cache.clear();
+        images.Reset();
+        handoff.Reset();
+        LOG_INFO(" * xcb_selection_owner              : 0x%08X '%s'\n", owner, LogAtom(selection));
         xcb_flush(connection);
         return true;
     }
@@ -175,48 +637,95 @@ public:
     bool GetSelectionOwner(xcb_atom_t selection)
     {
         auto cookie = xcb_get_selection_owner(connection, selection);
-        auto reply = xcb_get_selection_owner_reply(connection, cookie, nullptr);
+        auto reply = WaitReply(xcb_get_selection_owner_reply, cookie);
         if (!reply) {
-            fprintf(stderr, "xcb_get_selection_owner_reply() failed\n");
+            LOG_ERROR("xcb_get_selection_owner_reply() failed\n");
             return false;
         }
-        if (!reply->owner) {
+        SetSelectionData(selection, reply->owner);
+        free(reply);
+        return true;
+    }
+
+    void SetSelectionData(xcb_atom_t selection, xcb_window_t owner)
+    {
+        if (!owner) {
             selections.erase(selection);
         } else {
             auto iter = selections.find(selection);
             if (iter == selections.end()) {
                 auto &data = selections[selection] = {};
                 data.atom  = selection;
-                data.owner = reply->owner;
+                data.owner = owner;
             } else {
                 auto &data = selections[selection];
-                data.owner = reply->owner;
+                data.owner = owner;
             }
         }
-        printf(" * xcb_selection_owner              : 0x%08X '%s'\n", reply->owner, GetAtomName(selection));
-        free(reply);
-        return true;
+        LOG_INFO(" * xcb_selection_owner              : 0x%08X '%s'\n", owner, LogAtom(selection));
     }
 
     bool GetNextSelectionTarget(void)
     {
-        if (pending_target || incr_property) {
+        if (pending_target || receive_property) {
             return true;
         }
 
         // Case 2-4. we can request real data specified by mime_type
         for (auto &iter : selections) {
             auto &data = iter.second;
-            if (!data.targets.empty()) {
-                auto target = data.targets.front();
-                data.targets.pop();
+            if (!data.targets.Empty()) {
+                auto target = data.targets.Pop();
                 pending_target = target;
                 return ConvertSelection(data.atom, target);
             }
         }
+        EndPaste();
         return true;
     }
 
+    // a paste runs from the TARGETS request until every target it listed has been fetched
+    void BeginPaste(void)
+    {
+        if (!paste_active) {
+            paste_active = true;
+            paste_allocations = Allocations();
+            paste_clip = history.NextClip();
+        }
+    }
+
+    void EndPaste(void)
+    {
+        if (!paste_active) {
+            return;
+        }
+        for (auto &iter : selections) {
+            iter.second.targets = {};
+            iter.second.fallback = {};
+        }
+        auto blocks = transfer_arena.Blocks();
+        transfer_arena.Reset();
+        paste_active = false;
+
+        auto allocations = Allocations() - paste_allocations;
+        metrics.pastes++;
+        metrics.paste_allocations += allocations;
+        LOG_INFO("       . paste : %lu allocations, %zu arena blocks\n", allocations, blocks);
+        AppendPaste();
+    }
+
+    // heap allocations plus buffers the pool had to allocate, on the calling (event) thread only
+    static uint64_t ThreadAllocations(void)
+    {
+        return heap_allocations + BufferPool::ThreadAllocated();
+    }
+
+    // the thread's allocations made while this display was handling its events, up to now
+    uint64_t Allocations(void) const
+    {
+        return step_allocations + ThreadAllocations() - step_begin;
+    }
+
     bool ConvertSelection(xcb_atom_t selection, xcb_atom_t target)
     {
         auto iter = selections.find(selection);
@@ -226,27 +735,33 @@ public:
 
         auto &data = iter->second;
         if (target == GetAtom("TARGETS")) {
+            BeginPaste();
             data.targets = {};
         }
 
         xcb_window_t requestor = window;
         xcb_atom_t property = XCB_ATOM_CUT_BUFFER0 + (cut_buffer_idx++ % 8);
 
-        auto cookie = xcb_convert_selection_checked(connection, requestor, selection, target, property, XCB_CURRENT_TIME);
-        auto error = xcb_request_check(connection, cookie);
-        if (error) {
-            fprintf(stderr, "xcb_convert_selection_checked() failed (err: %d)\n", error->error_code);
-            free(error);
-            return false;
+        if (pipelined) {
+            // no round trip: a failure comes back as an error event
+            xcb_convert_selection(connection, requestor, selection, target, property, XCB_CURRENT_TIME);
+        } else {
+            auto cookie = xcb_convert_selection_checked(connection, requestor, selection, target, property, XCB_CURRENT_TIME);
+            auto error = xcb_request_check(connection, cookie);
+            if (error) {
+                LOG_ERROR("xcb_convert_selection_checked() failed (err: %d)\n", error->error_code);
+                free(error);
+                return false;
+            }
         }
-        printf(" * xcb_convert_selection_checked()  : requestor 0x%08X, selection '%s', target '%s', property '%s'\n",
-            requestor, GetAtomName(selection), GetAtomName(target), GetAtomName(property));
+        LOG_INFO(" * xcb_convert_selection_checked()  : requestor 0x%08X, selection '%s', target '%s', property '%s'\n",
+            requestor, LogAtom(selection), LogAtom(target), LogAtom(property));
         return true;
     }
 
     bool ProcButtonPress(xcb_button_press_event_t *event)
     {
-        printf("   - XCB_BUTTON_PRESS               : seq: %4u, time: %10u, root: 0x%08X, event: 0x%08X, child: 0x%08X, event_x: %d, event_y: %d, state: %u, same_screen: %u\n",
+        LOG_INFO("   - XCB_BUTTON_PRESS               : seq: %4u, time: %10u, root: 0x%08X, event: 0x%08X, child: 0x%08X, event_x: %d, event_y: %d, state: %u, same_screen: %u\n",
             event->sequence, event->time, event->root, event->event, event->child, event->event_x, event->event_y, event->state, event->same_screen);
 
         auto selection = GetAtom("CLIPBOARD");
@@ -266,77 +781,144 @@ public:
 
     bool ProcPropertyNotify(xcb_property_notify_event_t *event)
     {
-        printf("   - XCB_PROPERTY_NOTIFY            : seq: %4u, time: %10u, window: 0x%08X, state: '%s', atom: '%s'\n",
-            event->sequence, event->time, event->window, event->state == XCB_PROPERTY_NEW_VALUE ? "new" : "del", GetAtomName(event->atom));
+        LOG_INFO("   - XCB_PROPERTY_NOTIFY            : seq: %4u, time: %10u, window: 0x%08X, state: '%s', atom: '%s'\n",
+            event->sequence, event->time, event->window, event->state == XCB_PROPERTY_NEW_VALUE ? "new" : "del", LogAtom(event->atom));
 
-        if (event->atom != incr_property) {
+        if (event->window == window) {
+            if (event->atom != receive_property || event->state != XCB_PROPERTY_NEW_VALUE) {
+                return true;
+            }
+            auto cookie = xcb_get_property(connection, 1, window, event->atom, XCB_GET_PROPERTY_TYPE_ANY, 0, INT32_MAX / 4);
+            auto reply = WaitReply(xcb_get_property_reply, cookie);
+            if (!reply) {
+                LOG_ERROR("Failed to read property\n");
+                return true;
+            }
+            auto len = xcb_get_property_value_length(reply);
+            auto val = xcb_get_property_value(reply);
+            LOG_INFO("       . length: %d\n", len);
+            metrics.bytes_received += len;
+
+            if (paste_fd != INVALID_FD) {
+                // each chunk goes straight out; only the current reply is buffered
+                if (!WriteAll(paste_fd, val, len)) {
+                    Finish(false);
+                } else if (!len) {
+                    receive_property = XCB_ATOM_NONE;
+                    Finish(true);
+                }
+            } else if (len) {
+                receive_type = reply->type;
+                receive_writer.Append(val, len);
+            } else {
+                auto result = store.Commit(receive_selection, receive_target, receive_type, receive_writer);
+                LogStored(result);
+                Remember(receive_selection, receive_target, result.hash);
+                receive_property = XCB_ATOM_NONE;
+                GetNextSelectionTarget();
+            }
+            free(reply);
             return true;
         }
 
-        if (event->state == XCB_PROPERTY_NEW_VALUE) {
-            if (event->window == window) {
-                auto cookie = xcb_get_property(connection, 1, window, event->atom, XCB_GET_PROPERTY_TYPE_ANY, 0, INT32_MAX / 4);
-                auto reply = xcb_get_property_reply(connection, cookie, nullptr);
-                if (!reply) {
-                    printf("Failed to read property\n");
-                } else {
-                    auto len = xcb_get_property_value_length(reply);
-                    auto val = xcb_get_property_value(reply);
-                    printf("       . length: %d\n", len);
-
-                    if (len) {
-                        if (write_fd != INVALID_FD) {
-                            write(write_fd, val, len);
-                        }
-                    } else {
-                        if (write_fd != INVALID_FD) {
-                            close(write_fd);
-                            write_fd = INVALID_FD;
-                        }
-                        incr_property = XCB_ATOM_NONE;
-                        GetNextSelectionTarget();
-                    }
-                    free(reply);
-                }
+        if (event->state != XCB_PROPERTY_DELETE) {
+            return true;
+        }
+        auto iter = incr_sends.find({event->window, event->atom});
+        if (iter == incr_sends.end()) {
+            return true;
+        }
+        auto &incr = iter->second;
+
+        // a stream continues past the content, which only holds its first chunk
+        const uint8_t *chunk = nullptr;
+        ssize_t bytes = 0;
+        if (incr.bytes < incr.content.size()) {
+            bytes = std::min<ssize_t>(INCR_CHUNK_SIZE, incr.content.size() - incr.bytes);
+            chunk = reinterpret_cast<const uint8_t *>(incr.content.data()) + incr.bytes;
+        } else if (incr.stream) {
+            if (!stream_buf) {
+                stream_buf = BufferPool::Get().Acquire(INCR_CHUNK_SIZE);
             }
-        } else {
-            if (event->window != window) {
-                auto bytes = read(read_fd, read_buf, INCR_CHUNK_SIZE);
-                if (bytes < 0) {
-                    fprintf(stderr, "read() failed (err: '%s')\n", strerror(errno));
-                    return false;
-                }
-                incr_bytes += bytes;
-                printf("       . bytes : %u\n", incr_bytes);
-                printf("       . chunk : %lu\n", bytes);
-
-                auto cookie = xcb_change_property_checked(connection, XCB_PROP_MODE_REPLACE,
-                    event->window, event->atom, incr_target, 8, bytes, &read_buf);
-                auto error = xcb_request_check(connection, cookie);
-                if (error) {
-                    fprintf(stderr, "xcb_change_property_checked() failed (err: %d)\n", error->error_code);
-                    free(error);
-                    return true;
-                }
-                if (!bytes) {
-                    incr_property = XCB_ATOM_NONE;
-                    incr_target = XCB_ATOM_NONE;
-                    incr_bytes = 0;
-                }
+            bytes = ReadStream(stream_fd, stream_buf.Data(), INCR_CHUNK_SIZE);
+            if (bytes < 0) {
+                LOG_ERROR("read() failed (err: '%s')\n", LogText(strerror(errno)));
+                bytes = 0;
             }
+            chunk = stream_buf.Data();
+        }
+        incr.bytes += bytes;
+        LOG_INFO("       . bytes : %lu\n", incr.bytes);
+        LOG_INFO("       . chunk : %lu\n", bytes);
+
+        auto cookie = xcb_change_property_checked(connection, XCB_PROP_MODE_REPLACE,
+            event->window, event->atom, incr.target, 8, bytes, chunk);
+        auto error = xcb_request_check(connection, cookie);
+        if (error) {
+            LOG_ERROR("xcb_change_property_checked() failed (err: %d)\n", error->error_code);
+            free(error);
+            EndIncr(event->window, event->atom, false);
+            return true;
+        }
+        metrics.bytes_sent += bytes;
+        if (!bytes) {
+            EndIncr(event->window, event->atom, true);
+        }
+        return true;
+    }
+
+    // a requestor destroyed mid-transfer never deletes the property again
+    bool ProcDestroyNotify(xcb_destroy_notify_event_t *event)
+    {
+        for (auto iter = incr_sends.lower_bound({event->window, XCB_ATOM_NONE});
+             iter != incr_sends.end() && iter->first.first == event->window;
+             iter = incr_sends.lower_bound({event->window, XCB_ATOM_NONE})) {
+            LOG_WARN("       . requestor 0x%08X destroyed, INCR of '%s' dropped at %lu bytes\n",
+                event->window, LogAtom(iter->first.second), iter->second.bytes);
+            EndIncr(event->window, iter->first.second, false);
         }
         return true;
     }
 
+    // a finished or abandoned transfer; a headless owner unsubscribes once a requestor has none left
+    void EndIncr(xcb_window_t requestor, xcb_atom_t property, bool rc)
+    {
+        auto iter = incr_sends.find({requestor, property});
+        if (iter == incr_sends.end()) {
+            return;
+        }
+        if (iter->second.stream) {
+            stream_buf.Reset();
+            Finish(rc);
+        }
+        incr_sends.erase(iter);
+
+        auto next = incr_sends.lower_bound({requestor, XCB_ATOM_NONE});
+        if (rc && headless && (next == incr_sends.end() || next->first.first != requestor)) {
+            // the requestor's property changes are of no use to us past its transfers
+            uint32_t none[] = {XCB_EVENT_MASK_NO_EVENT};
+            xcb_change_window_attributes(connection, requestor, XCB_CW_EVENT_MASK, none);
+        }
+    }
+
     bool ProcSelectionClear(xcb_selection_clear_event_t *event)
     {
         // Case 4
-        printf("   - XCB_SELECTION_CLEAR            : seq: %4u, time: %10u, owner: 0x%08X, selection: '%s'\n",
-            event->sequence, event->time, event->owner, GetAtomName(event->selection));
+        LOG_INFO("   - XCB_SELECTION_CLEAR            : seq: %4u, time: %10u, owner: 0x%08X, selection: '%s'\n",
+            event->sequence, event->time, event->owner, LogAtom(event->selection));
 
         if (event->owner != window) {
             return true;
         }
+        if (stream_fd != INVALID_FD) {
+            // an INCR transfer already under way still completes
+            Finish(true);
+            return true;
+        }
+        text_cache.clear();
+        images.Reset();
+        handoff.Reset();
+        owned_content.clear();
 
         // retrive who has ownership
         if (!GetSelectionOwner(event->selection)) {
@@ -371,108 +953,635 @@ public:
             .event = notify
         };
 
-        auto cookie = xcb_send_event_checked(connection, 0, event->requestor, XCB_EVENT_MASK_NO_EVENT, response.data);
-        auto error = xcb_request_check(connection, cookie);
-        if (error) {
-            fprintf(stderr, "xcb_send_event_checked() failed (err: %d)\n", error->error_code);
-            free(error);
-            return false;
+        if (workers.Size()) {
+            // no round trip on the event thread; a failure comes back as an error event
+            xcb_send_event(connection, 0, event->requestor, XCB_EVENT_MASK_NO_EVENT, response.data);
+        } else {
+            auto cookie = xcb_send_event_checked(connection, 0, event->requestor, XCB_EVENT_MASK_NO_EVENT, response.data);
+            auto error = xcb_request_check(connection, cookie);
+            if (error) {
+                LOG_ERROR("xcb_send_event_checked() failed (err: %d)\n", error->error_code);
+                free(error);
+                return false;
+            }
         }
-        printf("       . responsed\n");
+        LOG_INFO("       . responsed\n");
         xcb_flush(connection);
         return true;
     }
 
     bool ProcSelectionRequest(xcb_selection_request_event_t *event)
     {
-        printf("   - XCB_SELECTION_REQUEST          : seq: %4u, time: %10u, owner: 0x%08X, requestor: 0x%08X, selection: '%s', target: '%s', property: '%s'\n",
-            event->sequence, event->time, event->owner, event->requestor, GetAtomName(event->selection), GetAtomName(event->target), GetAtomName(event->property));
+        LOG_INFO("   - XCB_SELECTION_REQUEST          : seq: %4u, time: %10u, owner: 0x%08X, requestor: 0x%08X, selection: '%s', target: '%s', property: '%s'\n",
+            event->sequence, event->time, event->owner, event->requestor, LogAtom(event->selection), LogAtom(event->target), LogAtom(event->property));
 
         if (event->requestor == window) {
             return true;
         }
+        metrics.requests++;
 
-        xcb_atom_t image_atom = XCB_ATOM_NONE;
-        image_atom = GetAtom("image/png");
-        //image_atom = GetAtom("image/jpeg");
-
-        xcb_void_cookie_t cookie = {};
-        if (event->target == GetAtom("TARGETS")) {
-            std::vector<xcb_atom_t> targets = {};
+        request_job_t job = {};
+        job.event = *event;
+        PrepareSelectionRequest(job);
 
-            if (image_atom == GetAtom("image/png")) {
-                read_fd = open("test.png", O_RDONLY | O_CREAT, S_IRUSR | S_IWUSR);
-            } else if (image_atom == GetAtom("image/jpeg")) {
-                read_fd = open("test.jpg", O_RDONLY | O_CREAT, S_IRUSR | S_IWUSR);
+        if (!workers.Size()) {
+            if (job.incr) {
+                StartIncr(job);
             } else {
-                read_fd = INVALID_FD;
+                ExecuteSelectionRequest(job);
             }
-            if (read_fd != INVALID_FD) {
-                read_fd_len = lseek(read_fd, 0, SEEK_END);
-                targets.push_back(image_atom);
-            } else {
-                targets.push_back(XCB_ATOM_STRING);
-                targets.push_back(GetAtom("UTF8_STRING"));
+            return SendSelectionResponse(&job.event);
+        }
+
+        // one request per requestor is in flight; the rest wait in order behind it
+        auto &queue = requestor_jobs[job.event.requestor];
+        queue.push_back(std::move(job));
+        if (queue.size() == 1) {
+            DispatchSelectionRequest(queue.front());
+        }
+        return true;
+    }
+
+    /**
+     * Event thread part of a request: everything that touches the atom cache or transfer state
+     *
+     *   Leaves either a ready-to-write property (type, format, data or a file range) or an INCR
+     *   transfer to start, or clears the property when the target cannot be served.
+     */
+    void PrepareSelectionRequest(request_job_t &job)
+    {
+        auto event = &job.event;
+
+        if (event->target == GetAtom("TARGETS")) {
+            auto targets = ContentTargets();
+            blob_t content = {};
+            if (handoff.Listening() && HandoffContent(content)) {
+                targets.push_back(GetAtom(MemfdHandoff::TARGET));
             }
             targets.push_back(event->target);
             targets.push_back(GetAtom("TIMESTAMP"));
 
             for (auto target : targets) {
-                printf("       . target: '%s'\n", GetAtomName(target));
+                LOG_INFO("       . target: '%s'\n", LogAtom(target));
             }
-
-            cookie = xcb_change_property_checked(connection, XCB_PROP_MODE_REPLACE,
-                event->requestor, event->property, XCB_ATOM_ATOM, 8 * sizeof(xcb_atom_t), targets.size(), targets.data());
+            job.SetProperty(XCB_ATOM_ATOM, 8 * sizeof(xcb_atom_t), targets.data(), targets.size() * sizeof(xcb_atom_t));
         } else if (event->target == GetAtom("TIMESTAMP")) {
             xcb_timestamp_t cur = XCB_CURRENT_TIME;
-            cookie = xcb_change_property_checked(connection, XCB_PROP_MODE_REPLACE,
-                event->requestor, event->property, XCB_ATOM_INTEGER, 8 * sizeof(xcb_timestamp_t), 1, &cur);
-        } else if (event->target == XCB_ATOM_STRING || event->target == GetAtom("UTF8_STRING")) {
-            static char text[] = "Copy & Paste test";
-            cookie = xcb_change_property_checked(connection, XCB_PROP_MODE_REPLACE,
-                event->requestor, event->property, event->target, 8, strlen(text), text);
-        } else if (image_atom && image_atom == event->target) {
-            if (read_fd == INVALID_FD) {
+            job.SetProperty(XCB_ATOM_INTEGER, 8 * sizeof(xcb_timestamp_t), &cur, sizeof(cur));
+        } else if (stream_fd != INVALID_FD) {
+            PrepareStreamRequest(job);
+        } else if (handoff.Listening() && event->target == GetAtom(MemfdHandoff::TARGET)) {
+            blob_t content = {};
+            auto type = HandoffContent(content);
+            auto value = type ? handoff.Offer(content, type) : std::string();
+            if (value.empty()) {
                 event->property = XCB_ATOM_NONE;
-            } else {
-                lseek(read_fd, 0, SEEK_SET);
-                if (read_fd_len < INCR_CHUNK_SIZE) {
-                    auto bytes = read(read_fd, read_buf, INCR_CHUNK_SIZE);
-                    if (bytes < 0) {
-                        event->property = XCB_ATOM_NONE;
-                        fprintf(stderr, "read() failed (err: '%s')\n", strerror(errno));
-                    } else {
-                        cookie = xcb_change_property_checked(connection, XCB_PROP_MODE_REPLACE,
-                            event->requestor, event->property, event->target, 8, bytes, &read_buf);
-                    }
-                } else if (!SetWindowAttribute(event->requestor)) {
-                    event->property = XCB_ATOM_NONE;
-                } else {
-                    incr_property = event->property;
-                    incr_target = event->target;
-                    incr_bytes = 0;
-                    cookie = xcb_change_property_checked(connection, XCB_PROP_MODE_REPLACE,
-                        event->requestor, event->property, GetAtom("INCR"), 32, 1, &read_fd_len);
-                    printf("       . 'INCR': %u\n", read_fd_len);
-                }
+                return;
+            }
+            LOG_INFO("       . memfd : %u bytes '%s'\n", static_cast<uint32_t>(content->size()), type);
+            job.SetProperty(event->target, 8, value.data(), value.size());
+        } else if (!owned_content.empty()) {
+            auto iter = owned_content.find(event->target);
+            if (iter == owned_content.end()) {
+                event->property = XCB_ATOM_NONE;
+                return;
+            }
+            job.SetContent(iter->second.type, iter->second.data, iter->second.blob);
+        } else if (TextTargets().count(event->target)) {
+            auto blob = GetText(event->target);
+            if (!blob) {
+                event->property = XCB_ATOM_NONE;
+                return;
             }
+            // TEXT lets the owner pick the encoding; the reply type says which one
+            job.SetContent(event->target == GetAtom("TEXT") ? GetAtom("UTF8_STRING") : event->target, *blob, blob);
+        } else if (auto image = GetImage(event->target)) {
+            job.SetContent(event->target, *image, image);
+        } else {
+            event->property = XCB_ATOM_NONE;
         }
+    }
 
-        if (event->property) {
+    // thread-safe part of a request: the property write with its round trip
+    void ExecuteSelectionRequest(request_job_t &job)
+    {
+        auto event = &job.event;
+        if (!event->property) {
+            return;
+        }
+
+        if (job.content.data()) {
+            auto cookie = xcb_change_property_checked(connection, XCB_PROP_MODE_REPLACE,
+                event->requestor, event->property, job.type, job.format, job.content.size(), job.content.data());
             auto error = xcb_request_check(connection, cookie);
             if (error) {
                 event->property = XCB_ATOM_NONE;
-                fprintf(stderr, "xcb_change_property_checked() failed (err: %d)\n", error->error_code);
+                LOG_ERROR("xcb_change_property_checked() failed (err: %d)\n", error->error_code);
                 free(error);
+                return;
+            }
+            metrics.bytes_sent += job.content.size();
+            return;
+        }
+
+        auto cookie = xcb_change_property_checked(connection, XCB_PROP_MODE_REPLACE,
+            event->requestor, event->property, job.type, job.format, job.data.size() * 8 / job.format, job.data.data());
+        auto error = xcb_request_check(connection, cookie);
+        if (error) {
+            event->property = XCB_ATOM_NONE;
+            LOG_ERROR("xcb_change_property_checked() failed (err: %d)\n", error->error_code);
+            free(error);
+            return;
+        }
+        metrics.bytes_sent += job.data.size();
+    }
+
+    // Case 3-6 for large data: announce INCR, then PropertyNotify(delete) pulls each chunk
+    void StartIncr(request_job_t &job)
+    {
+        auto event = &job.event;
+        if (!SetWindowAttribute(event->requestor, headless ? INCR_EVENTS : WATCH_EVENTS)) {
+            event->property = XCB_ATOM_NONE;
+            return;
+        }
+
+        // for a stream of unknown length this is the lower bound ICCCM allows: what is buffered
+        uint32_t len = job.content.size();
+        auto key = incr_key_t{event->requestor, event->property};
+        incr_sends[key] = {job.type, job.content, job.blob, 0, job.stream};
+        auto cookie = xcb_change_property_checked(connection, XCB_PROP_MODE_REPLACE,
+            event->requestor, event->property, GetAtom("INCR"), 32, 1, &len);
+        LOG_INFO("       . 'INCR': %u\n", len);
+
+        auto error = xcb_request_check(connection, cookie);
+        if (error) {
+            event->property = XCB_ATOM_NONE;
+            LOG_ERROR("xcb_change_property_checked() failed (err: %d)\n", error->error_code);
+            free(error);
+            EndIncr(event->requestor, key.second, false);
+        }
+    }
+
+    // what we serve as owner, without TARGETS, TIMESTAMP and the memfd handoff
+    std::vector<xcb_atom_t> ContentTargets(void)
+    {
+        std::vector<xcb_atom_t> targets = {};
+        if (stream_fd == INVALID_FD && owned_content.empty() && !text_mode && !images.Loaded()) {
+            if (!images.Load("test.png")) {
+                images.Load("test.jpg");
+            }
+        }
+        if (stream_fd != INVALID_FD) {
+            targets.push_back(stream_target);
+        } else if (!owned_content.empty()) {
+            for (auto &iter : owned_content) {
+                targets.push_back(iter.first);
+            }
+        } else if (!text_mode && images.Loaded()) {
+            for (auto type : images.Targets()) {
+                targets.push_back(GetAtom(type));
+            }
+        } else {
+            for (auto &iter : TextTargets()) {
+                targets.push_back(iter.first);
+            }
+        }
+        return targets;
+    }
+
+    // loads the canonical UTF-8 text served for every text target; invalid UTF-8 is read as Latin-1
+    bool SetText(const char *path)
+    {
+        auto fd = open(path, O_RDONLY);
+        if (fd == INVALID_FD) {
+            LOG_ERROR("open() failed '%s' (err: '%s')\n", LogText(path), LogText(strerror(errno)));
+            return false;
+        }
+
+        std::string data = {};
+        char buf[64 * 1024];
+        for (ssize_t bytes; (bytes = read(fd, buf, sizeof(buf))) > 0;) {
+            data.append(buf, bytes);
+        }
+        close(fd);
+
+        if (!Transcoder::ValidateUtf8(reinterpret_cast<const uint8_t *>(data.data()), data.size())) {
+            LOG_WARN(" * text is not UTF-8, reading it as ISO8859-1\n");
+            data = Transcoder::Latin1ToUtf8(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+        }
+        text = std::move(data);
+        text_mode = true;
+        text_cache.clear();
+        return true;
+    }
+
+    /**
+     * Text targets and the charset each one is served in (Transcoder::UTF8 or an ISO8859 part)
+     *
+     *   Interned in one batch on first use; charsets the system has no table for are left out.
+     */
+    const std::map<xcb_atom_t, int> &TextTargets(void)
+    {
+        if (!text_targets.empty()) {
+            return text_targets;
+        }
+
+        std::vector<std::pair<std::string, int>> names = {
+            { "UTF8_STRING",                    Transcoder::UTF8 },
+            { "TEXT",                           Transcoder::UTF8 },
+            { "text/plain;charset=utf-8",       Transcoder::UTF8 },
+            { "STRING",                         1                },
+        };
+        for (int part = 1; part <= Transcoder::MAX_PART; part++) {
+            if (Transcoder::Get().Supported(part)) {
+                names.push_back({ "ISO8859-" + std::to_string(part), part });
+                names.push_back({ "text/plain;charset=iso8859-" + std::to_string(part), part });
+            }
+        }
+
+        std::vector<xcb_intern_atom_cookie_t> cookies = {};
+        for (auto &name : names) {
+            auto cached = atom_cache.Find(name.first);
+            cookies.push_back(!cached ? xcb_intern_atom(connection, 0, name.first.size(), name.first.c_str()) : xcb_intern_atom_cookie_t{});
+        }
+        for (size_t i = 0; i < names.size(); i++) {
+            auto &name = names[i].first;
+            if (cookies[i].sequence) {
+                auto reply = xcb_intern_atom_reply(connection, cookies[i], nullptr);
+                if (!reply) {
+                    continue;
+                }
+                atom_cache.Insert(name, reply->atom);
+                trace_writer.Atom(reply->atom, name.data(), name.size());
+                free(reply);
+            }
+            text_targets[atom_cache.Find(name)] = names[i].second;
+        }
+        return text_targets;
+    }
+
+    // the text in the charset of 'target', converted once and kept until the text or ownership changes
+    blob_t GetText(xcb_atom_t target)
+    {
+        auto iter = text_cache.find(target);
+        if (iter != text_cache.end()) {
+            return iter->second;
+        }
+
+        auto charset = TextTargets().find(target);
+        if (charset == text_targets.end()) {
+            return {};
+        }
+
+        // targets sharing a charset share one buffer
+        for (auto &cached : text_cache) {
+            if (text_targets[cached.first] == charset->second) {
+                return text_cache[target] = cached.second;
+            }
+        }
+
+        auto converted = std::make_shared<std::string>();
+        if (!Transcoder::Get().Encode(text, charset->second, *converted)) {
+            return {};
+        }
+        return text_cache[target] = converted;
+    }
+
+    // serves the image at 'path' as every image type it can be converted to
+    bool SetImage(const char *path)
+    {
+        if (!images.Load(path)) {
+            LOG_ERROR("failed to load image '%s'\n", LogText(path));
+            return false;
+        }
+        text_mode = false;
+        return true;
+    }
+
+    // the image as 'target', converted on first request and kept until ownership changes
+    blob_t GetImage(xcb_atom_t target)
+    {
+        if (text_mode) {
+            return {};
+        }
+        for (auto type : images.Targets()) {
+            if (GetAtom(type) == target) {
+                auto blob = images.Get(type);
+                if (!blob) {
+                    LOG_ERROR("failed to convert the image to '%s'\n", type);
+                }
+                return blob;
+            }
+        }
+        return {};
+    }
+
+    // the content handed off through a memfd and its type: the image as loaded, or the UTF-8 text
+    const char *HandoffContent(blob_t &content)
+    {
+        if (stream_fd != INVALID_FD) {
+            return nullptr;
+        }
+        if (!owned_content.empty()) {
+            auto &owned = owned_content.begin()->second;
+            if (!owned.blob) {
+                // restored from the history: the memfd is filled from one copy, kept with the content
+                owned.blob = std::make_shared<const std::string>(owned.data);
+            }
+            content = owned.blob;
+            return GetAtomName(owned.type);
+        }
+        if (!text_mode && images.Loaded()) {
+            auto type = images.Targets().front();
+            content = images.Get(type);
+            return content ? type : nullptr;
+        }
+        content = GetText(GetAtom("UTF8_STRING"));
+        return content ? "UTF8_STRING" : nullptr;
+    }
+
+    // requestor side of 'x-memfd-handle'; the content is stored under the type the owner announced
+    bool ReceiveMemfd(xcb_atom_t selection, const void *value, size_t len)
+    {
+        auto begin = std::chrono::steady_clock::now();
+        size_t size = 0;
+        std::string type = {};
+        auto fd = MemfdHandoff::Claim(static_cast<const char *>(value), len, size, type);
+        if (fd == INVALID_FD) {
+            LOG_WARN("       . memfd handoff failed, falling back to the other targets\n");
+            return false;
+        }
+
+        auto data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+        close(fd);
+        if (data == MAP_FAILED) {
+            LOG_ERROR("mmap() failed (err: '%s')\n", LogText(strerror(errno)));
+            return false;
+        }
+        auto atom = GetAtom(type.c_str());
+        auto result = store.Put(selection, atom, atom, data, size);
+        metrics.bytes_received += size;
+        if (data) {
+            munmap(data, size);
+        }
+
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count();
+        LOG_INFO("       . memfd : '%s', %lu bytes in %ld us\n", LogText(type.c_str()), size, us);
+        LogStored(result);
+        Remember(selection, atom, result.hash);
+        return true;
+    }
+
+    // event thread side of the control socket
+    void ProcControlRequest(const ControlSocket::request_t &request)
+    {
+        auto &args = request.args;
+        LOG_INFO("   - control request                : '%s', %zu args, %zu bytes\n",
+            LogText(args[0].c_str()), args.size() - 1, request.content ? request.content->size() : 0);
+
+        ControlSocket::reply_t reply = {};
+        if (args[0] == "set" && args.size() > 1) {
+            reply = ControlSet(request);
+        } else if (args[0] == "get" && args.size() == 2) {
+            reply = ControlGet(args[1]);
+        } else if (args[0] == "status" && args.size() == 1) {
+            reply = ControlStatus();
+        } else {
+            reply.line = "error usage: set <target>... | get <target> | status";
+        }
+        if (reply.line.compare(0, 2, "ok")) {
+            LOG_WARN("       . %s\n", LogText(reply.line.c_str()));
+        }
+        control.Reply(request.client, std::move(reply));
+    }
+
+    // serves the content as every target given and (re)takes CLIPBOARD, so watchers see the change
+    ControlSocket::reply_t ControlSet(const ControlSocket::request_t &request)
+    {
+        auto content = request.content ? request.content : std::make_shared<const std::string>();
+        std::map<xcb_atom_t, owned_t> targets = {};
+        for (size_t i = 1; i < request.args.size(); i++) {
+            auto atom = GetAtom(request.args[i].c_str());
+            if (!atom) {
+                return {"error cannot intern '" + request.args[i] + "'", {}};
+            }
+            targets[atom] = {atom, *content, content};
+        }
+
+        owned_content = std::move(targets);
+        if (!SetSelectionOwner(GetAtom("CLIPBOARD"))) {
+            owned_content.clear();
+            return {"error cannot take CLIPBOARD", {}};
+        }
+        if (history.Opened()) {
+            std::vector<ClipboardHistory::target_t> names = {};
+            for (size_t i = 1; i < request.args.size(); i++) {
+                names.push_back({request.args[i], request.args[i]});
+            }
+            AppendHistory(history.NextClip(), names, *content);
+        }
+        return {"ok", {}};
+    }
+
+    // what we serve while we own CLIPBOARD, otherwise what was last received from its owner
+    ControlSocket::reply_t ControlGet(const std::string &name)
+    {
+        auto selection = GetAtom("CLIPBOARD");
+        auto target = GetAtom(name.c_str());
+        auto iter = selections.find(selection);
+        blob_t content = {};
+        xcb_atom_t type = target;
+        if (iter != selections.end() && iter->second.owner == window) {
+            if (!owned_content.empty()) {
+                auto found = owned_content.find(target);
+                if (found != owned_content.end()) {
+                    auto &owned = found->second;
+                    content = owned.blob ? owned.blob : std::make_shared<const std::string>(owned.data);
+                    type = owned.type;
+                }
+            } else if (TextTargets().count(target)) {
+                content = GetText(target);
+                type = target == GetAtom("TEXT") ? GetAtom("UTF8_STRING") : target;
+            } else {
+                content = GetImage(target);
+            }
+        } else {
+            std::string_view data = {};
+            uint32_t stored_type = XCB_ATOM_NONE;
+            if (store.Find(selection, target, data, &stored_type)) {
+                content = std::make_shared<const std::string>(data);
+                type = stored_type;
+            }
+        }
+        if (!content) {
+            return {"error '" + name + "' is not available", {}};
+        }
+        return {"ok " + std::string(GetAtomName(type)) + " " + std::to_string(content->size()), content};
+    }
+
+    // who owns CLIPBOARD and every target 'get' can answer for it
+    ControlSocket::reply_t ControlStatus(void)
+    {
+        auto selection = GetAtom("CLIPBOARD");
+        auto iter = selections.find(selection);
+        xcb_window_t owner = iter != selections.end() ? iter->second.owner : static_cast<xcb_window_t>(XCB_WINDOW_NONE);
+
+        std::vector<xcb_atom_t> targets = {};
+        const char *state = "none";
+        if (owner == window) {
+            state = "owned";
+            targets = ContentTargets();
+        } else if (owner) {
+            state = "foreign";
+            targets = store.Targets(selection);
+        }
+
+        char buf[64];
+        snprintf(buf, sizeof(buf), "ok %s 0x%08X", state, owner);
+        ControlSocket::reply_t reply = {buf, {}};
+        for (auto target : targets) {
+            reply.line += ' ';
+            reply.line += GetAtomName(target);
+        }
+        return reply;
+    }
+
+    /**
+     * Pipe mode: take CLIPBOARD and serve 'fd', of unknown length, once
+     *
+     *   Nothing is read until the first request. Content that ends within one chunk is sent as a
+     *   plain property, anything longer via INCR, reading the next chunk as each one is taken.
+     */
+    bool SetCopyStream(int fd, const char *target)
+    {
+        if (fd == INVALID_FD) {
+            LOG_ERROR("open() failed (err: '%s')\n", LogText(strerror(errno)));
+            return false;
+        }
+        stream_fd = fd;
+        stream_target_name = target;
+        own = true;
+        return true;
+    }
+
+    // pipe mode: convert CLIPBOARD to 'target' once and write it to 'fd' as it arrives
+    bool SetPasteStream(int fd, const char *target)
+    {
+        paste_fd = fd;
+        stream_target_name = target;
+        return true;
+    }
+
+    void PrepareStreamRequest(request_job_t &job)
+    {
+        auto event = &job.event;
+        if (event->target != stream_target || stream_started) {
+            event->property = XCB_ATOM_NONE;
+            return;
+        }
+        stream_started = true;
+
+        auto first = std::make_shared<std::string>(INCR_CHUNK_SIZE, '\0');
+        auto bytes = ReadStream(stream_fd, first->data(), first->size());
+        if (bytes < 0) {
+            LOG_ERROR("read() failed (err: '%s')\n", LogText(strerror(errno)));
+            event->property = XCB_ATOM_NONE;
+            Finish(false);
+            return;
+        }
+        first->resize(bytes);
+
+        job.SetContent(event->target, *first, first);
+        job.incr   = bytes == INCR_CHUNK_SIZE;
+        job.stream = job.incr;
+        if (!job.incr) {
+            Finish(true);
+        }
+    }
+
+    // fills 'buf' unless the stream ends first; a pipe returns whatever is available per read()
+    static ssize_t ReadStream(int fd, void *buf, size_t len)
+    {
+        size_t total = 0;
+        while (total < len) {
+            auto bytes = read(fd, static_cast<uint8_t *>(buf) + total, len - total);
+            if (bytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            if (!bytes) {
+                break;
+            }
+            total += bytes;
+        }
+        return total;
+    }
+
+    static bool WriteAll(int fd, const void *data, size_t len)
+    {
+        for (size_t total = 0; total < len;) {
+            auto bytes = write(fd, static_cast<const uint8_t *>(data) + total, len - total);
+            if (bytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOG_ERROR("write() failed (err: '%s')\n", LogText(strerror(errno)));
+                return false;
             }
+            total += bytes;
+        }
+        return true;
+    }
+
+    // ends the event loop once every queued response is out
+    void Finish(bool rc)
+    {
+        finished = true;
+        finished_rc = finished_rc && rc;
+    }
+
+    void DispatchSelectionRequest(request_job_t &job)
+    {
+        // INCR keeps per-transfer state on the event thread, so it is started here
+        if (job.incr) {
+            StartIncr(job);
+            CompleteSelectionRequest(job.event.requestor);
+            return;
+        }
+
+        auto requestor = job.event.requestor;
+        auto ptr = &job;
+        workers.Post([this, ptr, requestor] {
+            Log::SetThreadContext(log_context);
+            ExecuteSelectionRequest(*ptr);
+            tasks.Post([this, requestor] { CompleteSelectionRequest(requestor); });
+        });
+    }
+
+    // the event thread sends every SelectionNotify, in request order for each requestor
+    void CompleteSelectionRequest(xcb_window_t requestor)
+    {
+        auto iter = requestor_jobs.find(requestor);
+        if (iter == requestor_jobs.end()) {
+            return;
+        }
+
+        auto &queue = iter->second;
+        SendSelectionResponse(&queue.front().event);
+        queue.pop_front();
+        if (queue.empty()) {
+            requestor_jobs.erase(iter);
+            return;
         }
-        return SendSelectionResponse(event);
+        DispatchSelectionRequest(queue.front());
     }
 
     bool ProcSelectionNotify(xcb_selection_notify_event_t *event)
     {
-        printf("   - XCB_SELECTION_NOTIFY           : seq: %4u, time: %10u, requestor: 0x%08X, selection: '%s', target: '%s', property: '%s'\n",
-            event->sequence, event->time, event->requestor, GetAtomName(event->selection), GetAtomName(event->target), event->property ? GetAtomName(event->property) : "(null)");
+        LOG_INFO("   - XCB_SELECTION_NOTIFY           : seq: %4u, time: %10u, requestor: 0x%08X, selection: '%s', target: '%s', property: '%s'\n",
+            event->sequence, event->time, event->requestor, LogAtom(event->selection), LogAtom(event->target), LogAtom(event->property));
 
         if (event->requestor != window) {
             return true;
@@ -487,11 +1596,17 @@ public:
             pending_target = XCB_ATOM_NONE;
         }
 
+        if (paste_fd != INVALID_FD && event->target == stream_target && !event->property) {
+            LOG_ERROR("CLIPBOARD cannot be converted to '%s'\n", LogAtom(event->target));
+            Finish(false);
+            return true;
+        }
+
         if (event->property) {
             auto cookie = xcb_get_property(connection, 1, event->requestor, event->property, XCB_GET_PROPERTY_TYPE_ANY, 0, INT32_MAX / 4);
-            auto reply = xcb_get_property_reply(connection, cookie, nullptr);
+            auto reply = WaitReply(xcb_get_property_reply, cookie);
             if (!reply) {
-                fprintf(stderr, "Failed to read property\n");
+                LOG_ERROR("Failed to read property\n");
                 return false;
             }
 
@@ -499,54 +1614,66 @@ public:
             auto value = xcb_get_property_value(reply);
             if (event->target == GetAtom("TARGETS")) {
                 // Case 2-2
+                store.Clear(event->selection);
                 auto atoms = reinterpret_cast<xcb_atom_t *>(value);
+                auto handoff_offered = false;
+                data.targets = {transfer_arena.Allocate<xcb_atom_t>(reply->length)};
                 for (uint32_t i = 0; i < reply->length; i++) {
                     auto atom = atoms[i];
-                    printf("       . target: '%s'\n", GetAtomName(atom));
-                    if (event->target != atom) {
-                        data.targets.push(atom);
+                    LOG_INFO("       . target: '%s'\n", LogAtom(atom));
+                    if (memfd && atom == GetAtom(MemfdHandoff::TARGET)) {
+                        handoff_offered = true;
+                    } else if (event->target != atom) {
+                        data.targets.Push(atom);
                     }
                 }
+                // the other targets are only fetched if the handoff fails
+                data.fallback = {};
+                if (handoff_offered) {
+                    data.fallback = data.targets;
+                    data.targets = {transfer_arena.Allocate<xcb_atom_t>(1)};
+                    data.targets.Push(GetAtom(MemfdHandoff::TARGET));
+                }
             } else {
                 // Case 2-4
                 auto len = xcb_get_property_value_length(reply);
-                printf("       . type  : '%s'\n", GetAtomName(reply->type));
-                printf("       . length: %d\n", len);
-
-                if (write_fd == INVALID_FD) {
-                    if (event->target == GetAtom("image/png")) {
-                        write_fd = open("test.png", O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-                    } else if (event->target == GetAtom("image/bmp")) {
-                        write_fd = open("test.bmp", O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-                    } else if (event->target == GetAtom("image/jpeg")) {
-                        write_fd = open("test.jpg", O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-                    }
-                }
+                LOG_INFO("       . type  : '%s'\n", LogAtom(reply->type));
+                LOG_INFO("       . length: %d\n", len);
+                metrics.bytes_received += len;
 
-                if (reply->type == GetAtom("INCR")) {
+                if (memfd && event->target == GetAtom(MemfdHandoff::TARGET)) {
+                    if (!ReceiveMemfd(event->selection, value, len)) {
+                        data.targets = data.fallback;
+                    }
+                    data.fallback = {};
+                } else if (reply->type == GetAtom("INCR")) {
                     if (len == 4) {
                         auto bytes = *reinterpret_cast<uint32_t *>(value);
-                        printf("       . 'INCR': %u\n", bytes);
-                        incr_property = event->property;
+                        LOG_INFO("       . 'INCR': %u\n", bytes);
+                        receive_property = event->property;
+                        receive_selection = event->selection;
+                        receive_target = event->target;
+                        receive_writer = {};
+                        if (paste_fd == INVALID_FD) {
+                            receive_writer.Reserve(bytes);
+                        }
                     }
+                } else if (paste_fd != INVALID_FD) {
+                    Finish(WriteAll(paste_fd, value, len));
                 } else {
                     if (reply->type == XCB_ATOM_INTEGER) {
                         uint32_t num = *reinterpret_cast<uint32_t *>(value);
-                        printf("       . number: %u\n", num);
+                        LOG_INFO("       . number: %u\n", num);
                     } else if (reply->type == XCB_ATOM_STRING ||
                                reply->type == GetAtom("TEXT") ||
                                reply->type == GetAtom("UTF8_STRING") ||
                                reply->type == GetAtom("text/plain") ||
                                reply->type == GetAtom("text/html")) {
-                        std::string str = "";
-                        str.assign(reinterpret_cast<char *>(value), std::min(len, 1024));
-                        printf("       . string: '%s'\n", str.c_str());
-                    }
-                    if (write_fd != INVALID_FD) {
-                        write(write_fd, value, len);
-                        close(write_fd);
-                        write_fd = INVALID_FD;
+                        LOG_INFO("       . string: '%s'\n", LogText(reinterpret_cast<char *>(value), len));
                     }
+                    auto result = store.Put(event->selection, event->target, reply->type, value, len);
+                    LogStored(result);
+                    Remember(event->selection, event->target, result.hash);
                 }
             }
             free(reply);
@@ -556,160 +1683,680 @@ public:
         return true;
     }
 
-    bool CreateWindow(void)
+    void LogStored(const ClipboardStore::result_t &result)
     {
-        uint32_t mask = XCB_CW_BACK_PIXMAP | XCB_CW_EVENT_MASK;
-        std::vector<uint32_t> values = { screen->black_pixel, XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_BUTTON_PRESS};
+        auto stats = store.Stats();
+        LOG_INFO("       . stored: %016lx, %lu bytes%s (store: %lu blobs, %lu bytes, %lu keys)\n",
+            result.hash, result.size, result.deduplicated ? ", deduplicated" : "", stats.blobs, stats.bytes, stats.keys);
+    }
 
-        xcb_window_t window = xcb_generate_id(connection);
-        auto cookie = xcb_create_window_checked(connection, screen->root_depth, window, screen->root,
-            0, 0, 400, 200, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, mask, values.data());
+    // CLIPBOARD content just stored from its owner; the paste goes to the history when it ends
+    void Remember(xcb_atom_t selection, xcb_atom_t target, uint64_t hash)
+    {
+        if (history.Opened() && selection == GetAtom("CLIPBOARD")) {
+            paste_history.push_back({hash, target});
+        }
+    }
+
+    // one clip per paste, one entry per distinct payload with every target it came as
+    void AppendPaste(void)
+    {
+        for (size_t i = 0; i < paste_history.size(); i++) {
+            auto hash = paste_history[i].first;
+            auto seen = std::find_if(paste_history.begin(), paste_history.begin() + i,
+                [hash](auto &payload) { return payload.first == hash; });
+            if (seen != paste_history.begin() + i) {
+                continue;
+            }
+            std::string_view data = {};
+            std::vector<ClipboardHistory::target_t> targets = {};
+            for (size_t j = i; j < paste_history.size(); j++) {
+                std::string_view found = {};
+                uint32_t type = XCB_ATOM_NONE;
+                // a target evicted meanwhile, by a store limit smaller than the paste, is left out
+                if (paste_history[j].first == hash && store.Find(GetAtom("CLIPBOARD"), paste_history[j].second, found, &type)) {
+                    data = found;
+                    targets.push_back({GetAtomName(paste_history[j].second), GetAtomName(type)});
+                }
+            }
+            if (!targets.empty()) {
+                AppendHistory(paste_clip, targets, data);
+            }
+        }
+        paste_history.clear();
+    }
+
+    void AppendHistory(uint64_t clip, const std::vector<ClipboardHistory::target_t> &targets, std::string_view data)
+    {
+        if (!history.Append(clip, "CLIPBOARD", targets, data)) {
+            LOG_ERROR("failed to append to the clipboard history (err: '%s')\n", LogText(strerror(errno)));
+            return;
+        }
+        LOG_INFO("       . history: clip %lu, %zu targets, %zu bytes\n", clip, targets.size(), data.size());
+    }
+
+    bool CreateWindow(void)
+    {
+        auto cookie = RequestWindow();
         auto error = xcb_request_check(connection, cookie);
         if (error) {
-            fprintf(stderr, "xcb_create_window_checked() failed (err: %d)\n", error->error_code);
+            LOG_ERROR("xcb_create_window_checked() failed (err: %d)\n", error->error_code);
             free(error);
+            window = XCB_WINDOW_NONE;
             return false;
         }
-        this->window = window;
         return true;
     }
 
+    // windowed: 400x200, a button press in it takes CLIPBOARD; headless: 1x1 InputOnly, never mapped
+    xcb_void_cookie_t RequestWindow(void)
+    {
+        window = xcb_generate_id(connection);
+        if (headless) {
+            uint32_t values[] = {XCB_EVENT_MASK_PROPERTY_CHANGE};
+            return xcb_create_window_checked(connection, XCB_COPY_FROM_PARENT, window, screen->root,
+                0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, XCB_CW_EVENT_MASK, values);
+        }
+
+        uint32_t mask = XCB_CW_BACK_PIXMAP | XCB_CW_EVENT_MASK;
+        std::vector<uint32_t> values = { screen->black_pixel, XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_BUTTON_PRESS};
+        return xcb_create_window_checked(connection, screen->root_depth, window, screen->root,
+            0, 0, 400, 200, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, mask, values.data());
+    }
+
     bool MapWindow(void)
     {
         auto cookie = xcb_map_window_checked(connection, window);
         auto error = xcb_request_check(connection, cookie);
         if (error) {
-            fprintf(stderr, "xcb_map_window_checked() failed (err: %d)\n", error->error_code);
+            LOG_ERROR("xcb_map_window_checked() failed (err: %d)\n", error->error_code);
             free(error);
             return false;
         }
         return true;
     }
 
+    // whether a handler acts on 'event'; property changes only matter for the running INCR transfer
+    bool Relevant(const xcb_generic_event_t *event) const
+    {
+        auto code = event->response_type & 0x7F;
+        if (code == XCB_PROPERTY_NOTIFY) {
+            auto notify = reinterpret_cast<const xcb_property_notify_event_t *>(event);
+            return notify->window == window ? notify->atom == receive_property : incr_sends.count({notify->window, notify->atom}) > 0;
+        }
+        return dispatcher.Handles(code);
+    }
+
     bool ProcEvent(xcb_generic_event_t *event)
     {
+        return dispatcher.Dispatch(*this, event);
+    }
+
+    bool ProcError(xcb_generic_error_t *error)
+    {
+        LOG_ERROR("   - X error                        : seq: %4u, code: %u, major: %u, minor: %u, resource: 0x%08X\n",
+            error->sequence, error->error_code, error->major_code, error->minor_code, error->resource_id);
+        return true;
+    }
+
+    // safe from any thread; a name is interned once however many threads miss on it together
+    xcb_atom_t GetAtom(const char *name)
+    {
+        bool miss = false;
+        auto atom = atom_cache.Get(name, &miss);
+        ProfileAtom(name, miss);
+        if (!atom) {
+            LOG_ERROR("xcb_intern_atom_reply() failed '%s'\n", LogText(name));
+            return XCB_NONE;
+        }
+        if (miss) {
+            trace_writer.Atom(atom, name, strlen(name));
+        }
+        return atom;
+    }
+
+    // the returned name is owned by the cache and never moves
+    const char *GetAtomName(xcb_atom_t atom)
+    {
+        bool miss = false;
+        auto name = atom_cache.GetName(atom, &miss);
+        if (!name) {
+            return "Unknown";
+        }
+        if (miss) {
+            trace_writer.Atom(atom, name, strlen(name));
+        }
+        ProfileAtom(name, miss);
+        return name;
+    }
+
+    // uses are counted by the cache; only a miss, a round trip anyway, gets here
+    void ProfileAtom(std::string_view name, bool miss)
+    {
+        if (miss && !atom_profile_path.empty() && atom_profile.Miss(name)) {
+            LOG_INFO("   - atom miss after startup    : '%s'\n", LogText(name.data(), name.size()));
+        }
+    }
+
+    // every reply the handlers wait for goes through here so it can be recorded or replayed
+    template <typename Reply, typename Cookie>
+    Reply *WaitReply(Reply *(*reply_fn)(xcb_connection_t *, Cookie, xcb_generic_error_t **), Cookie cookie)
+    {
+        if (trace_reader && replay_stub) {
+            return static_cast<Reply *>(trace_reader->NextReply());
+        }
+        auto reply = reply_fn(connection, cookie, nullptr);
+        trace_writer.Reply(reply);
+        return reply;
+    }
+
+    bool Record(const char *path)
+    {
+        if (!trace_writer.Open(path, screen->root, window)) {
+            LOG_ERROR("failed to open trace '%s'\n", LogText(path));
+            return false;
+        }
+        // interned before the trace was open, by the startup batch or the profile; later lookups
+        // only trace a miss, so a replay would never learn these names otherwise
+        atom_cache.ForEach([this](std::string_view name, xcb_atom_t atom) {
+            trace_writer.Atom(atom, name.data(), name.size());
+        });
+        LOG_INFO(" * recording trace                  : '%s'\n", LogText(path));
+        return true;
+    }
+
+    /**
+     * Feeds a recorded trace through ProcEvent() as fast as possible
+     *
+     *   - stub : no X server; replies come from the trace and requests go to an error connection
+     *   - live : requests and replies go to $DISPLAY (e.g. Xvfb); recorded window and atom ids
+     *            are translated to the ones of this connection before each event is handled, other
+     *            clients' windows (requestors) to 1x1 InputOnly stand-ins created on first sight
+     */
+    bool Replay(const char *path, bool stub)
+    {
+        if (!CheckTasks()) {
+            return false;
+        }
+
+        TraceReader reader = {};
+        if (!reader.Open(path)) {
+            LOG_ERROR("failed to read trace '%s'\n", LogText(path));
+            return false;
+        }
+
+        auto &header = reader.Header();
+        std::map<xcb_atom_t, std::string> recorded_atoms = {};
+        for (auto &entry : reader.Entries()) {
+            if (entry.kind == Trace::ATOM && entry.payload.size() >= 4) {
+                xcb_atom_t atom = XCB_ATOM_NONE;
+                memcpy(&atom, entry.payload.data(), 4);
+                recorded_atoms[atom].assign(reinterpret_cast<const char *>(entry.payload.data()) + 4, entry.payload.size() - 4);
+            }
+        }
+
+        if (stub) {
+            // xcb_connect_to_fd(-1) yields libxcb's static error connection, on which every request is a no-op
+            connection = xcb_connect_to_fd(-1, nullptr);
+            window = header.window;
+            for (auto &iter : recorded_atoms) {
+                atom_cache.Insert(iter.second, iter.first);
+            }
+            Log::Get().SetAtomResolver([recorded_atoms](uint32_t atom) -> std::string {
+                auto iter = recorded_atoms.find(atom);
+                return iter != recorded_atoms.end() ? iter->second : std::to_string(atom);
+            });
+        } else if (!Init()) {
+            return false;
+        }
+
+        struct stat_t {
+            uint64_t    count   = 0;
+            int64_t     ns      = 0;
+        } stats[128] = {};
+
+        trace_reader = &reader;
+        replay_stub = stub;
+
+        auto &entries = reader.Entries();
+        std::vector<uint32_t> buf = {};
+        int64_t total_ns = 0;
+        uint64_t total_events = 0;
+        bool rc = true;
+
+        for (size_t i = 0; rc && i < entries.size(); i++) {
+            auto &entry = entries[i];
+            if (entry.kind != Trace::EVENT || entry.payload.size() < sizeof(xcb_generic_event_t)) {
+                continue;
+            }
+
+            buf.assign((entry.payload.size() + 3) / 4, 0);
+            memcpy(buf.data(), entry.payload.data(), entry.payload.size());
+            auto event = reinterpret_cast<xcb_generic_event_t *>(buf.data());
+            if (!stub) {
+                RemapEvent(event, header, recorded_atoms);
+            }
+            reader.BeginEvent(i);
+
+            auto begin = std::chrono::steady_clock::now();
+            rc = ProcEvent(event);
+            tasks.Drain();
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+
+            auto &stat = stats[event->response_type & 0x7f];
+            stat.count++;
+            stat.ns += ns;
+            total_events++;
+            total_ns += ns;
+        }
+
+        while (!requestor_jobs.empty()) {
+            struct pollfd fd = {tasks.Fd(), POLLIN, 0};
+            poll(&fd, 1, -1);
+            tasks.Wakeup();
+        }
+        if (!stub) {
+            // make the server catch up so the run includes the work it was asked to do
+            free(xcb_get_input_focus_reply(connection, xcb_get_input_focus(connection), nullptr));
+            for (auto &iter : replay_windows) {
+                xcb_destroy_window(connection, iter.second);
+            }
+            replay_windows.clear();
+        }
+        trace_reader = nullptr;
+
+        // the summary is the point of a replay, so it is printed regardless of the log level
+        Log::Get().Flush();
+        printf("\n * Replay '%s' (%s)\n", path, stub ? "stub" : "live");
+        for (size_t type = 0; type < 128; type++) {
+            auto &stat = stats[type];
+            if (stat.count) {
+                printf("   - %-30s : %8lu events, %10.1f ns/event\n", EventName(type), stat.count, static_cast<double>(stat.ns) / stat.count);
+            }
+        }
+        printf("   - total                          : %8lu events, %10.3f ms, %.0f events/s\n",
+            total_events, total_ns / 1e6, total_ns ? total_events * 1e9 / total_ns : 0.0);
+        printf("   - replies missing from the trace : %lu\n", reader.MissingReplies());
+        if (!rc) {
+            LOG_ERROR("replay stopped: a handler failed\n");
+        }
+        return rc;
+    }
+
+    void RemapEvent(xcb_generic_event_t *event, const Trace::header_t &header, const std::map<xcb_atom_t, std::string> &recorded_atoms)
+    {
+        auto remap_window = [&](xcb_window_t &value) {
+            if (value == header.window) {
+                value = window;
+            } else if (value == header.root) {
+                value = screen->root;
+            } else if (value != XCB_WINDOW_NONE) {
+                value = StandInWindow(value);
+            }
+        };
+        auto remap_atom = [&](xcb_atom_t &value) {
+            if (value > XCB_ATOM_WM_TRANSIENT_FOR) {
+                auto iter = recorded_atoms.find(value);
+                value = iter != recorded_atoms.end() ? GetAtom(iter->second.c_str()) : static_cast<xcb_atom_t>(XCB_ATOM_NONE);
+            }
+        };
+
         switch (event->response_type & ~0x80)
         {
-            case XCB_BUTTON_PRESS:
-                if (!ProcButtonPress(reinterpret_cast<xcb_button_press_event_t *>(event))) {
-                    return false;
-                }
+            case XCB_BUTTON_PRESS: {
+                auto e = reinterpret_cast<xcb_button_press_event_t *>(event);
+                remap_window(e->event);
                 break;
-            case XCB_PROPERTY_NOTIFY:
-                if (!ProcPropertyNotify(reinterpret_cast<xcb_property_notify_event_t *>(event))) {
-                    return false;
-                }
+            }
+            case XCB_PROPERTY_NOTIFY: {
+                auto e = reinterpret_cast<xcb_property_notify_event_t *>(event);
+                remap_window(e->window);
+                remap_atom(e->atom);
                 break;
-            case XCB_SELECTION_CLEAR:
-                if (!ProcSelectionClear(reinterpret_cast<xcb_selection_clear_event_t *>(event))) {
-                    return false;
-                }
+            }
+            case XCB_SELECTION_CLEAR: {
+                auto e = reinterpret_cast<xcb_selection_clear_event_t *>(event);
+                remap_window(e->owner);
+                remap_atom(e->selection);
                 break;
-            case XCB_SELECTION_REQUEST:
-                if (!ProcSelectionRequest(reinterpret_cast<xcb_selection_request_event_t *>(event))) {
-                    return false;
-                }
+            }
+            case XCB_SELECTION_REQUEST: {
+                auto e = reinterpret_cast<xcb_selection_request_event_t *>(event);
+                remap_window(e->owner);
+                remap_window(e->requestor);
+                remap_atom(e->selection);
+                remap_atom(e->target);
+                remap_atom(e->property);
                 break;
-            case XCB_SELECTION_NOTIFY:
-                if (!ProcSelectionNotify(reinterpret_cast<xcb_selection_notify_event_t *>(event))) {
-                    return false;
-                }
+            }
+            case XCB_SELECTION_NOTIFY: {
+                auto e = reinterpret_cast<xcb_selection_notify_event_t *>(event);
+                remap_window(e->requestor);
+                remap_atom(e->selection);
+                remap_atom(e->target);
+                remap_atom(e->property);
+                break;
+            }
+            case XCB_DESTROY_NOTIFY: {
+                auto e = reinterpret_cast<xcb_destroy_notify_event_t *>(event);
+                remap_window(e->event);
+                remap_window(e->window);
                 break;
+            }
         }
-        return true;
     }
 
-    xcb_atom_t GetAtom(const char *name)
+    // a window of this connection standing in for another client's recorded one, so replies reach a window that exists
+    xcb_window_t StandInWindow(xcb_window_t recorded)
     {
-        auto iter = atoms.find(name);
-        if (iter != atoms.end()) {
-            return iter->second;
+        auto &stand_in = replay_windows[recorded];
+        if (!stand_in) {
+            stand_in = xcb_generate_id(connection);
+            xcb_create_window(connection, XCB_COPY_FROM_PARENT, stand_in, screen->root,
+                0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0, nullptr);
         }
+        return stand_in;
+    }
 
-        auto cookie = xcb_intern_atom(connection, 0, strlen(name), name);
-        auto reply = xcb_intern_atom_reply(connection, cookie, nullptr);
-        if (!reply) {
-            fprintf(stderr, "xcb_intern_atom_reply() failed '%s'\n", name);
-            return XCB_NONE;
+    static const char *EventName(size_t type)
+    {
+        switch (type)
+        {
+            case XCB_BUTTON_PRESS:      return "XCB_BUTTON_PRESS";
+            case XCB_PROPERTY_NOTIFY:   return "XCB_PROPERTY_NOTIFY";
+            case XCB_SELECTION_CLEAR:   return "XCB_SELECTION_CLEAR";
+            case XCB_SELECTION_REQUEST: return "XCB_SELECTION_REQUEST";
+            case XCB_SELECTION_NOTIFY:  return "XCB_SELECTION_NOTIFY";
         }
+        return "other";
+    }
 
-        auto atom = reply->atom;
-        atoms[name] = atom;
-        atom_names[atom] = name;
-        free(reply);
-        return atom;
+    bool RunEventLoop(void)
+    {
+        return RunDisplays({this});
     }
 
-    const char *GetAtomName(xcb_atom_t atom)
+    /**
+     * One reactor thread for any number of displays
+     *
+     *   Every display is stepped until nothing is ready, then the thread sleeps in poll() on all
+     *   connections and the signal pipe. While worker jobs or coroutine replies are outstanding it
+     *   wakes every millisecond to collect them. A display whose connection fails or whose pipe
+     *   transfer ends is dropped and the others keep running; the result is false if any failed.
+     */
+    static bool RunDisplays(const std::vector<Selection *> &displays)
     {
-        auto iter = atom_names.find(atom);
-        if (iter != atom_names.end()) {
-            return iter->second.c_str();
+        auto active = displays;
+        for (auto display : active) {
+            Log::SetThreadContext(display->log_context);
+            LOG_INFO("\n * Run event loop\n");
+            xcb_flush(display->connection);
+            display->run_begin = std::chrono::steady_clock::now();
         }
 
-        auto cookie = xcb_get_atom_name(connection, atom);
-        auto reply = xcb_get_atom_name_reply(connection, cookie, nullptr);
-        if (!reply) {
-            return "Unknown";
+        auto rc = true;
+        std::vector<struct pollfd> fds = {};
+        while (!active.empty()) {
+            auto signum = 0;
+            if (read(signal_pipe[0], &signum, sizeof(int)) == sizeof(int)) {
+                LOG_INFO(" - Unix signal (%d) received\n", signum);
+                break;
+            }
+
+            auto busy = false;
+            for (size_t i = 0; i < active.size();) {
+                auto display = active[i];
+                Log::SetThreadContext(display->log_context);
+                auto more = false;
+                auto state = display->Step(more);
+                if (state != step_t::RUNNING) {
+                    rc = rc && state == step_t::DONE;
+                    active.erase(active.begin() + i);
+                    continue;
+                }
+                // worker completions wake the loop through the task queue; replies libxcb has
+                // already read off the socket would not, so awaited ones keep it polling
+                busy = busy || more || display->replies.Pending();
+                i++;
+            }
+
+            fds.clear();
+            fds.push_back({signal_pipe[0], POLLIN, 0});
+            for (auto display : active) {
+                fds.push_back({xcb_get_file_descriptor(display->connection), POLLIN, 0});
+            }
+            for (auto display : active) {
+                fds.push_back({display->tasks.Fd(), POLLIN, 0});
+            }
+            if (!busy && !idle_rss_kib) {
+                idle_rss_kib = ResidentKiB();
+            }
+            // idle with buffers cached: wake up once more to free them
+            auto timeout = busy ? 1 : BufferPool::Get().Stats().cached ? IDLE_TRIM_MS : -1;
+            auto ready = poll(fds.data(), fds.size(), timeout);
+            if (ready > 0) {
+                for (size_t i = 1; i < fds.size(); i++) {
+                    if (fds[i].revents) {
+                        auto display = active[(i - 1) % active.size()];
+                        display->metrics.wakeups++;
+                        display->woken = true;
+                    }
+                }
+                for (size_t i = 0; i < active.size(); i++) {
+                    if (fds[1 + active.size() + i].revents) {
+                        Log::SetThreadContext(active[i]->log_context);
+                        // the tasks run here rather than in the next Step(), so the wakeup was not idle
+                        if (active[i]->tasks.Wakeup()) {
+                            active[i]->woken = false;
+                        }
+                    }
+                }
+            } else if (!ready && !busy) {
+                TrimIdle();
+            }
         }
 
-        atom_names[atom].assign(xcb_get_atom_name_name(reply), xcb_get_atom_name_name_length(reply));
-        atoms[atom_names[atom]] = atom;
-        free(reply);
-        return atom_names[atom].c_str();
+        auto now = std::chrono::steady_clock::now();
+        for (auto display : displays) {
+            display->run_end = now;
+        }
+        return rc;
     }
 
-    bool RunEventLoop(void)
+    enum class step_t
     {
-        printf("\n * Run event loop\n");
-        xcb_flush(connection);
+        RUNNING,
+        DONE,
+        FAILED,
+    };
 
-        while (true) {
-            auto signum = 0;
-            auto bytes = read(signal_pipe[0], &signum, sizeof(int));
-            if (bytes == -1) {
-                if (errno == EINTR) {
-                    continue;
-                }
-            } else if (bytes == sizeof(int)) {
-                printf(" - Unix signal (%d) received\n", signum);
-                return true;
-            }
+    /**
+     * Handles whatever is ready on this display without blocking
+     *
+     *   At most STEP_EVENTS events are taken per call so one busy display cannot starve the rest;
+     *   'more' tells the reactor not to sleep.
+     */
+    step_t Step(bool &more)
+    {
+        size_t acted = 0;
+        // displays share the reactor thread and its counters: only what runs in here is ours
+        step_begin = ThreadAllocations();
+        auto state = StepEvents(more, acted);
+        step_allocations += ThreadAllocations() - step_begin;
+        step_begin = ThreadAllocations();
+        // woken for nothing: only events no handler acts on
+        if (woken) {
+            woken = false;
+            metrics.idle_wakeups += !acted;
+        }
+        return state;
+    }
 
-            auto rc = xcb_connection_has_error(connection);
-            if (rc) {
-                fprintf(stderr, "xcb_connection_has_error() - %d\n", rc);
-                return false;
+    // 'acted' counts the tasks, resumed coroutines and relevant events handled
+    step_t StepEvents(bool &more, size_t &acted)
+    {
+        static constexpr size_t STEP_EVENTS = 64;
+
+        auto rc = xcb_connection_has_error(connection);
+        if (rc) {
+            LOG_ERROR("xcb_connection_has_error() - %d\n", rc);
+            return step_t::FAILED;
+        }
+
+        for (size_t n = 0; n < STEP_EVENTS; n++) {
+            acted += tasks.Drain();
+            auto resumed = replies.Poll();
+            acted += resumed;
+            if (startup.Done()) {
+                auto rc = startup.Result();
+                startup.Reset();
+                if (!rc) {
+                    return step_t::FAILED;
+                }
+                if (own && !SetSelectionOwner(GetAtom("CLIPBOARD"))) {
+                    return step_t::FAILED;
+                }
+                xcb_flush(connection);
+                LOG_INFO(" * connect-to-ready                 : %.3f ms (%s)\n", ElapsedMs(connect_begin), pipelined ? "pipelined" : "serial");
             }
 
             auto event = xcb_poll_for_event(connection);
             if (event) {
-                auto rc = ProcEvent(event);
+                metrics.events++;
+                auto relevant = Relevant(event);
+                acted += relevant;
+                auto rc = true;
+                if (relevant || !headless) {
+                    trace_writer.Event(event);
+                    rc = ProcEvent(event);
+                } else {
+                    metrics.filtered++;
+                }
                 free(event);
                 if (!rc) {
-                    return false;
+                    return step_t::FAILED;
                 }
             }
+
+            if (finished && requestor_jobs.empty() && !receive_property && incr_sends.empty()) {
+                xcb_flush(connection);
+                return finished_rc ? step_t::DONE : step_t::FAILED;
+            }
+            if (!event && !resumed) {
+                xcb_flush(connection);
+                return step_t::RUNNING;
+            }
+        }
+        xcb_flush(connection);
+        more = true;
+        return step_t::RUNNING;
+    }
+
+    // kB the process grew by while this display was set up, as measured by the caller
+    void SetMemoryCost(long kib)
+    {
+        memory_kib = kib;
+    }
+
+    long MemoryCost(void) const
+    {
+        return memory_kib;
+    }
+
+    static long ResidentKiB(void)
+    {
+        long pages = 0;
+        long resident = 0;
+        auto file = fopen("/proc/self/statm", "r");
+        if (!file) {
+            return 0;
+        }
+        if (fscanf(file, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(file);
+        return resident * (sysconf(_SC_PAGESIZE) / 1024);
+    }
+
+    void PrintMetrics(FILE *out)
+    {
+        auto stats = store.Stats();
+        fprintf(out, " - %-30s : %8lu events, %6lu wakeups, %6lu requests, %10lu bytes sent, %10lu bytes received, store %lu bytes, setup +%ld KiB, %lu pastes (%.1f allocations each)\n",
+            display_name.empty() ? "$DISPLAY" : display_name.c_str(), metrics.events.load(), metrics.wakeups.load(), metrics.requests.load(),
+            metrics.bytes_sent.load(), metrics.bytes_received.load(), stats.bytes, memory_kib,
+            metrics.pastes, metrics.pastes ? static_cast<double>(metrics.paste_allocations) / metrics.pastes : 0.0);
+        auto minutes = std::chrono::duration<double, std::ratio<60>>(run_end - run_begin).count();
+        auto per_minute = [minutes](uint64_t count) {
+            return minutes > 0 ? count / minutes : 0.0;
+        };
+        fprintf(out, "   . %-28s : %s, %.2f min, %.1f events/min (%lu filtered), %.1f wakeups/min, %.1f idle wakeups/min (%lu)\n",
+            "event loop", headless ? "headless" : "windowed", minutes, per_minute(metrics.events), metrics.filtered,
+            per_minute(metrics.wakeups), per_minute(metrics.idle_wakeups), metrics.idle_wakeups);
+        if (control.Listening()) {
+            auto control_stats = control.Stats();
+            fprintf(out, " - control socket                 : %lu clients, %lu requests, %lu fds received, %lu fds sent\n",
+                control_stats.clients, control_stats.requests, control_stats.fds_received, control_stats.fds_sent);
+        }
+        if (history.Opened()) {
+            auto history_stats = history.Stats();
+            fprintf(out, " - clipboard history              : %lu entries, %lu bytes, %lu appended, %lu compactions\n",
+                history_stats.entries, history_stats.bytes, history_stats.appended, history_stats.compactions);
+        }
+    }
+
+    // process-wide: shared by every display
+    static void PrintMemory(FILE *out)
+    {
+        auto stats = BufferPool::Get().Stats();
+        fprintf(out, " - memory                         : idle rss %ld KiB, pool %lu acquired, %lu allocated, %lu bytes in use, %lu bytes cached, %lu bytes trimmed\n",
+            idle_rss_kib, stats.acquired, stats.allocated, stats.in_use, stats.cached, stats.trimmed);
+    }
+
+    // returns pooled buffers, and the heap pages they leave free, to the system
+    static void TrimIdle(void)
+    {
+        if (BufferPool::Get().Trim()) {
+#ifdef __GLIBC__
+            malloc_trim(0);
+#endif
+        }
+        idle_rss_kib = ResidentKiB();
+    }
+
+    // workers, the control thread and the replay tail wake the loop through the task queue's eventfd
+    bool CheckTasks(void)
+    {
+        if (tasks.Fd() < 0) {
+            LOG_ERROR("eventfd() failed (err: '%s')\n", LogText(strerror(tasks.Error())));
+            return false;
         }
         return true;
     }
 
     bool ListenSignal(void)
     {
+        // shared by every display of the process
+        if (listening_signal) {
+            return true;
+        }
+        listening_signal = true;
+        if (signal_users++) {
+            return true;
+        }
         if (pipe(signal_pipe)) {
-            fprintf(stderr, "pipe() failed\n");
+            LOG_ERROR("pipe() failed\n");
             return false;
         }
 
         for (auto fd : signal_pipe) {
             auto fd_flags = fcntl(fd, F_GETFL);
             if (fd_flags == -1) {
-                fprintf(stderr, "fcntl(F_GETFL) failed\n");
+                LOG_ERROR("fcntl(F_GETFL) failed\n");
                 return false;
             }
 
             if (fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK) == -1) {
-                fprintf(stderr, "fcntl(F_SETFL - O_NONBLOCK) failed\n");
+                LOG_ERROR("fcntl(F_SETFL - O_NONBLOCK) failed\n");
                 return false;
             }
         }
@@ -734,42 +2381,450 @@ public:
     }
 
 private:
+    using dispatcher_t = EventDispatcher<Selection,
+        On<&Selection::ProcError>,
+        On<&Selection::ProcButtonPress, XCB_BUTTON_PRESS>,
+        On<&Selection::ProcPropertyNotify>,
+        On<&Selection::ProcDestroyNotify>,
+        On<&Selection::ProcSelectionClear>,
+        On<&Selection::ProcSelectionRequest>,
+        On<&Selection::ProcSelectionNotify>>;
+
+    using job_queue_t = std::deque<request_job_t>;
+
+    // updated on the event thread and by workers, read at exit
+    struct metrics_t
+    {
+        std::atomic<uint64_t>                   events                      = 0;
+        std::atomic<uint64_t>                   wakeups                     = 0;
+        std::atomic<uint64_t>                   requests                    = 0;
+        std::atomic<uint64_t>                   bytes_sent                  = 0;
+        std::atomic<uint64_t>                   bytes_received              = 0;
+        uint64_t                                pastes                      = 0;
+        uint64_t                                paste_allocations           = 0;
+        uint64_t                                filtered                    = 0;    // dropped unread, headless only
+        uint64_t                                idle_wakeups                = 0;
+    };
+
+    // windowed: subscribed to on the root window and on INCR requestors; headless: on INCR requestors only
+    static constexpr uint32_t                   WATCH_EVENTS                = XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_PROPERTY_CHANGE;
+    static constexpr uint32_t                   INCR_EVENTS                 = XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_PROPERTY_CHANGE;
+
+    std::string                                 display_name                = {};
+    uint32_t                                    log_context                 = 0;
+    metrics_t                                   metrics                     = {};
+    long                                        memory_kib                  = 0;
+    bool                                        listening_signal            = false;
+    bool                                        woken                       = false;
+    std::chrono::steady_clock::time_point       run_begin                   = {};
+    std::chrono::steady_clock::time_point       run_end                     = {};
+
     int                                         screen_num                  = 0;
     xcb_connection_t                           *connection                  = nullptr;
     const xcb_setup_t                          *setup                       = nullptr;
     xcb_screen_t                               *screen                      = nullptr;
     xcb_window_t                                window                      = XCB_WINDOW_NONE;
     uint8_t                                     cut_buffer_idx              = 0;
+    bool                                        pipelined                   = false;
+    bool                                        own                         = false;
+    bool                                        headless                    = false;
+    std::chrono::steady_clock::time_point       connect_begin               = {};
+
+    // atoms in the transfer arena, taken front to back; nothing to free
+    struct atom_list_t
+    {
+        xcb_atom_t                             *atoms                       = nullptr;
+        uint32_t                                count                       = 0;
+        uint32_t                                next                        = 0;
+
+        bool Empty(void) const
+        {
+            return next == count;
+        }
+
+        void Push(xcb_atom_t atom)
+        {
+            atoms[count++] = atom;
+        }
+
+        xcb_atom_t Pop(void)
+        {
+            return atoms[next++];
+        }
+    };
 
     struct selection_t
     {
         xcb_atom_t                              atom                        = XCB_ATOM_NONE;
         xcb_window_t                            owner                       = XCB_WINDOW_NONE;
-        std::queue<xcb_atom_t>                  targets                     = {};
+        atom_list_t                             targets                     = {};
+        atom_list_t                             fallback                    = {};
     };
     std::map<xcb_atom_t, selection_t>           selections                  = {};
     xcb_atom_t                                  pending_target              = XCB_ATOM_NONE;
-    xcb_atom_t                                  incr_property               = XCB_ATOM_NONE;
-    xcb_atom_t                                  incr_target                 = XCB_ATOM_NONE;
-    uint32_t                                    incr_bytes                  = 0;
-    int32_t                                     write_fd                    = INVALID_FD;
-    int32_t                                     read_fd                     = INVALID_FD;
-    uint32_t                                    read_fd_len                 = 0;
-    uint8_t                                     read_buf[INCR_CHUNK_SIZE]   = {};
-
-    std::map<std::string, xcb_atom_t>           atoms                       = {};
-    std::map<xcb_atom_t, std::string>           atom_names                  = {};
+    TransferArena                               transfer_arena              = {};
+    bool                                        paste_active                = false;
+    uint64_t                                    paste_allocations           = 0;
+    uint64_t                                    step_allocations            = 0;    // see Allocations()
+    uint64_t                                    step_begin                  = 0;
+    xcb_atom_t                                  receive_property            = XCB_ATOM_NONE;   // of the INCR transfer we receive
+
+    // one INCR transfer we send; each requestor and property has its own
+    struct incr_t
+    {
+        xcb_atom_t                              target                      = XCB_ATOM_NONE;
+        std::string_view                        content                     = {};
+        blob_t                                  blob                        = {};   // owns 'content', unless it is in the history mapping
+        uint64_t                                bytes                       = 0;
+        bool                                    stream                      = false;
+    };
+    using incr_key_t = std::pair<xcb_window_t, xcb_atom_t>;
+    using incr_map_t = std::map<incr_key_t, incr_t>;
+    incr_map_t                                  incr_sends                  = {};
+
+    int32_t                                     stream_fd                   = INVALID_FD;
+    int32_t                                     paste_fd                    = INVALID_FD;
+    std::string                                 stream_target_name          = {};
+    xcb_atom_t                                  stream_target               = XCB_ATOM_NONE;
+    BufferPool::Buffer                          stream_buf                  = {};
+    bool                                        stream_started              = false;
+    bool                                        finished                    = false;
+    bool                                        finished_rc                 = true;
+    xcb_atom_t                                  receive_selection           = XCB_ATOM_NONE;
+    xcb_atom_t                                  receive_target              = XCB_ATOM_NONE;
+    xcb_atom_t                                  receive_type                = XCB_ATOM_NONE;
+    ClipboardStore::Writer                      receive_writer              = {};
+    ClipboardStore                              store                       = {};
+
+    std::string                                 text                        = "Copy & Paste test";
+    bool                                        text_mode                   = false;
+    std::map<xcb_atom_t, int>                   text_targets                = {};
+    std::map<xcb_atom_t, blob_t>                text_cache                  = {};
+    ImageConverter                              images                      = {};
+    bool                                        memfd                       = false;
+    MemfdHandoff                                handoff                     = {};
+    ControlSocket                               control                     = {};
+
+    // what a control 'set' or the history restore serves, taking precedence over text and image
+    struct owned_t
+    {
+        xcb_atom_t                              type                        = XCB_ATOM_NONE;
+        std::string_view                        data                        = {};
+        blob_t                                  blob                        = {};   // owns 'data', unless it is in the history mapping
+    };
+    std::map<xcb_atom_t, owned_t>               owned_content               = {};
+    ClipboardHistory                            history                     = {};
+    uint64_t                                    paste_clip                  = 0;
+    using remembered_t = std::pair<uint64_t, xcb_atom_t>;                                   // (content hash, target)
+    std::vector<remembered_t>                   paste_history               = {};   // of the paste so far
+
+    std::string                                 atom_profile_path           = {};
+    std::vector<std::string>                    precache_names              = {};
+    AtomProfile                                 atom_profile                = {};
+    AtomCache                                   atom_cache                  = {};
+
+    WorkerPool                                  workers                     = {};
+    std::map<xcb_window_t, job_queue_t>         requestor_jobs              = {};
+    TaskQueue                                   tasks                       = {};
+
+    dispatcher_t                                dispatcher                  = {};
+    ReplyScheduler                              replies                     = {};
+    Task<bool>                                  startup                     = {};
+
+    TraceWriter                                 trace_writer                = {};
+    TraceReader                                *trace_reader                = nullptr;
+    bool                                        replay_stub                 = false;
+    std::map<xcb_window_t, xcb_window_t>        replay_windows              = {};   // recorded -> stand-in, live replay
 };
 
+static bool ParseLogLevel(const char *arg, LogLevel &level)
+{
+    static const struct {
+        const char     *name;
+        LogLevel        level;
+    } levels[] = {
+        { "debug",  LogLevel::DEBUG },
+        { "info",   LogLevel::INFO  },
+        { "warn",   LogLevel::WARN  },
+        { "error",  LogLevel::ERROR },
+        { "off",    LogLevel::OFF   },
+    };
+
+    for (auto &item : levels) {
+        if (!strcmp(arg, item.name)) {
+            level = item.level;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Every display on its own connection, window, atom cache, transfer state and store, all driven
+ * by one reactor thread. A display that fails to connect is reported and skipped.
+ */
+static bool RunMultiDisplay(const std::vector<const char *> &names, const std::function<bool(Selection &)> &configure, bool pipelined)
+{
+    std::vector<std::unique_ptr<Selection>> displays = {};
+    std::vector<Selection *> running = {};
+    auto rss = Selection::ResidentKiB();
+    for (size_t i = 0; i < names.size(); i++) {
+        auto display = std::make_unique<Selection>();
+        display->SetDisplay(names[i], i);
+        Log::Get().SetContextPrefix(i, std::string("[") + names[i] + "] ");
+        if (!configure(*display) || !display->Init(pipelined)) {
+            fprintf(stderr, "display '%s' skipped\n", names[i]);
+            continue;
+        }
+        auto now = Selection::ResidentKiB();
+        display->SetMemoryCost(now - rss);
+        rss = now;
+        display->Start();
+        running.push_back(display.get());
+        displays.push_back(std::move(display));
+    }
+    if (running.empty()) {
+        return false;
+    }
+
+    auto rc = Selection::RunDisplays(running);
+    Log::Get().Flush();
+
+    printf("\n * Displays\n");
+    long extra_kib = 0;
+    for (size_t i = 0; i < displays.size(); i++) {
+        displays[i]->PrintMetrics(stdout);
+        displays[i]->SaveAtomProfile(stdout);
+        if (i) {
+            extra_kib += displays[i]->MemoryCost();
+        }
+    }
+    if (displays.size() > 1) {
+        printf(" - memory per additional display : %ld KiB\n", extra_kib / static_cast<long>(displays.size() - 1));
+    }
+    Selection::PrintMemory(stdout);
+    return rc;
+}
+
+static void Usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("  -l, --log-level LEVEL     debug | info | warn | error | off (default: info)\n");
+    printf("  -T, --log-timestamps      prefix each log line with a monotonic timestamp\n");
+    printf("  -d, --display NAME        connect to NAME instead of $DISPLAY; repeat to serve several displays\n");
+    printf("  -p, --pipelined           issue every startup request at once and synchronize once\n");
+    printf("  -o, --own                 take CLIPBOARD ownership at startup\n");
+    printf("  -H, --headless            daemon mode: no mapped window, no root events, unused events dropped unread\n");
+    printf("  -t, --text FILE           serve FILE as the text content, in every supported charset\n");
+    printf("  -i, --image FILE          serve the PNG or JPEG image FILE, converted on request (default: test.png)\n");
+    printf("  -M, --memfd               offer and claim content through a sealed memfd on the same host\n");
+    printf("  -m, --store-limit MIB     keep up to MIB of received clipboard content (default: 64)\n");
+    printf("  -c, --copy FILE           take CLIPBOARD and serve FILE ('-' for stdin) once, streamed via INCR\n");
+    printf("  -P, --paste               write CLIPBOARD to stdout as it arrives\n");
+    printf("  -y, --type TARGET         target for --copy and --paste (default: UTF8_STRING)\n");
+    printf("  -w, --workers N           serve selection requests on N worker threads (default: inline)\n");
+    printf("  -C, --control PATH        serve set / get / status requests on the Unix socket PATH ('@NAME': abstract)\n");
+    printf("  -L, --history FILE        append CLIPBOARD content to FILE and take CLIPBOARD with its last clip at startup\n");
+    printf("  -K, --history-limit MIB   compact the history past MIB, keeping its newest clips (default: 64, 0: none)\n");
+    printf("  -A, --atom-profile FILE   precache the atoms FILE lists and merge this run's atom use into it\n");
+    printf("  -r, --record FILE         record every event and reply to a trace\n");
+    printf("  -R, --replay FILE         replay a trace through the handlers against $DISPLAY\n");
+    printf("  -S, --replay-stub FILE    replay a trace without an X server, replies from the trace\n");
+    printf("  -h, --help                show this help\n");
+}
+
 int main(int argc, char **argv)
 {
-    printf("Example xcb_selection\n");
+    static const struct option options[] = {
+        { "log-level",      required_argument,  nullptr, 'l' },
+        { "log-timestamps", no_argument,        nullptr, 'T' },
+        { "display",        required_argument,  nullptr, 'd' },
+        { "pipelined",      no_argument,        nullptr, 'p' },
+        { "own",            no_argument,        nullptr, 'o' },
+        { "headless",       no_argument,        nullptr, 'H' },
+        { "text",           required_argument,  nullptr, 't' },
+        { "image",          required_argument,  nullptr, 'i' },
+        { "memfd",          no_argument,        nullptr, 'M' },
+        { "store-limit",    required_argument,  nullptr, 'm' },
+        { "copy",           required_argument,  nullptr, 'c' },
+        { "paste",          no_argument,        nullptr, 'P' },
+        { "type",           required_argument,  nullptr, 'y' },
+        { "workers",        required_argument,  nullptr, 'w' },
+        { "control",        required_argument,  nullptr, 'C' },
+        { "history",        required_argument,  nullptr, 'L' },
+        { "history-limit",  required_argument,  nullptr, 'K' },
+        { "atom-profile",   required_argument,  nullptr, 'A' },
+        { "record",         required_argument,  nullptr, 'r' },
+        { "replay",         required_argument,  nullptr, 'R' },
+        { "replay-stub",    required_argument,  nullptr, 'S' },
+        { "help",           no_argument,        nullptr, 'h' },
+        { nullptr,          0,                  nullptr,  0  },
+    };
+
+    auto level = LogLevel::INFO;
+    const char *record_path = nullptr;
+    const char *replay_path = nullptr;
+    bool replay_stub = false;
+    bool pipelined = false;
+    bool own = false;
+    bool headless = false;
+    size_t worker_count = 0;
+    size_t store_limit = 64;
+    bool memfd = false;
+    const char *copy_path = nullptr;
+    bool paste = false;
+    const char *stream_type = "UTF8_STRING";
+    bool level_set = false;
+    std::vector<const char *> displays = {};
+    const char *text_path = nullptr;
+    const char *image_path = nullptr;
+    const char *atom_profile_path = nullptr;
+    const char *control_path = nullptr;
+    const char *history_path = nullptr;
+    size_t history_limit = ClipboardHistory::DEFAULT_LIMIT / (1024 * 1024);
+    for (int opt; (opt = getopt_long(argc, argv, "l:Td:poHt:i:Mm:c:Py:w:C:L:K:A:r:R:S:h", options, nullptr)) != -1;) {
+        switch (opt) {
+            case 'l':
+                if (!ParseLogLevel(optarg, level)) {
+                    fprintf(stderr, "invalid log level '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                level_set = true;
+                break;
+            case 'T':
+                Log::Get().SetTimestamps(true);
+                break;
+            case 'd':
+                displays.push_back(optarg);
+                break;
+            case 'p':
+                pipelined = true;
+                break;
+            case 'o':
+                own = true;
+                break;
+            case 'H':
+                headless = true;
+                break;
+            case 't':
+                text_path = optarg;
+                break;
+            case 'i':
+                image_path = optarg;
+                break;
+            case 'M':
+                memfd = true;
+                break;
+            case 'm':
+                store_limit = strtoul(optarg, nullptr, 0);
+                break;
+            case 'c':
+                copy_path = optarg;
+                break;
+            case 'P':
+                paste = true;
+                break;
+            case 'y':
+                stream_type = optarg;
+                break;
+            case 'w':
+                worker_count = strtoul(optarg, nullptr, 0);
+                break;
+            case 'C':
+                control_path = optarg;
+                break;
+            case 'L':
+                history_path = optarg;
+                break;
+            case 'K':
+                history_limit = strtoul(optarg, nullptr, 0);
+                break;
+            case 'A':
+                atom_profile_path = optarg;
+                break;
+            case 'r':
+                record_path = optarg;
+                break;
+            case 'R':
+            case 'S':
+                replay_path = optarg;
+                replay_stub = opt == 'S';
+                break;
+            case 'h':
+                Usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                Usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    // pipe modes keep stdout for the content and stay quiet unless asked
+    auto console = stdout;
+    if (copy_path || paste) {
+        console = stderr;
+        Log::Get().SetOutput(stderr, stderr);
+        if (!level_set) {
+            level = LogLevel::WARN;
+        }
+    }
+    Log::Get().SetLevel(level);
+
+    fprintf(console, "Example xcb_selection\n");
+
+    auto configure = [&](Selection &obj) {
+        obj.SetOwnOnStartup(own);
+        obj.SetHeadless(headless);
+        obj.SetWorkers(worker_count);
+        obj.SetStoreLimit(store_limit * 1024 * 1024);
+        if (atom_profile_path) {
+            obj.SetAtomProfile(atom_profile_path);
+        }
+        return obj.SetMemfdHandoff(memfd) && (!control_path || obj.SetControlSocket(control_path)) && (!history_path || obj.SetHistory(history_path, history_limit * 1024 * 1024)) &&
+               (!text_path || obj.SetText(text_path)) && (!image_path || obj.SetImage(image_path));
+    };
+
+    if ((control_path || history_path) && (copy_path || paste || replay_path)) {
+        fprintf(stderr, "--control and --history cannot be combined with --copy, --paste or --replay\n");
+        return EXIT_FAILURE;
+    }
+
+    // one consumer for the whole process, whichever displays come and go
+    Log::Get().Start();
+    auto rc = false;
+    if (displays.size() > 1) {
+        if (copy_path || paste || record_path || replay_path || control_path || history_path) {
+            fprintf(stderr, "--copy, --paste, --control, --history, --record and --replay take a single display\n");
+            return EXIT_FAILURE;
+        }
+        rc = RunMultiDisplay(displays, configure, pipelined);
+        Log::Get().Stop();
+        printf("\n%s..\n", rc ? "Succeed" : "Failed");
+        return rc ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
     auto obj = Selection();
-    if (!obj.Init() || !obj.ShowCase()) {
-        printf("\nFailed..\n");
+    obj.SetDisplay(displays.empty() ? nullptr : displays.front(), 0);
+    if (!configure(obj)) {
+        rc = false;
+    } else if (copy_path && !obj.SetCopyStream(strcmp(copy_path, "-") ? open(copy_path, O_RDONLY) : STDIN_FILENO, stream_type)) {
+        rc = false;
+    } else if (paste && !obj.SetPasteStream(STDOUT_FILENO, stream_type)) {
+        rc = false;
+    } else if (replay_path) {
+        rc = obj.Replay(replay_path, replay_stub);
+    } else {
+        rc = obj.Init(pipelined) && (!record_path || obj.Record(record_path)) && obj.ShowCase();
+    }
+    Log::Get().Stop();
+    if (!replay_path) {
+        obj.SaveAtomProfile(console);
+        obj.PrintMetrics(console);
+        Selection::PrintMemory(console);
+    }
+    if (!rc) {
+        fprintf(console, "\nFailed..\n");
         return EXIT_FAILURE;
     }
-    printf("\nSucceed..\n");
+    fprintf(console, "\nSucceed..\n");
     return EXIT_SUCCESS;
 }
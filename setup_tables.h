@@ -0,0 +1,238 @@
+#pragma once
+#include <cstdint>
+#include <array>
+#include <vector>
+#include <xcb/xcb.h>
+
+/**
+ * Flat screen / visual / pixmap format tables built once from xcb_setup_t
+ *
+ *   The setup is a chain of variable-length records, so finding anything in it is a nested
+ *   linear walk. Parse() walks it once into
+ *     - formats  : indexed by depth, bits_per_pixel and scanline_pad
+ *     - screens  : one entry per root, with its range of visuals
+ *     - visuals  : every visual of every screen, with the shift and width of each channel mask
+ *     - by id    : an open-addressing table from visual id to visual index
+ *     - by class : per screen, [depth][class] to the first matching visual
+ *   so each lookup is a fixed number of array reads.
+ */
+
+class SetupTables
+{
+public:
+    static constexpr uint16_t   NONE            = 0xFFFF;
+    static constexpr size_t     CLASSES         = 6;    // XCB_VISUAL_CLASS_STATIC_GRAY .. DIRECT_COLOR
+
+    struct format_t
+    {
+        uint8_t                 bits_per_pixel  = 0;
+        uint8_t                 scanline_pad    = 0;
+    };
+
+    struct channel_t
+    {
+        uint32_t                mask            = 0;
+        uint8_t                 shift           = 0;
+        uint8_t                 width           = 0;
+    };
+
+    struct visual_t
+    {
+        xcb_visualid_t          id              = 0;
+        uint8_t                 screen          = 0;
+        uint8_t                 depth           = 0;
+        uint8_t                 _class          = 0;
+        uint8_t                 bits_per_rgb    = 0;
+        uint16_t                colormap_entries = 0;
+        channel_t               red             = {};
+        channel_t               green           = {};
+        channel_t               blue            = {};
+    };
+
+    struct screen_t
+    {
+        const xcb_screen_t     *screen          = nullptr;
+        uint16_t                first_visual    = 0;
+        uint16_t                visual_count    = 0;
+        uint16_t                root_visual     = NONE;     // index into Visuals()
+        std::array<std::array<uint16_t, CLASSES>, 256> by_class = {};
+    };
+
+    SetupTables(void)
+    {
+    }
+
+    bool Parse(const xcb_setup_t *setup)
+    {
+        formats = {};
+        screens.clear();
+        visuals.clear();
+
+        for (auto iter = xcb_setup_pixmap_formats_iterator(setup); iter.rem; xcb_format_next(&iter)) {
+            auto &format = formats[iter.data->depth];
+            format.bits_per_pixel = iter.data->bits_per_pixel;
+            format.scanline_pad   = iter.data->scanline_pad;
+        }
+
+        for (auto screen_iter = xcb_setup_roots_iterator(setup); screen_iter.rem; xcb_screen_next(&screen_iter)) {
+            screen_t screen = {};
+            screen.screen       = screen_iter.data;
+            screen.first_visual = static_cast<uint16_t>(visuals.size());
+            for (auto &row : screen.by_class) {
+                row.fill(NONE);
+            }
+
+            for (auto depth_iter = xcb_screen_allowed_depths_iterator(screen_iter.data); depth_iter.rem; xcb_depth_next(&depth_iter)) {
+                for (auto iter = xcb_depth_visuals_iterator(depth_iter.data); iter.rem; xcb_visualtype_next(&iter)) {
+                    auto data = iter.data;
+                    visual_t visual = {};
+                    visual.id               = data->visual_id;
+                    visual.screen           = static_cast<uint8_t>(screens.size());
+                    visual.depth            = depth_iter.data->depth;
+                    visual._class           = data->_class;
+                    visual.bits_per_rgb     = data->bits_per_rgb_value;
+                    visual.colormap_entries = data->colormap_entries;
+                    visual.red              = Channel(data->red_mask);
+                    visual.green            = Channel(data->green_mask);
+                    visual.blue             = Channel(data->blue_mask);
+
+                    auto index = static_cast<uint16_t>(visuals.size());
+                    if (visual._class < CLASSES && screen.by_class[visual.depth][visual._class] == NONE) {
+                        screen.by_class[visual.depth][visual._class] = index;
+                    }
+                    if (visual.id == screen_iter.data->root_visual) {
+                        screen.root_visual = index;
+                    }
+                    visuals.push_back(visual);
+                }
+            }
+            screen.visual_count = static_cast<uint16_t>(visuals.size() - screen.first_visual);
+            screens.push_back(screen);
+        }
+
+        BuildIndex();
+        return !screens.empty();
+    }
+
+    const std::vector<screen_t> &Screens(void) const
+    {
+        return screens;
+    }
+
+    const std::vector<visual_t> &Visuals(void) const
+    {
+        return visuals;
+    }
+
+    // nullptr if no pixmap format exists for 'depth'
+    const format_t *Format(uint8_t depth) const
+    {
+        auto &format = formats[depth];
+        return format.bits_per_pixel ? &format : nullptr;
+    }
+
+    // bytes per line of a ZPixmap image of 'width' pixels; 0 if there is no format for 'depth'
+    uint32_t Stride(uint8_t depth, uint32_t width) const
+    {
+        auto &format = formats[depth];
+        if (!format.bits_per_pixel) {
+            return 0;
+        }
+        uint32_t pad = format.scanline_pad;
+        return (width * format.bits_per_pixel + pad - 1) / pad * pad / 8;
+    }
+
+    const visual_t *Visual(xcb_visualid_t id) const
+    {
+        if (index.empty()) {
+            return nullptr;
+        }
+        for (auto slot = Hash(id) & (index.size() - 1);; slot = (slot + 1) & (index.size() - 1)) {
+            auto &entry = index[slot];
+            if (entry.visual == NONE) {
+                return nullptr;
+            }
+            if (entry.id == id) {
+                return &visuals[entry.visual];
+            }
+        }
+    }
+
+    // the first visual of 'screen' with this depth and class, as the server listed them
+    const visual_t *Visual(size_t screen, uint8_t depth, uint8_t _class) const
+    {
+        if (screen >= screens.size() || _class >= CLASSES) {
+            return nullptr;
+        }
+        auto visual = screens[screen].by_class[depth][_class];
+        return visual == NONE ? nullptr : &visuals[visual];
+    }
+
+    const visual_t *RootVisual(size_t screen) const
+    {
+        if (screen >= screens.size() || screens[screen].root_visual == NONE) {
+            return nullptr;
+        }
+        return &visuals[screens[screen].root_visual];
+    }
+
+    // places 8-bit r, g, b in a pixel of a TrueColor / DirectColor visual
+    static uint32_t Pixel(const visual_t &visual, uint8_t r, uint8_t g, uint8_t b)
+    {
+        return Scale(visual.red, r) | Scale(visual.green, g) | Scale(visual.blue, b);
+    }
+
+private:
+    struct index_t
+    {
+        xcb_visualid_t          id              = 0;
+        uint16_t                visual          = NONE;
+    };
+
+    static channel_t Channel(uint32_t mask)
+    {
+        channel_t channel = {};
+        channel.mask  = mask;
+        channel.shift = mask ? static_cast<uint8_t>(__builtin_ctz(mask)) : 0;
+        channel.width = static_cast<uint8_t>(__builtin_popcount(mask));
+        return channel;
+    }
+
+    static uint32_t Scale(const channel_t &channel, uint8_t value)
+    {
+        if (!channel.width) {
+            return 0;
+        }
+        uint32_t v = channel.width >= 8 ? static_cast<uint32_t>(value) << (channel.width - 8) : value >> (8 - channel.width);
+        return (v << channel.shift) & channel.mask;
+    }
+
+    static uint32_t Hash(xcb_visualid_t id)
+    {
+        return id * 0x9E3779B1u >> 7;
+    }
+
+    // at most half full, so a probe sequence stays short
+    void BuildIndex(void)
+    {
+        size_t size = 16;
+        while (size < visuals.size() * 2) {
+            size <<= 1;
+        }
+        index.assign(size, index_t{});
+        for (size_t i = 0; i < visuals.size(); i++) {
+            auto slot = Hash(visuals[i].id) & (size - 1);
+            while (index[slot].visual != NONE && index[slot].id != visuals[i].id) {
+                slot = (slot + 1) & (size - 1);
+            }
+            if (index[slot].visual == NONE) {
+                index[slot] = {visuals[i].id, static_cast<uint16_t>(i)};
+            }
+        }
+    }
+
+    std::array<format_t, 256>                   formats     = {};
+    std::vector<screen_t>                       screens     = {};
+    std::vector<visual_t>                       visuals     = {};
+    std::vector<index_t>                        index       = {};
+};
@@ -3,9 +3,11 @@
 #include <cstdlib>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <unistd.h>
 #include <xcb/xcb.h>
+#include "event_dispatch.h"
 
 constexpr int32_t   INVALID_FD      = -1;
 static int          signal_pipe[2]  = {INVALID_FD, INVALID_FD};
@@ -73,12 +75,28 @@ public:
         return true;
     }
 
+    // sleeps in poll() on the signal pipe and the X connection
     bool RunEventLoop(void)
     {
         printf("\n * Run event loop\n");
         xcb_flush(connection);
 
         while (true) {
+            auto rc = xcb_connection_has_error(connection);
+            if (rc) {
+                fprintf(stderr, "xcb_connection_has_error() - %d\n", rc);
+                return false;
+            }
+
+            struct pollfd fds[] = {
+                {signal_pipe[0], POLLIN, 0},
+                {xcb_get_file_descriptor(connection), POLLIN, 0},
+            };
+            if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+                fprintf(stderr, "poll() failed\n");
+                return false;
+            }
+
             auto signum = 0;
             auto bytes = read(signal_pipe[0], &signum, sizeof(int));
             if (bytes == -1) {
@@ -90,20 +108,30 @@ public:
                 return true;
             }
 
-            auto rc = xcb_connection_has_error(connection);
-            if (rc) {
-                fprintf(stderr, "xcb_connection_has_error() - %d\n", rc);
-                return false;
-            }
-
-            auto event = xcb_poll_for_event(connection);
-            if (event) {
+            while (auto event = xcb_poll_for_event(connection)) {
+                auto rc = dispatcher.Dispatch(*this, event);
                 free(event);
+                if (!rc) {
+                    return false;
+                }
             }
         }
         return true;
     }
 
+    bool ProcError(xcb_generic_error_t *error)
+    {
+        fprintf(stderr, " - X error: seq: %u, code: %u, major: %u, minor: %u\n",
+            error->sequence, error->error_code, error->major_code, error->minor_code);
+        return true;
+    }
+
+    bool ProcMappingNotify(xcb_mapping_notify_event_t *event)
+    {
+        printf(" - XCB_MAPPING_NOTIFY: request: %u, first_keycode: %u, count: %u\n", event->request, event->first_keycode, event->count);
+        return true;
+    }
+
     static void OnSignal(int signum)
     {
         while (true) {
@@ -119,8 +147,13 @@ public:
     }
 
 private:
+    using dispatcher_t = EventDispatcher<Signal,
+        On<&Signal::ProcError>,
+        On<&Signal::ProcMappingNotify>>;
+
     int                 screen_num      = 0;
     xcb_connection_t   *connection      = nullptr;
+    dispatcher_t        dispatcher      = {};
 };
 
 
@@ -0,0 +1,161 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <utility>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/**
+ * Multi-producer, single-consumer task queue with an eventfd to wake the consumer's poll()
+ *
+ *   - Post() is lock-free from any thread: a CAS push onto a stack. Only the post that finds
+ *     the stack empty writes the eventfd, so a burst costs one syscall, not one per task
+ *   - the consumer polls Fd() with its other sources and calls Wakeup() when it is readable,
+ *     which clears the eventfd, takes the whole stack with one exchange and runs it in posting
+ *     order; tasks posted meanwhile wait for the next wakeup
+ *   - Drain() does the same without the syscall, for a loop that is awake anyway; the eventfd
+ *     it leaves set costs at most one empty wakeup
+ *   - tasks run on the consumer thread, so they may touch its state without locks
+ *   - the eventfd is created with the queue; its owner checks Fd() at startup and fails there,
+ *     since poll() skips a negative fd and the consumer would never wake
+ */
+
+class TaskQueue
+{
+public:
+    struct stats_t
+    {
+        uint64_t                posted          = 0;
+        uint64_t                run             = 0;
+        uint64_t                wakeups         = 0;    // eventfd writes
+        uint64_t                batches         = 0;    // Drain() calls that ran something
+    };
+
+    TaskQueue(void)
+    {
+        fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0) {
+            error = errno;
+        }
+    }
+
+    // tasks never drained are dropped without running; what they would touch may be gone
+    ~TaskQueue(void)
+    {
+        auto node = stack.exchange(nullptr, std::memory_order_acquire);
+        while (node) {
+            auto next = node->next;
+            delete node;
+            node = next;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    TaskQueue(const TaskQueue &) = delete;
+    TaskQueue &operator=(const TaskQueue &) = delete;
+
+    // -1 if the eventfd could not be created
+    int Fd(void) const
+    {
+        return fd;
+    }
+
+    // errno of the failed eventfd(), 0 if Fd() is valid
+    int Error(void) const
+    {
+        return error;
+    }
+
+    void Post(std::function<void()> task)
+    {
+        auto node = new node_t{nullptr, std::move(task)};
+        auto head = stack.load(std::memory_order_relaxed);
+        do {
+            node->next = head;
+        } while (!stack.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+        posted.fetch_add(1, std::memory_order_relaxed);
+
+        if (!head) {
+            uint64_t one = 1;
+            while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+            }
+            wakeups.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // consumer only, after poll() reported Fd() readable; returns how many tasks ran
+    size_t Wakeup(void)
+    {
+        // cleared before the exchange: a post after it finds the stack empty and writes again
+        uint64_t count = 0;
+        while (read(fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+        }
+        return Drain();
+    }
+
+    // consumer only; returns how many tasks ran
+    size_t Drain(void)
+    {
+        if (!stack.load(std::memory_order_relaxed)) {
+            return 0;
+        }
+        auto node = stack.exchange(nullptr, std::memory_order_acquire);
+        if (!node) {
+            return 0;
+        }
+        node_t *fifo = nullptr;
+        while (node) {
+            auto next = node->next;
+            node->next = fifo;
+            fifo = node;
+            node = next;
+        }
+
+        size_t done = 0;
+        while (fifo) {
+            auto next = fifo->next;
+            fifo->task();
+            delete fifo;
+            fifo = next;
+            done++;
+        }
+        run += done;
+        batches++;
+        return done;
+    }
+
+    bool Empty(void) const
+    {
+        return !stack.load(std::memory_order_acquire);
+    }
+
+    // consumer only
+    stats_t Stats(void) const
+    {
+        stats_t stats = {};
+        stats.posted  = posted.load(std::memory_order_relaxed);
+        stats.run     = run;
+        stats.wakeups = wakeups.load(std::memory_order_relaxed);
+        stats.batches = batches;
+        return stats;
+    }
+
+private:
+    struct node_t
+    {
+        node_t                 *next;
+        std::function<void()>   task;
+    };
+
+    int                                     fd              = -1;
+    int                                     error           = 0;
+    std::atomic<node_t *>                   stack           = nullptr;
+    std::atomic<uint64_t>                   posted          = 0;
+    std::atomic<uint64_t>                   wakeups         = 0;
+    uint64_t                                run             = 0;
+    uint64_t                                batches         = 0;
+};
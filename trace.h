@@ -0,0 +1,255 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <xcb/xcb.h>
+
+/**
+ * Event stream trace
+ *
+ *   file   : header_t, then records back to back
+ *   record : record_t followed by 'length' payload bytes, padded to 4
+ *
+ *   - EVENT : the xcb_generic_event_t as returned by xcb_poll_for_event() (36 bytes for core events)
+ *   - REPLY : a reply as returned by xcb_*_reply() (32 + 4 * length bytes), empty if the reply failed
+ *   - ATOM  : an atom the client learned, u32 atom followed by the name
+ *
+ *   Replies are attributed to the closest preceding EVENT; a replayer hands them back in order
+ *   while that event is being handled. Atom lookups are recorded as ATOM, not REPLY, so that a
+ *   replayer can preload its atom cache without disturbing the reply order.
+ */
+
+class Trace
+{
+public:
+    static constexpr char       MAGIC[8]    = {'X', 'C', 'B', 'T', 'R', 'A', 'C', 'E'};
+    static constexpr uint32_t   VERSION     = 1;
+
+    enum kind_t : uint8_t
+    {
+        EVENT   = 1,
+        REPLY   = 2,
+        ATOM    = 3,
+    };
+
+    struct header_t
+    {
+        char                    magic[8]    = {};
+        uint32_t                version     = 0;
+        uint32_t                root        = 0;
+        uint32_t                window      = 0;
+        uint32_t                reserved    = 0;
+    };
+
+    struct record_t
+    {
+        uint8_t                 kind        = 0;
+        uint8_t                 pad[3]      = {};
+        uint32_t                length      = 0;
+        int64_t                 timestamp   = 0;
+    };
+
+    struct entry_t
+    {
+        kind_t                  kind        = EVENT;
+        int64_t                 timestamp   = 0;
+        std::vector<uint8_t>    payload     = {};
+    };
+};
+
+class TraceWriter
+{
+public:
+    TraceWriter(void)
+    {
+    }
+
+    ~TraceWriter(void)
+    {
+        Close();
+    }
+
+    bool Open(const char *path, xcb_window_t root, xcb_window_t window)
+    {
+        file = fopen(path, "wb");
+        if (!file) {
+            return false;
+        }
+        // full buffering: a record is a single small fwrite on the event thread
+        setvbuf(file, nullptr, _IOFBF, 1 << 20);
+
+        Trace::header_t header = {};
+        memcpy(header.magic, Trace::MAGIC, sizeof(header.magic));
+        header.version = Trace::VERSION;
+        header.root    = root;
+        header.window  = window;
+        start = std::chrono::steady_clock::now();
+        return fwrite(&header, sizeof(header), 1, file) == 1;
+    }
+
+    void Close(void)
+    {
+        if (file) {
+            fclose(file);
+            file = nullptr;
+        }
+    }
+
+    bool IsOpen(void) const
+    {
+        return file != nullptr;
+    }
+
+    void Event(const xcb_generic_event_t *event)
+    {
+        uint32_t length = sizeof(xcb_generic_event_t);
+        if ((event->response_type & ~0x80) == XCB_GE_GENERIC) {
+            length += reinterpret_cast<const xcb_ge_generic_event_t *>(event)->length * 4;
+        }
+        Write(Trace::EVENT, event, length);
+    }
+
+    void Reply(const void *reply)
+    {
+        uint32_t length = 0;
+        if (reply) {
+            length = 32 + reinterpret_cast<const xcb_generic_reply_t *>(reply)->length * 4;
+        }
+        Write(Trace::REPLY, reply, length);
+    }
+
+    void Atom(xcb_atom_t atom, const char *name, size_t len)
+    {
+        uint8_t buf[4 + 256];
+        len = std::min(len, sizeof(buf) - 4);
+        memcpy(buf, &atom, 4);
+        memcpy(buf + 4, name, len);
+        Write(Trace::ATOM, buf, 4 + len);
+    }
+
+private:
+    void Write(Trace::kind_t kind, const void *data, uint32_t length)
+    {
+        if (!file) {
+            return;
+        }
+        static const uint8_t zero[4] = {};
+        Trace::record_t record = {};
+        record.kind      = kind;
+        record.length    = length;
+        record.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        fwrite(&record, sizeof(record), 1, file);
+        if (length) {
+            fwrite(data, 1, length, file);
+            fwrite(zero, 1, (4 - length % 4) % 4, file);
+        }
+    }
+
+    FILE                                       *file        = nullptr;
+    std::chrono::steady_clock::time_point       start       = {};
+};
+
+class TraceReader
+{
+public:
+    TraceReader(void)
+    {
+    }
+
+    bool Open(const char *path)
+    {
+        auto file = fopen(path, "rb");
+        if (!file) {
+            return false;
+        }
+
+        auto rc = fread(&header, sizeof(header), 1, file) == 1 &&
+                  !memcmp(header.magic, Trace::MAGIC, sizeof(header.magic)) &&
+                  header.version == Trace::VERSION;
+
+        // a length is trusted only as far as the file goes, so a corrupt one cannot size a huge payload
+        struct stat st = {};
+        rc = rc && fstat(fileno(file), &st) == 0;
+        uint64_t left = rc ? st.st_size - sizeof(header) : 0;
+
+        Trace::record_t record = {};
+        while (rc && fread(&record, sizeof(record), 1, file) == 1) {
+            uint64_t padded = (uint64_t{record.length} + 3) & ~uint64_t{3};
+            left -= std::min<uint64_t>(left, sizeof(record));
+            if (padded > left) {
+                rc = false;
+                break;
+            }
+            left -= padded;
+
+            Trace::entry_t entry = {};
+            entry.kind      = static_cast<Trace::kind_t>(record.kind);
+            entry.timestamp = record.timestamp;
+            entry.payload.resize(padded);
+            if (entry.payload.size() && fread(entry.payload.data(), entry.payload.size(), 1, file) != 1) {
+                rc = false;
+                break;
+            }
+            entry.payload.resize(record.length);
+            entries.push_back(std::move(entry));
+        }
+        fclose(file);
+        return rc;
+    }
+
+    const Trace::header_t &Header(void) const
+    {
+        return header;
+    }
+
+    const std::vector<Trace::entry_t> &Entries(void) const
+    {
+        return entries;
+    }
+
+    // positions the reply cursor right after the event at 'index'
+    void BeginEvent(size_t index)
+    {
+        reply_cursor = index + 1;
+    }
+
+    // returns a malloc()ed copy of the next reply recorded for the current event, like xcb_*_reply()
+    void *NextReply(void)
+    {
+        while (reply_cursor < entries.size()) {
+            auto &entry = entries[reply_cursor];
+            if (entry.kind == Trace::EVENT) {
+                break;
+            }
+            reply_cursor++;
+            if (entry.kind != Trace::REPLY) {
+                continue;
+            }
+            if (entry.payload.empty()) {
+                return nullptr;
+            }
+            auto reply = malloc(entry.payload.size());
+            memcpy(reply, entry.payload.data(), entry.payload.size());
+            return reply;
+        }
+        missing_replies++;
+        return nullptr;
+    }
+
+    uint64_t MissingReplies(void) const
+    {
+        return missing_replies;
+    }
+
+private:
+    Trace::header_t                             header          = {};
+    std::vector<Trace::entry_t>                 entries         = {};
+    size_t                                      reply_cursor    = 0;
+    uint64_t                                    missing_replies = 0;
+};
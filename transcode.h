@@ -0,0 +1,300 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <iconv.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Text transcoding from one canonical UTF-8 buffer
+ *
+ *   - ASCII runs are found 32 (AVX2) or 16 (SSE2) bytes at a time, with a 64-bit scalar fallback,
+ *     and copied with memcpy; only the remaining multi-byte sequences are decoded one by one
+ *   - ISO8859-n tables are built once per part from the system iconv: the 96 code points of
+ *     0xA0..0xFF are decoded and kept sorted for a binary search from code point to byte
+ *   - part 1 (Latin-1) needs no table, and 0x80..0x9F map to U+0080..U+009F for every part
+ *
+ *   Code points a charset cannot represent are replaced by '?'.
+ */
+
+class Transcoder
+{
+public:
+    static constexpr int    UTF8            = 0;
+    static constexpr int    MAX_PART        = 16;
+
+    static Transcoder &Get(void)
+    {
+        static Transcoder transcoder;
+        return transcoder;
+    }
+
+    // length of the leading run of bytes below 0x80
+    static size_t AsciiPrefix(const uint8_t *data, size_t len)
+    {
+        static const auto impl = SelectAsciiPrefix();
+        return impl(data, len);
+    }
+
+    static bool ValidateUtf8(const uint8_t *data, size_t len)
+    {
+        size_t i = 0;
+        while (i < len) {
+            i += AsciiPrefix(data + i, len - i);
+            if (i == len) {
+                break;
+            }
+            uint32_t cp = 0;
+            auto n = DecodeUtf8(data + i, len - i, cp);
+            if (!n) {
+                return false;
+            }
+            i += n;
+        }
+        return true;
+    }
+
+    // Latin-1 is the only legacy input we accept, since every byte string is valid Latin-1
+    static std::string Latin1ToUtf8(const uint8_t *data, size_t len)
+    {
+        std::string out(len * 2, '\0');
+        size_t i = 0;
+        size_t o = 0;
+        while (i < len) {
+            auto ascii = AsciiPrefix(data + i, len - i);
+            memcpy(&out[o], data + i, ascii);
+            i += ascii;
+            o += ascii;
+            if (i == len) {
+                break;
+            }
+            out[o++] = static_cast<char>(0xC0 | (data[i] >> 6));
+            out[o++] = static_cast<char>(0x80 | (data[i] & 0x3F));
+            i++;
+        }
+        out.resize(o);
+        return out;
+    }
+
+    // false if the part has no table (e.g. ISO8859-12, which was never published)
+    bool Supported(int part)
+    {
+        return part == UTF8 || part == 1 || Table(part) != nullptr;
+    }
+
+    // 'utf8' must be valid UTF-8
+    bool Encode(const std::string &utf8, int part, std::string &out)
+    {
+        if (part == UTF8) {
+            out = utf8;
+            return true;
+        }
+
+        const table_t *table = part == 1 ? nullptr : Table(part);
+        if (part != 1 && !table) {
+            return false;
+        }
+
+        auto data = reinterpret_cast<const uint8_t *>(utf8.data());
+        auto len = utf8.size();
+        out.resize(len);
+
+        size_t i = 0;
+        size_t o = 0;
+        while (i < len) {
+            auto ascii = AsciiPrefix(data + i, len - i);
+            memcpy(&out[o], data + i, ascii);
+            i += ascii;
+            o += ascii;
+            if (i == len) {
+                break;
+            }
+
+            uint32_t cp = 0;
+            auto n = DecodeUtf8(data + i, len - i, cp);
+            i += n ? n : 1;
+            out[o++] = static_cast<char>(Map(table, cp));
+        }
+        out.resize(o);
+        return true;
+    }
+
+    // returns the number of bytes consumed, 0 for an invalid or truncated sequence
+    static size_t DecodeUtf8(const uint8_t *p, size_t len, uint32_t &cp)
+    {
+        auto c = p[0];
+        if (c < 0x80) {
+            cp = c;
+            return 1;
+        }
+
+        size_t n = 0;
+        uint32_t min = 0;
+        if ((c & 0xE0) == 0xC0) {
+            n = 2;
+            cp = c & 0x1F;
+            min = 0x80;
+        } else if ((c & 0xF0) == 0xE0) {
+            n = 3;
+            cp = c & 0x0F;
+            min = 0x800;
+        } else if ((c & 0xF8) == 0xF0) {
+            n = 4;
+            cp = c & 0x07;
+            min = 0x10000;
+        } else {
+            return 0;
+        }
+        if (len < n) {
+            return 0;
+        }
+        for (size_t k = 1; k < n; k++) {
+            if ((p[k] & 0xC0) != 0x80) {
+                return 0;
+            }
+            cp = (cp << 6) | (p[k] & 0x3F);
+        }
+        if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+            return 0;
+        }
+        return n;
+    }
+
+private:
+    // sorted (code point, byte) pairs for 0xA0..0xFF
+    using table_t = std::vector<std::pair<uint32_t, uint8_t>>;
+    using ascii_prefix_t = size_t (*)(const uint8_t *, size_t);
+
+    Transcoder(void)
+    {
+    }
+
+    static uint8_t Map(const table_t *table, uint32_t cp)
+    {
+        if (cp < 0xA0) {
+            return static_cast<uint8_t>(cp);
+        }
+        if (!table) {
+            return cp <= 0xFF ? static_cast<uint8_t>(cp) : '?';
+        }
+        auto iter = std::lower_bound(table->begin(), table->end(), std::make_pair(cp, static_cast<uint8_t>(0)));
+        return iter != table->end() && iter->first == cp ? iter->second : '?';
+    }
+
+    const table_t *Table(int part)
+    {
+        if (part < 2 || part > MAX_PART) {
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        auto &slot = tables[part];
+        if (!slot.built) {
+            slot.built = true;
+            slot.valid = BuildTable(part, slot.table);
+        }
+        return slot.valid ? &slot.table : nullptr;
+    }
+
+    static bool BuildTable(int part, table_t &table)
+    {
+        auto charset = "ISO-8859-" + std::to_string(part);
+        auto cd = iconv_open("UTF-32LE", charset.c_str());
+        if (cd == reinterpret_cast<iconv_t>(-1)) {
+            return false;
+        }
+
+        for (int byte = 0xA0; byte <= 0xFF; byte++) {
+            char in = static_cast<char>(byte);
+            uint32_t cp = 0;
+            char *in_ptr = &in;
+            char *out_ptr = reinterpret_cast<char *>(&cp);
+            size_t in_left = 1;
+            size_t out_left = sizeof(cp);
+            // bytes left undefined by a part (e.g. 0xA1 in ISO8859-6) just have no entry
+            if (iconv(cd, &in_ptr, &in_left, &out_ptr, &out_left) != static_cast<size_t>(-1) && !out_left) {
+                table.emplace_back(cp, static_cast<uint8_t>(byte));
+            }
+            iconv(cd, nullptr, nullptr, nullptr, nullptr);
+        }
+        iconv_close(cd);
+
+        std::sort(table.begin(), table.end());
+        return !table.empty();
+    }
+
+    static size_t AsciiPrefixScalar(const uint8_t *data, size_t len)
+    {
+        size_t i = 0;
+        for (; i + 8 <= len; i += 8) {
+            uint64_t word = 0;
+            memcpy(&word, data + i, 8);
+            if (word & 0x8080808080808080ULL) {
+                break;
+            }
+        }
+        while (i < len && data[i] < 0x80) {
+            i++;
+        }
+        return i;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("sse2")))
+    static size_t AsciiPrefixSse2(const uint8_t *data, size_t len)
+    {
+        size_t i = 0;
+        for (; i + 16 <= len; i += 16) {
+            auto mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)));
+            if (mask) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+        return i + AsciiPrefixScalar(data + i, len - i);
+    }
+
+    __attribute__((target("avx2")))
+    static size_t AsciiPrefixAvx2(const uint8_t *data, size_t len)
+    {
+        size_t i = 0;
+        for (; i + 32 <= len; i += 32) {
+            auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i))));
+            if (mask) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+        return i + AsciiPrefixSse2(data + i, len - i);
+    }
+#endif
+
+    static ascii_prefix_t SelectAsciiPrefix(void)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return AsciiPrefixAvx2;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return AsciiPrefixSse2;
+        }
+#endif
+        return AsciiPrefixScalar;
+    }
+
+    struct slot_t
+    {
+        bool            built   = false;
+        bool            valid   = false;
+        table_t         table   = {};
+    };
+
+    std::mutex                              lock        = {};
+    std::array<slot_t, MAX_PART + 1>        tables      = {};
+};
@@ -0,0 +1,87 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed-size thread pool
+ *
+ *   Jobs run in FIFO order on whichever worker is free; callers that need ordering between
+ *   jobs must not post the next one before the previous one has completed.
+ */
+
+class WorkerPool
+{
+public:
+    WorkerPool(void)
+    {
+    }
+
+    ~WorkerPool(void)
+    {
+        Stop();
+    }
+
+    bool Start(size_t count)
+    {
+        for (size_t i = 0; i < count; i++) {
+            workers.emplace_back([this] { Run(); });
+        }
+        return true;
+    }
+
+    // lets queued jobs finish, then joins every worker
+    void Stop(void)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            running = false;
+        }
+        cond.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+    }
+
+    size_t Size(void) const
+    {
+        return workers.size();
+    }
+
+    void Post(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            jobs.push_back(std::move(job));
+        }
+        cond.notify_one();
+    }
+
+private:
+    void Run(void)
+    {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                cond.wait(guard, [this] { return !jobs.empty() || !running; });
+                if (jobs.empty()) {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::mutex                              lock        = {};
+    std::condition_variable                 cond        = {};
+    std::deque<std::function<void()>>       jobs        = {};
+    std::vector<std::thread>                workers     = {};
+    bool                                    running     = true;
+};
@@ -0,0 +1,347 @@
+#pragma once
+#include <cstdlib>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <utility>
+#include <vector>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+
+/**
+ * C++20 coroutine awaitables for xcb cookies
+ *
+ *   A request is sent when its awaiter is created, and co_await only waits for the reply, so
+ *
+ *       auto a = replies.Send(xcb_get_selection_owner(connection, XCB_ATOM_PRIMARY));
+ *       auto b = replies.Send(xcb_get_selection_owner(connection, XCB_ATOM_SECONDARY));
+ *       auto owner_a = co_await a;
+ *       auto owner_b = co_await b;
+ *
+ *   keeps both requests in flight. The event loop calls ReplyScheduler::Poll() once per
+ *   iteration; it resumes every coroutine whose reply has arrived. Replies are malloc()ed
+ *   exactly like xcb_*_reply() results and must be free()d by the caller.
+ */
+
+template <typename T = bool>
+class Task
+{
+public:
+    struct promise_type
+    {
+        T                           value           = {};
+        std::coroutine_handle<>     continuation    = {};
+
+        Task get_return_object(void)
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        // eager: a task runs up to its first co_await when it is called
+        std::suspend_never initial_suspend(void) noexcept
+        {
+            return {};
+        }
+
+        struct final_awaiter
+        {
+            bool await_ready(void) noexcept
+            {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+            {
+                auto continuation = handle.promise().continuation;
+                return continuation ? continuation : std::noop_coroutine();
+            }
+
+            void await_resume(void) noexcept
+            {
+            }
+        };
+
+        final_awaiter final_suspend(void) noexcept
+        {
+            return {};
+        }
+
+        void return_value(T value)
+        {
+            this->value = std::move(value);
+        }
+
+        void unhandled_exception(void)
+        {
+            std::terminate();
+        }
+    };
+
+    Task(void)
+    {
+    }
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle)
+    {
+    }
+
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, {}))
+    {
+    }
+
+    Task &operator=(Task &&other) noexcept
+    {
+        if (this != &other) {
+            Reset();
+            handle = std::exchange(other.handle, {});
+        }
+        return *this;
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    ~Task(void)
+    {
+        Reset();
+    }
+
+    explicit operator bool(void) const
+    {
+        return static_cast<bool>(handle);
+    }
+
+    bool Done(void) const
+    {
+        return handle && handle.done();
+    }
+
+    T &Result(void)
+    {
+        return handle.promise().value;
+    }
+
+    // destroying a suspended task also destroys its awaiters, which discard their replies
+    void Reset(void)
+    {
+        if (handle) {
+            handle.destroy();
+            handle = {};
+        }
+    }
+
+    bool await_ready(void) const noexcept
+    {
+        return handle.done();
+    }
+
+    void await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        handle.promise().continuation = awaiting;
+    }
+
+    T await_resume(void)
+    {
+        return std::move(handle.promise().value);
+    }
+
+private:
+    std::coroutine_handle<promise_type>     handle  = {};
+};
+
+class ReplyScheduler;
+
+class ReplyAwaiterBase
+{
+protected:
+    friend class ReplyScheduler;
+
+    ReplyScheduler                 *scheduler   = nullptr;
+    unsigned int                    sequence    = 0;
+    void                           *reply       = nullptr;
+    xcb_generic_error_t            *error       = nullptr;
+    std::coroutine_handle<>         waiting     = {};
+    bool                            completed   = false;
+    bool                            consumed    = false;
+};
+
+class ReplyScheduler
+{
+public:
+    using ReplyHook = std::function<void(const void *reply)>;
+
+    ReplyScheduler(void)
+    {
+    }
+
+    ~ReplyScheduler(void)
+    {
+        for (auto awaiter : pending) {
+            awaiter->scheduler = nullptr;
+        }
+    }
+
+    void SetConnection(xcb_connection_t *connection)
+    {
+        this->connection = connection;
+    }
+
+    xcb_connection_t *Connection(void) const
+    {
+        return connection;
+    }
+
+    // called with every reply (or nullptr for an error) before the waiting coroutine resumes
+    void SetReplyHook(ReplyHook hook)
+    {
+        this->hook = std::move(hook);
+    }
+
+    template <typename Cookie>
+    auto Send(Cookie cookie);
+
+    size_t Pending(void) const
+    {
+        return pending.size();
+    }
+
+    // resumes every coroutine whose reply is available; returns how many were resumed
+    size_t Poll(void)
+    {
+        if (pending.empty()) {
+            return 0;
+        }
+        xcb_flush(connection);
+
+        // a resumed coroutine may add or destroy awaiters, so rescan after each resume
+        size_t resumed = 0;
+        for (size_t i = 0; i < pending.size();) {
+            auto awaiter = pending[i];
+            if (!Complete(awaiter)) {
+                i++;
+                continue;
+            }
+            pending.erase(pending.begin() + i);
+            awaiter->waiting.resume();
+            resumed++;
+            i = 0;
+        }
+        return resumed;
+    }
+
+    bool Complete(ReplyAwaiterBase *awaiter)
+    {
+        if (awaiter->completed) {
+            return true;
+        }
+        if (!xcb_poll_for_reply(connection, awaiter->sequence, &awaiter->reply, &awaiter->error)) {
+            return false;
+        }
+        awaiter->completed = true;
+        if (hook) {
+            hook(awaiter->reply);
+        }
+        return true;
+    }
+
+    void Register(ReplyAwaiterBase *awaiter)
+    {
+        pending.push_back(awaiter);
+    }
+
+    void Unregister(ReplyAwaiterBase *awaiter)
+    {
+        for (auto iter = pending.begin(); iter != pending.end(); iter++) {
+            if (*iter == awaiter) {
+                pending.erase(iter);
+                break;
+            }
+        }
+    }
+
+private:
+    xcb_connection_t                   *connection  = nullptr;
+    std::vector<ReplyAwaiterBase *>     pending     = {};
+    ReplyHook                           hook        = {};
+};
+
+template <typename Reply>
+class ReplyAwaiter : public ReplyAwaiterBase
+{
+public:
+    ReplyAwaiter(ReplyScheduler *scheduler, unsigned int sequence)
+    {
+        this->scheduler = scheduler;
+        this->sequence  = sequence;
+    }
+
+    ReplyAwaiter(const ReplyAwaiter &) = delete;
+    ReplyAwaiter &operator=(const ReplyAwaiter &) = delete;
+
+    ~ReplyAwaiter(void)
+    {
+        if (!scheduler) {
+            return;
+        }
+        if (waiting) {
+            scheduler->Unregister(this);
+        }
+        if (!completed) {
+            xcb_discard_reply(scheduler->Connection(), sequence);
+        } else if (!consumed) {
+            free(reply);
+        }
+        free(error);
+    }
+
+    bool await_ready(void)
+    {
+        return scheduler->Complete(this);
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        waiting = handle;
+        scheduler->Register(this);
+    }
+
+    // nullptr if the request failed; the error code is kept in Error()
+    Reply *await_resume(void)
+    {
+        waiting  = {};
+        consumed = true;
+        return static_cast<Reply *>(reply);
+    }
+
+    const xcb_generic_error_t *Error(void) const
+    {
+        return error;
+    }
+};
+
+// the reply type is deduced from the cookie, e.g. xcb_intern_atom_cookie_t -> xcb_intern_atom_reply_t
+template <typename Cookie>
+struct cookie_reply_t;
+
+#define XCB_CORO_COOKIE(NAME)                                       \
+    template <>                                                     \
+    struct cookie_reply_t<xcb_##NAME##_cookie_t>                    \
+    {                                                               \
+        using type = xcb_##NAME##_reply_t;                          \
+    }
+
+XCB_CORO_COOKIE(intern_atom);
+XCB_CORO_COOKIE(get_atom_name);
+XCB_CORO_COOKIE(get_property);
+XCB_CORO_COOKIE(get_selection_owner);
+XCB_CORO_COOKIE(get_input_focus);
+XCB_CORO_COOKIE(get_geometry);
+XCB_CORO_COOKIE(get_window_attributes);
+XCB_CORO_COOKIE(query_tree);
+#undef XCB_CORO_COOKIE
+
+template <typename Cookie>
+auto ReplyScheduler::Send(Cookie cookie)
+{
+    return ReplyAwaiter<typename cookie_reply_t<Cookie>::type>(this, cookie.sequence);
+}